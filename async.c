@@ -0,0 +1,231 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "async.h"
+#include "common.h"
+
+void async_init(struct luaeng_async *async) {
+   memset(async, 0, sizeof(*async));
+   pthread_mutex_init(&async->lock, NULL);
+
+   /* Timers are on the monotonic clock */
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&async->cond, &attr);
+   pthread_condattr_destroy(&attr);
+}
+
+void async_destroy(struct luaeng_async *async) {
+   pthread_mutex_destroy(&async->lock);
+   pthread_cond_destroy(&async->cond);
+}
+
+static void read_file(struct async_wait *wait) {
+   int fd = open(wait->path, O_RDONLY);
+   if (fd == -1) {
+      wait->error = errno;
+      return;
+   }
+
+   struct stat st;
+   size_t capacity = 4096;
+   if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      capacity = (size_t)st.st_size + 1;
+   }
+   wait->data = malloc(capacity);
+   wait->len = 0;
+   while (wait->data != NULL) {
+      if (wait->len == capacity) {
+         char *data = realloc(wait->data, capacity * 2);
+         if (data == NULL) {
+            break;
+         }
+         wait->data = data;
+         capacity *= 2;
+      }
+      ssize_t n = read(fd, wait->data + wait->len, capacity - wait->len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         if (n < 0) {
+            wait->error = errno;
+         }
+         break;
+      }
+      wait->len += n;
+   }
+   if (wait->data == NULL || wait->error != 0) {
+      wait->error = wait->error != 0 ? wait->error : ENOMEM;
+      free(wait->data);
+      wait->data = NULL;
+      wait->len = 0;
+   }
+   close(fd);
+}
+
+void async_run(struct async_wait *wait) {
+   switch (wait->op) {
+   case ASYNC_SLEEP: {
+      uint64_t now = monotonic_ns();
+      if (wait->deadline > now) {
+         uint64_t ns = wait->deadline - now;
+         struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+         while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+         }
+      }
+      break;
+   }
+   case ASYNC_READ_FILE:
+      read_file(wait);
+      break;
+   }
+}
+
+void async_wait_clear(struct async_wait *wait) {
+   free(wait->path);
+   free(wait->data);
+   wait->path = wait->data = NULL;
+   wait->len = 0;
+}
+
+void async_submit(struct luaeng_async *async, struct async_wait *wait) {
+   pthread_mutex_lock(&async->lock);
+   wait->next = NULL;
+   if (wait->op == ASYNC_SLEEP) {
+      struct async_wait **pos = &async->timers;
+      while (*pos != NULL && (*pos)->deadline <= wait->deadline) {
+         pos = &(*pos)->next;
+      }
+      wait->next = *pos;
+      *pos = wait;
+   } else if (async->queue_tail != NULL) {
+      async->queue_tail->next = wait;
+      async->queue_tail = wait;
+   } else {
+      async->queue = async->queue_tail = wait;
+   }
+   async->submitted++;
+   pthread_cond_signal(&async->cond);
+   pthread_mutex_unlock(&async->lock);
+}
+
+/*
+ * Take the next operation to carry out, waiting for one if need be.
+ * Returns NULL when stopping. Called with the lock held.
+ */
+static struct async_wait *next_wait(struct luaeng_async *async) {
+   while (!async->stopping) {
+      struct async_wait *wait = async->queue;
+      if (wait != NULL) {
+         async->queue = wait->next;
+         if (async->queue == NULL) {
+            async->queue_tail = NULL;
+         }
+         return wait;
+      }
+
+      wait = async->timers;
+      if (wait == NULL) {
+         pthread_cond_wait(&async->cond, &async->lock);
+      } else if (wait->deadline <= monotonic_ns()) {
+         async->timers = wait->next;
+         return wait;
+      } else {
+         struct timespec ts = {
+            wait->deadline / 1000000000, wait->deadline % 1000000000
+         };
+         pthread_cond_timedwait(&async->cond, &async->lock, &ts);
+      }
+   }
+   return NULL;
+}
+
+static void *async_thread(void *arg) {
+   struct luaeng_async *async = arg;
+
+   pthread_mutex_lock(&async->lock);
+   struct async_wait *wait;
+   while ((wait = next_wait(async)) != NULL) {
+      pthread_mutex_unlock(&async->lock);
+      if (wait->op != ASYNC_SLEEP) {
+         async_run(wait);
+      }
+      wait->done(wait);
+      pthread_mutex_lock(&async->lock);
+      async->completed++;
+   }
+   pthread_mutex_unlock(&async->lock);
+   return NULL;
+}
+
+bool async_start(struct luaeng_async *async, int nthreads) {
+   if (nthreads <= 0) {
+      return true;
+   }
+   async->threads = calloc(nthreads, sizeof(pthread_t));
+   if (async->threads == NULL) {
+      return false;
+   }
+   while (async->nthreads < nthreads) {
+      if (pthread_create(&async->threads[async->nthreads], NULL,
+                         async_thread, async) != 0) {
+         async_stop(async);
+         return false;
+      }
+      async->nthreads++;
+   }
+   return true;
+}
+
+void async_stop(struct luaeng_async *async) {
+   pthread_mutex_lock(&async->lock);
+   async->stopping = true;
+   pthread_cond_broadcast(&async->cond);
+   pthread_mutex_unlock(&async->lock);
+
+   for (int ii = 0; ii < async->nthreads; ++ii) {
+      pthread_join(async->threads[ii], NULL);
+   }
+   free(async->threads);
+   async->threads = NULL;
+   async->nthreads = 0;
+   async->queue = async->queue_tail = async->timers = NULL;
+}
+
+void async_stats(struct luaeng_async *async, ADD_STAT add_stat,
+                 const void *cookie) {
+   pthread_mutex_lock(&async->lock);
+   uint64_t submitted = async->submitted;
+   uint64_t completed = async->completed;
+   pthread_mutex_unlock(&async->lock);
+
+   add_stat_u64(add_stat, cookie, "async_threads", async->nthreads);
+   add_stat_u64(add_stat, cookie, "async_submitted", submitted);
+   add_stat_u64(add_stat, cookie, "async_completed", completed);
+   add_stat_u64(add_stat, cookie, "async_waiting", submitted - completed);
+}
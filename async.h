@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Operations a hook can wait for without holding up its
+ * worker thread.
+ *
+ * A hook which calls memcached.sleep() or memcached.read_file() yields
+ * its coroutine, and the request is parked (see run_hook() in
+ * lua_engine.c). The operation is carried out by one of a few threads of
+ * its own, which then tells the server the request can go on.
+ */
+#ifndef MEMCACHED_LUA_ASYNC_H
+#define MEMCACHED_LUA_ASYNC_H
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memcached/engine.h>
+
+enum async_op {
+   ASYNC_SLEEP,
+   ASYNC_READ_FILE
+};
+
+/**
+ * An operation to wait for, along with its result.
+ */
+struct async_wait {
+   struct async_wait *next;  // In the queue or the timers.
+   enum async_op op;
+   uint64_t deadline;        // ASYNC_SLEEP: monotonic time in ns.
+   char *path;               // ASYNC_READ_FILE: the file...
+   char *data;               // ...and its contents (malloc()ed)...
+   size_t len;
+   int error;                // ...or the errno of the failure.
+
+   /* Called on an async thread once the operation is complete */
+   void (*done)(struct async_wait *wait);
+};
+
+struct luaeng_async {
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   struct async_wait *queue;       // Waiting to be carried out, oldest first...
+   struct async_wait *queue_tail;
+   struct async_wait *timers;      // ...or for their deadline, earliest first.
+   pthread_t *threads;
+   int nthreads;
+   bool stopping;
+
+   /* Stats, protected by lock */
+   uint64_t submitted;
+   uint64_t completed;
+};
+
+void async_init(struct luaeng_async *async);
+
+/**
+ * Start nthreads threads carrying out the operations submitted.
+ */
+bool async_start(struct luaeng_async *async, int nthreads);
+
+/**
+ * Have an operation carried out, and wait->done called when complete.
+ */
+void async_submit(struct luaeng_async *async, struct async_wait *wait);
+
+/**
+ * Carry out an operation on the calling thread.
+ */
+void async_run(struct async_wait *wait);
+
+/**
+ * Free the operation's arguments and result.
+ */
+void async_wait_clear(struct async_wait *wait);
+
+/**
+ * Stop the threads. Operations still waiting are dropped without their
+ * done callback; they belong to whoever submitted them.
+ */
+void async_stop(struct luaeng_async *async);
+
+void async_destroy(struct luaeng_async *async);
+
+void async_stats(struct luaeng_async *async, ADD_STAT add_stat,
+                 const void *cookie);
+
+#endif
@@ -0,0 +1,71 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Small helpers shared by the engine's modules: little endian
+ * integers in the files it writes, clocks, and stats.
+ */
+#ifndef MEMCACHED_LUA_COMMON_H
+#define MEMCACHED_LUA_COMMON_H
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <memcached/engine.h>
+
+/* Store the low len bytes of value at p, little endian */
+static inline void put_le(uint8_t *p, uint64_t value, int len) {
+   for (int ii = 0; ii < len; ++ii) {
+      p[ii] = (uint8_t)(value >> (8 * ii));
+   }
+}
+
+static inline uint64_t get_le(const uint8_t *p, int len) {
+   uint64_t value = 0;
+   for (int ii = len - 1; ii >= 0; --ii) {
+      value = (value << 8) | p[ii];
+   }
+   return value;
+}
+
+/* Wall clock time in milliseconds */
+static inline uint64_t now_ms(void) {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static inline uint64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void add_stat_u64(ADD_STAT add_stat, const void *cookie,
+                                const char *key, uint64_t value) {
+   char val[32];
+   int len = snprintf(val, sizeof(val), "%"PRIu64, value);
+   add_stat(key, strlen(key), val, len, cookie);
+}
+
+#endif
@@ -0,0 +1,42 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <pthread.h>
+
+#include "crc32.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+   for (uint32_t ii = 0; ii < 256; ++ii) {
+      uint32_t c = ii;
+      for (int k = 0; k < 8; ++k) {
+         c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      crc_table[ii] = c;
+   }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+   const uint8_t *p = data;
+   pthread_once(&crc_once, crc_init);
+   crc = ~crc;
+   while (len-- > 0) {
+      crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   }
+   return ~crc;
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "histogram.h"
+
+/* Highest value which ends up in the given bucket */
+static uint64_t bucket_max(int bucket) {
+   if (bucket < HIST_SUB_BUCKETS) {
+      return (uint64_t)bucket;
+   }
+   int shift = bucket / HIST_SUB_BUCKETS - 1;
+   uint64_t base = HIST_SUB_BUCKETS + (uint64_t)(bucket % HIST_SUB_BUCKETS);
+   return ((base + 1) << shift) - 1;
+}
+
+uint64_t histogram_percentile(const struct luaeng_histogram *hist,
+                              double percentile) {
+   if (hist->count == 0) {
+      return 0;
+   }
+
+   uint64_t rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+   if (rank == 0) {
+      rank = 1;
+   } else if (rank > hist->count) {
+      rank = hist->count;
+   }
+
+   uint64_t seen = 0;
+   for (int ii = 0; ii < HIST_BUCKETS; ++ii) {
+      seen += hist->buckets[ii];
+      if (seen >= rank) {
+         return bucket_max(ii);
+      }
+   }
+   return bucket_max(HIST_BUCKETS - 1);
+}
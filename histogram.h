@@ -0,0 +1,72 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Latency histograms.
+ *
+ * Values are counted in log-linear buckets: every power of two is split
+ * into HIST_SUB_BUCKETS buckets of equal width, so percentiles are
+ * reported within 25% of the real value over the whole 64 bit range
+ * while recording a value is only a few instructions.
+ */
+#ifndef MEMCACHED_LUA_HISTOGRAM_H
+#define MEMCACHED_LUA_HISTOGRAM_H
+
+#include "config.h"
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS    2
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/**
+ * Only holds counters which can be summed up and subtracted, so a set of
+ * histograms can be aggregated and reset by treating it as an array of
+ * uint64_t.
+ */
+struct luaeng_histogram {
+   uint64_t count;
+   uint64_t total;
+   uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline int histogram_bucket(uint64_t value) {
+   if (value < HIST_SUB_BUCKETS) {
+      return (int)value;
+   }
+   int msb = 63 - __builtin_clzll(value);
+   int shift = msb - HIST_SUB_BITS;
+   return (shift + 1) * HIST_SUB_BUCKETS +
+      (int)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+static inline void histogram_record(struct luaeng_histogram *hist,
+                                    uint64_t value) {
+   hist->count++;
+   hist->total += value;
+   hist->buckets[histogram_bucket(value)]++;
+}
+
+/**
+ * Return the highest value counted in the same bucket as the value at
+ * the given percentile (0 - 100).
+ */
+uint64_t histogram_percentile(const struct luaeng_histogram *hist,
+                              double percentile);
+
+#endif
@@ -0,0 +1,639 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "crc32.h"
+#include "journal.h"
+#include "lua_engine.h"
+
+/*
+ * File layout, all integers little endian:
+ *
+ *   header:  "LUAEJRNL" version:u32 0:u32
+ *   record:  crc32:u32 type:u8 nkey:u16 nbytes:u32 flags:u32 exptime:u64
+ *            cas:u64 key value
+ *
+ * The checksum covers the rest of the record. Times are unix times (0
+ * for never), as the server's clock starts over with the process. A
+ * flush has no key and value, and the time it is due in exptime.
+ */
+#define JOURNAL_MAGIC     "LUAEJRNL"
+#define JOURNAL_VERSION   1
+#define HEADER_SIZE       16
+#define RECORD_SIZE       31
+#define WRITE_CHUNK       (1024 * 1024)
+
+enum {
+   RECORD_LINKED = 1,
+   RECORD_UNLINKED = 2,
+   RECORD_FLUSHED = 3,
+   RECORD_FLUSH_AT = 4
+};
+
+/**
+ * A change waiting to be written.
+ */
+struct journal_record {
+   struct journal_record *next;
+   enum store_change change;
+   hash_item *it;            // Referenced, NULL for flushes.
+   uint64_t value;           // As passed to the changed callback.
+};
+
+struct buffer {
+   uint8_t *data;
+   size_t len;
+   size_t capacity;
+};
+
+/*
+ * Convert between the server's clock and unix time, keeping 0 as never
+ * and times in the past in the past.
+ */
+static uint64_t to_unix(rel_time_t when, rel_time_t now, time_t unix_now) {
+   if (when == 0) {
+      return 0;
+   }
+   int64_t res = (int64_t)unix_now + ((int64_t)when - now);
+   return res > 0 ? (uint64_t)res : 1;
+}
+
+static rel_time_t from_unix(uint64_t when, rel_time_t now, time_t unix_now) {
+   if (when == 0) {
+      return 0;
+   }
+   if (when <= (uint64_t)unix_now) {
+      return now > 0 ? now : 1;
+   }
+   return now + (rel_time_t)(when - unix_now);
+}
+
+static bool buffer_reserve(struct buffer *buf, size_t len) {
+   if (buf->len + len <= buf->capacity) {
+      return true;
+   }
+   size_t capacity = buf->capacity ? buf->capacity : 4096;
+   while (capacity < buf->len + len) {
+      capacity *= 2;
+   }
+   uint8_t *data = realloc(buf->data, capacity);
+   if (data == NULL) {
+      return false;
+   }
+   buf->data = data;
+   buf->capacity = capacity;
+   return true;
+}
+
+static bool encode_record(struct buffer *buf, int type, const hash_item *it,
+                          uint64_t exptime, uint64_t cas) {
+   size_t nkey = it != NULL ? it->item.nkey : 0;
+   size_t nbytes = it != NULL && type == RECORD_LINKED ? it->item.nbytes : 0;
+   if (!buffer_reserve(buf, RECORD_SIZE + nkey + nbytes)) {
+      return false;
+   }
+
+   uint8_t *p = buf->data + buf->len;
+   put_le(p + 4, type, 1);
+   put_le(p + 5, nkey, 2);
+   put_le(p + 7, nbytes, 4);
+   put_le(p + 11, it != NULL ? it->item.flags : 0, 4);
+   put_le(p + 15, exptime, 8);
+   put_le(p + 23, cas, 8);
+   if (it != NULL) {
+      memcpy(p + RECORD_SIZE, item_get_key(&it->item), nkey);
+      memcpy(p + RECORD_SIZE + nkey, item_get_data(&it->item), nbytes);
+   }
+   put_le(p, crc32_update(0, p + 4, RECORD_SIZE - 4 + nkey + nbytes), 4);
+   buf->len += RECORD_SIZE + nkey + nbytes;
+   return true;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len) {
+   while (len > 0) {
+      ssize_t n = write(fd, data, len);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+bool journal_init(struct luaeng_journal *journal, struct luaeng_store *store,
+                  const char *path, const char *sync) {
+   memset(journal, 0, sizeof(*journal));
+   journal->store = store;
+   journal->fd = -1;
+   journal->sync = JOURNAL_SYNC_SECOND;
+   if (sync != NULL) {
+      if (strcmp(sync, "always") == 0) {
+         journal->sync = JOURNAL_SYNC_ALWAYS;
+      } else if (strcmp(sync, "none") == 0) {
+         journal->sync = JOURNAL_SYNC_NONE;
+      } else if (strcmp(sync, "second") != 0) {
+         fprintf(stderr, "journal: unknown sync policy \"%s\"\n", sync);
+         return false;
+      }
+   }
+   if (path != NULL) {
+      journal->path = strdup(path);
+      sem_init(&journal->wakeup, 0, 0);
+   }
+   return true;
+}
+
+void journal_destroy(struct luaeng_journal *journal) {
+   if (journal->path == NULL) {
+      return;
+   }
+   if (journal->fd != -1) {
+      close(journal->fd);
+      journal->fd = -1;
+   }
+   sem_destroy(&journal->wakeup);
+   free(journal->path);
+   journal->path = NULL;
+}
+
+/*
+ * Called by the store with the stripe's lock held, so this only queues
+ * the change.
+ */
+static void journal_changed(void *arg, enum store_change change,
+                            hash_item *it, uint64_t value) {
+   struct luaeng_journal *journal = arg;
+   struct journal_record *rec = malloc(sizeof(*rec));
+   if (rec == NULL) {
+      __sync_add_and_fetch(&journal->lost, 1);
+      return;
+   }
+   rec->change = change;
+   rec->it = it;
+   rec->value = value;
+   if (it != NULL) {
+      __sync_add_and_fetch(&it->refcount, 1);
+   }
+
+   struct journal_record *head;
+   do {
+      head = journal->head;
+      rec->next = head;
+   } while (!__sync_bool_compare_and_swap(&journal->head, head, rec));
+   __sync_add_and_fetch(&journal->pushed, 1);
+
+   if (head == NULL) {
+      sem_post(&journal->wakeup);
+   }
+}
+
+/*
+ * Take every queued record, oldest first.
+ */
+static struct journal_record *take_records(struct luaeng_journal *journal) {
+   struct journal_record *head = __sync_lock_test_and_set(&journal->head, NULL);
+
+   struct journal_record *list = NULL;
+   while (head != NULL) {
+      struct journal_record *next = head->next;
+      head->next = list;
+      list = head;
+      head = next;
+   }
+   return list;
+}
+
+/*
+ * Once the file can't be repaired after a failed write, the changes are
+ * only taken off the queue.
+ */
+static void drop_records(struct luaeng_journal *journal,
+                         struct journal_record *list) {
+   while (list != NULL) {
+      struct journal_record *rec = list;
+      list = rec->next;
+      if (rec->it != NULL) {
+         store_item_release(journal->store, rec->it);
+      }
+      free(rec);
+      journal->records++;
+   }
+}
+
+/*
+ * Write out the buffer, which holds whole records, moving *end past them.
+ * A failed write may leave part of them behind; *error gets its errno.
+ */
+static bool flush_buffer(struct luaeng_journal *journal, struct buffer *buf,
+                         off_t *end, int *error) {
+   bool ok = buf->len == 0 || write_all(journal->fd, buf->data, buf->len);
+   if (!ok) {
+      *error = errno;
+   } else if (buf->len > 0) {
+      *end += buf->len;
+      journal->bytes += buf->len;
+      journal->writes++;
+   }
+   buf->len = 0;
+   return ok;
+}
+
+/*
+ * Write out a batch of records, with as few writes as the size of the
+ * values allows. *end is kept at the end of the last whole record in the
+ * file.
+ */
+static bool write_records(struct luaeng_journal *journal,
+                          struct journal_record *list, struct buffer *buf,
+                          off_t *end, int *error) {
+   struct luaeng_store *store = journal->store;
+   rel_time_t now = store->get_current_time();
+   time_t unix_now = time(NULL);
+   bool ok = true;
+
+   while (list != NULL) {
+      struct journal_record *rec = list;
+      list = rec->next;
+
+      if (ok) {
+         switch (rec->change) {
+         case STORE_LINKED:
+            ok = encode_record(buf, RECORD_LINKED, rec->it,
+                               to_unix(rec->it->item.exptime, now, unix_now),
+                               rec->value);
+            break;
+         case STORE_UNLINKED:
+            ok = encode_record(buf, RECORD_UNLINKED, rec->it, 0, rec->value);
+            break;
+         case STORE_FLUSHED:
+            ok = encode_record(buf, RECORD_FLUSHED, NULL, 0, rec->value);
+            break;
+         case STORE_FLUSH_AT:
+            ok = encode_record(buf, RECORD_FLUSH_AT, NULL,
+                               to_unix((rel_time_t)rec->value, now, unix_now),
+                               0);
+            break;
+         }
+         if (!ok) {
+            *error = ENOMEM;
+         } else if (buf->len >= WRITE_CHUNK) {
+            ok = flush_buffer(journal, buf, end, error);
+         }
+      }
+
+      if (rec->it != NULL) {
+         store_item_release(store, rec->it);
+      }
+      free(rec);
+      journal->records++;
+   }
+
+   /* The records encoded before running out of memory still go out */
+   return flush_buffer(journal, buf, end, error) && ok;
+}
+
+static void *journal_thread(void *arg) {
+   struct luaeng_journal *journal = arg;
+   struct buffer buf = { NULL, 0, 0 };
+   uint64_t last_sync = now_ms();
+   bool dirty = false;
+   bool failing = false;
+   bool broken = false;
+   off_t end = lseek(journal->fd, 0, SEEK_END);
+
+   for (;;) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += 1;
+      sem_timedwait(&journal->wakeup, &deadline);
+
+      /* Nothing is logged once stopping is set, so this gets the rest */
+      bool stopping = __sync_fetch_and_add(&journal->stopping, 0) != 0;
+      struct journal_record *list = take_records(journal);
+      if (list != NULL && broken) {
+         drop_records(journal, list);
+         journal->errors++;
+      } else if (list != NULL) {
+         int error = 0;
+         bool ok = write_records(journal, list, &buf, &end, &error);
+         if (!ok) {
+            journal->errors++;
+            if (!failing) {
+               fprintf(stderr, "journal: failed to write %s: %s\n",
+                       journal->path, strerror(error));
+            }
+            /*
+             * Replay stops at a torn record, so it is cut off before
+             * anything else is appended after it
+             */
+            if (ftruncate(journal->fd, end) != 0) {
+               fprintf(stderr, "journal: failed to truncate %s, no longer "
+                       "journaling: %s\n", journal->path, strerror(errno));
+               broken = true;
+            }
+         }
+         failing = !ok;
+         dirty = true;
+      }
+
+      uint64_t now = now_ms();
+      if (dirty && journal->sync != JOURNAL_SYNC_NONE &&
+          (journal->sync == JOURNAL_SYNC_ALWAYS || stopping ||
+           now - last_sync >= 1000)) {
+         if (fsync(journal->fd) == 0) {
+            journal->syncs++;
+         } else {
+            journal->errors++;
+         }
+         last_sync = now;
+         dirty = false;
+      }
+
+      if (stopping) {
+         break;
+      }
+   }
+
+   free(buf.data);
+   return NULL;
+}
+
+void journal_stop(struct luaeng_journal *journal) {
+   if (!journal->started) {
+      return;
+   }
+   store_set_changed(journal->store, NULL, NULL);
+   __sync_fetch_and_add(&journal->stopping, 1);
+   sem_post(&journal->wakeup);
+   pthread_join(journal->thread, NULL);
+   journal->started = false;
+}
+
+/*
+ * Apply the records of a mapped journal to the store, up to the first
+ * one which doesn't check out. Returns the offset it stopped at.
+ */
+static size_t replay_records(struct luaeng_journal *journal,
+                             const uint8_t *data, size_t size) {
+   struct luaeng_store *store = journal->store;
+   rel_time_t now = store->get_current_time();
+   time_t unix_now = time(NULL);
+   uint64_t flush_at = 0;
+   size_t pos = HEADER_SIZE;
+
+   while (pos + RECORD_SIZE <= size) {
+      const uint8_t *p = data + pos;
+      int type = (int)get_le(p + 4, 1);
+      size_t nkey = get_le(p + 5, 2);
+      size_t nbytes = get_le(p + 7, 4);
+      uint32_t flags = (uint32_t)get_le(p + 11, 4);
+      uint64_t exptime = get_le(p + 15, 8);
+      uint64_t cas = get_le(p + 23, 8);
+      const uint8_t *key = p + RECORD_SIZE;
+      size_t len = RECORD_SIZE + nkey + nbytes;
+      if (len > size - pos ||
+          get_le(p, 4) != crc32_update(0, p + 4, len - 4)) {
+         break;
+      }
+      pos += len;
+
+      switch (type) {
+      case RECORD_LINKED:
+         if (exptime != 0 && exptime <= (uint64_t)unix_now) {
+            /* Still replaces the value before it */
+            store_unlink(store, key, nkey, 0);
+            journal->replay_skipped++;
+         } else {
+            hash_item *it = store_item_alloc(store, key, nkey, nbytes, flags,
+                                             from_unix(exptime, now, unix_now));
+            if (it == NULL) {
+               store_unlink(store, key, nkey, 0);
+               journal->replay_skipped++;
+               break;
+            }
+            memcpy(item_get_data(&it->item), key + nkey, nbytes);
+            it->cas = cas;
+            if (store_restore(store, it) == ENGINE_SUCCESS) {
+               journal->replayed++;
+            } else {
+               journal->replay_skipped++;
+            }
+            store_item_release(store, it);
+         }
+         break;
+      case RECORD_UNLINKED:
+         store_unlink(store, key, nkey, 0);
+         journal->replayed++;
+         break;
+      case RECORD_FLUSHED:
+         store_flush_cas(store, cas);
+         flush_at = 0;
+         journal->replayed++;
+         break;
+      case RECORD_FLUSH_AT:
+         flush_at = exptime;
+         journal->replayed++;
+         break;
+      }
+   }
+
+   /* A flush which was still to come when the server went down */
+   if (flush_at != 0) {
+      if (flush_at <= (uint64_t)unix_now) {
+         store_flush_cas(store, store->cas);
+      } else {
+         store_flush(store, from_unix(flush_at, now, unix_now));
+      }
+   }
+   return pos;
+}
+
+/*
+ * Write the items in the store to a new journal and put it in place of
+ * the old one.
+ */
+static bool compact(struct luaeng_journal *journal) {
+   struct luaeng_store *store = journal->store;
+   size_t len = strlen(journal->path);
+   char *tmp = malloc(len + 5);
+   if (tmp == NULL) {
+      return false;
+   }
+   memcpy(tmp, journal->path, len);
+   memcpy(tmp + len, ".tmp", 5);
+
+   int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1) {
+      fprintf(stderr, "journal: can't create %s: %s\n", tmp, strerror(errno));
+      free(tmp);
+      return false;
+   }
+
+   struct buffer buf = { NULL, 0, 0 };
+   bool ok = buffer_reserve(&buf, HEADER_SIZE);
+   if (ok) {
+      memcpy(buf.data, JOURNAL_MAGIC, 8);
+      put_le(buf.data + 8, JOURNAL_VERSION, 4);
+      put_le(buf.data + 12, 0, 4);
+      buf.len = HEADER_SIZE;
+   }
+
+   rel_time_t now = store->get_current_time();
+   time_t unix_now = time(NULL);
+   for (uint32_t ii = 0; ii < store->nstripes && ok; ++ii) {
+      hash_item **items;
+      int n = store_snapshot_stripe(store, ii, &items);
+      ok = n >= 0;
+      for (int jj = 0; jj < n; ++jj) {
+         hash_item *it = items[jj];
+         if (ok) {
+            ok = encode_record(&buf, RECORD_LINKED, it,
+                               to_unix(it->item.exptime, now, unix_now),
+                               it->cas);
+            journal->compacted++;
+         }
+         if (ok && buf.len >= WRITE_CHUNK) {
+            ok = write_all(fd, buf.data, buf.len);
+            buf.len = 0;
+         }
+         store_item_release(store, it);
+      }
+      free(items);
+   }
+   if (ok && store->flush_time != 0) {
+      ok = encode_record(&buf, RECORD_FLUSH_AT, NULL,
+                         to_unix(store->flush_time, now, unix_now), 0);
+   }
+
+   ok = ok && write_all(fd, buf.data, buf.len) && fsync(fd) == 0;
+   free(buf.data);
+   if (close(fd) != 0) {
+      ok = false;
+   }
+   if (ok && rename(tmp, journal->path) != 0) {
+      ok = false;
+   }
+   if (!ok) {
+      fprintf(stderr, "journal: failed to write %s: %s\n", tmp,
+              strerror(errno));
+      unlink(tmp);
+   }
+   free(tmp);
+   return ok;
+}
+
+bool journal_replay(struct luaeng_journal *journal, bool *found) {
+   *found = false;
+   if (journal->path == NULL) {
+      return true;
+   }
+
+   uint64_t start = now_ms();
+   int fd = open(journal->path, O_RDONLY);
+   if (fd != -1) {
+      struct stat st;
+      void *data = MAP_FAILED;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+         data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      }
+      close(fd);
+
+      if (data != MAP_FAILED && (size_t)st.st_size >= HEADER_SIZE &&
+          memcmp(data, JOURNAL_MAGIC, 8) == 0 &&
+          get_le((const uint8_t*)data + 8, 4) == JOURNAL_VERSION) {
+         size_t end = replay_records(journal, data, st.st_size);
+         journal->truncated = st.st_size - end;
+         if (journal->truncated > 0) {
+            fprintf(stderr, "journal: dropping %"PRIu64" bytes from the end "
+                    "of %s\n", journal->truncated, journal->path);
+         }
+         *found = true;
+      } else {
+         fprintf(stderr, "journal: ignoring damaged %s\n", journal->path);
+      }
+      if (data != MAP_FAILED) {
+         munmap(data, st.st_size);
+      }
+   } else if (errno != ENOENT) {
+      fprintf(stderr, "journal: can't open %s: %s\n", journal->path,
+              strerror(errno));
+      return false;
+   }
+
+   journal->replay_duration = now_ms() - start;
+   return true;
+}
+
+bool journal_start(struct luaeng_journal *journal) {
+   if (journal->path == NULL) {
+      return true;
+   }
+
+   /*
+    * Everything the store holds now, replayed or loaded from a snapshot,
+    * goes into a fresh journal
+    */
+   if (!compact(journal)) {
+      return false;
+   }
+   journal->fd = open(journal->path, O_WRONLY | O_APPEND);
+   if (journal->fd == -1) {
+      return false;
+   }
+
+   store_set_changed(journal->store, journal_changed, journal);
+   journal->started = pthread_create(&journal->thread, NULL, journal_thread,
+                                     journal) == 0;
+   if (!journal->started) {
+      store_set_changed(journal->store, NULL, NULL);
+   }
+   return journal->started;
+}
+
+void journal_stats(struct luaeng_journal *journal, ADD_STAT add_stat,
+                   const void *cookie) {
+   static const char *sync_names[] = { "always", "second", "none" };
+   add_stat("journal_sync", 12, sync_names[journal->sync],
+            strlen(sync_names[journal->sync]), cookie);
+   add_stat_u64(add_stat, cookie, "journal_queued",
+                journal->pushed - journal->records);
+   add_stat_u64(add_stat, cookie, "journal_records", journal->records);
+   add_stat_u64(add_stat, cookie, "journal_bytes", journal->bytes);
+   add_stat_u64(add_stat, cookie, "journal_writes", journal->writes);
+   add_stat_u64(add_stat, cookie, "journal_syncs", journal->syncs);
+   add_stat_u64(add_stat, cookie, "journal_errors", journal->errors);
+   add_stat_u64(add_stat, cookie, "journal_lost", journal->lost);
+   add_stat_u64(add_stat, cookie, "journal_replayed", journal->replayed);
+   add_stat_u64(add_stat, cookie, "journal_replay_skipped", journal->replay_skipped);
+   add_stat_u64(add_stat, cookie, "journal_truncated", journal->truncated);
+   add_stat_u64(add_stat, cookie, "journal_compacted", journal->compacted);
+   add_stat_u64(add_stat, cookie, "journal_replay_duration_ms", journal->replay_duration);
+}
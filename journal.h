@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Append-only log of the changes to the store, for durability
+ * across restarts.
+ *
+ * The store reports every change while it holds the stripe's lock (see
+ * store_set_changed()), and the journal only pushes a referenced record
+ * on a lock-free list there; a thread of its own takes the whole list at
+ * once, writes it out with a single write() and syncs it as the policy
+ * asks. Worker threads never wait for the disk, and the records which
+ * pile up while a write is in progress go out together in the next one.
+ *
+ * Records carry the item's cas, so flushes can be replayed exactly, and
+ * a checksum each: replay stops at the first record which doesn't check
+ * out, which is where a crash left the file. Once the store is loaded
+ * (from the journal, or a snapshot without one) the journal is compacted
+ * by writing out the items in the store in its place.
+ */
+#ifndef MEMCACHED_LUA_JOURNAL_H
+#define MEMCACHED_LUA_JOURNAL_H
+
+#include "config.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <memcached/engine.h>
+
+#include "store.h"
+
+enum journal_sync {
+   JOURNAL_SYNC_ALWAYS,      // After every write.
+   JOURNAL_SYNC_SECOND,      // At most once a second.
+   JOURNAL_SYNC_NONE         // Left to the operating system.
+};
+
+struct journal_record;
+
+struct luaeng_journal {
+   struct luaeng_store *store;
+   char *path;
+   enum journal_sync sync;
+   int fd;
+
+   struct journal_record *head; // Pushed records, newest first, updated atomically.
+   sem_t wakeup;                // Posted when head goes from empty to not.
+   pthread_t thread;
+   bool started;
+   uint32_t stopping;        // Set atomically.
+
+   /* Stats, updated by the journal thread unless noted */
+   uint64_t pushed;          // Updated atomically.
+   uint64_t lost;            // Changes which couldn't be queued, updated atomically.
+   uint64_t records;         // Taken off the queue, and written unless there were errors.
+   uint64_t bytes;
+   uint64_t writes;
+   uint64_t syncs;
+   uint64_t errors;
+   uint64_t replayed;
+   uint64_t replay_skipped;  // Expired, or no room for them.
+   uint64_t truncated;       // Bytes dropped from the end of the file.
+   uint64_t compacted;       // Records written by the compaction.
+   uint64_t replay_duration; // In ms.
+};
+
+/**
+ * Returns false for an unknown sync policy ("always", "second" or "none").
+ */
+bool journal_init(struct luaeng_journal *journal, struct luaeng_store *store,
+                  const char *path, const char *sync);
+
+/**
+ * Replay the journal into the store, if there is one. Sets *found if
+ * there was a journal to replay. Returns false if it couldn't be read.
+ */
+bool journal_replay(struct luaeng_journal *journal, bool *found);
+
+/**
+ * Compact the journal down to the items in the store, and start logging
+ * the changes to it. Returns false if the compacted journal couldn't be
+ * written.
+ */
+bool journal_start(struct luaeng_journal *journal);
+
+/**
+ * Stop logging, once everything logged so far is written and synced.
+ */
+void journal_stop(struct luaeng_journal *journal);
+
+void journal_destroy(struct luaeng_journal *journal);
+
+void journal_stats(struct luaeng_journal *journal, ADD_STAT add_stat,
+                   const void *cookie);
+
+#endif
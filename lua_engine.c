@@ -15,7 +15,6 @@
  *   limitations under the License.
  */
 #include <stdlib.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -24,14 +23,31 @@
 #include <unistd.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
 
+#include "common.h"
 #include "lua_engine.h"
+#include "marshal.h"
 
 #include <memcached/util.h>
 #include <memcached/config_parser.h>
 
-#define INIT_FREE_STACK_SIZE 8
 #define KEY_BUFFER_MAX       260
+#define DEFAULT_THREADS      4
+#define DEFAULT_SCRIPT       "./memcached.lua"
+#define BUDGET_STEP          1000
+#define DEFAULT_CACHE_SIZE   (64 * 1024 * 1024)
+#define DEFAULT_POOL_MIN     1
+#define DEFAULT_POOL_MAX     4
+#define DEFAULT_POOL_SHARED  16
+#define DEFAULT_POOL_IDLE    60
+#define DEFAULT_ASYNC_PARKED 1024
+#define TRIM_BATCH           8
+#define LUA_SMALL_MIN        16
+#define LUA_SMALL_MAX        512
+#define LUA_GC_PAUSE         200  // Lua's default (LUAI_GCPAUSE).
 
 #ifdef UNUSED
 #elif defined(__GNUC__)
@@ -97,6 +113,11 @@ static ENGINE_ERROR_CODE luaeng_unknown_command(ENGINE_HANDLE* handle,
                                                  const void* cookie,
                                                  protocol_binary_request_header *request,
                                                  ADD_RESPONSE response);
+static void release_tld(void* arg);
+static void release_lua(struct luaeng* luaeng, struct luaeng_lua* ll);
+static void add_thread_stats(struct luaeng_thread_stats* total,
+                             const struct luaeng_thread_stats* stats,
+                             bool subtract);
 
 ENGINE_ERROR_CODE create_instance(uint64_t interface,
                                   GET_SERVER_API get_server_api,
@@ -138,19 +159,43 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
       .server = *api,
       .initialized = true,
       .lock = PTHREAD_MUTEX_INITIALIZER,
+      .reload_lock = PTHREAD_MUTEX_INITIALIZER,
+      .tasks_lock = PTHREAD_MUTEX_INITIALIZER,
       .stats = {
          .lock = PTHREAD_MUTEX_INITIALIZER
       },
       .config = {
          .verbose = 0,
-         .script = NULL
+         .script = NULL,
+         .store_stripes = STORE_DEFAULT_STRIPES,
+         .threads = DEFAULT_THREADS,
+         .prewarm = 0,
+         .pool_min = DEFAULT_POOL_MIN,
+         .pool_max = DEFAULT_POOL_MAX,
+         .pool_shared = DEFAULT_POOL_SHARED,
+         .pool_idle = DEFAULT_POOL_IDLE,
+         .slab_factor = SLAB_DEFAULT_FACTOR,
+         .instruction_limit = 0,
+         .time_limit = 0,
+         .cache_size = DEFAULT_CACHE_SIZE,
+         .async_parked = DEFAULT_ASYNC_PARKED,
+         .command_min = LUAENG_CMD_SCRIPT_MIN,
+         .command_max = LUAENG_CMD_SCRIPT_MAX
       }
    };
 
    luaeng.server = *api;
    *engine = luaeng;
+   async_init(&engine->async);
 
-   if (pthread_key_create(&engine->tld, NULL) != 0) {
+   /* Task threads wait for their next run on the monotonic clock */
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&engine->tasks_cond, &attr);
+   pthread_condattr_destroy(&attr);
+
+   if (pthread_key_create(&engine->tld, release_tld) != 0) {
       return ENGINE_ENOMEM;
    }
 
@@ -166,152 +211,1657 @@ static const char* luaeng_engine_info(ENGINE_HANDLE* UNUSED(handle)) {
    return "Lua engine v0.1";
 }
 
-static lua_State* create_lua(struct luaeng* luaeng) {
-   lua_State* L = lua_open();
-   if (L != NULL) {
-      luaL_openlibs(L);
+/*
+ * Expose the status codes and store operations to the script in the
+ * global table "memcached".
+ */
+static void register_constants(lua_State* L) {
+   static const struct {
+      const char *name;
+      int value;
+   } constants[] = {
+      { "SUCCESS", ENGINE_SUCCESS },
+      { "KEY_ENOENT", ENGINE_KEY_ENOENT },
+      { "KEY_EEXISTS", ENGINE_KEY_EEXISTS },
+      { "ENOMEM", ENGINE_ENOMEM },
+      { "NOT_STORED", ENGINE_NOT_STORED },
+      { "EINVAL", ENGINE_EINVAL },
+      { "ENOTSUP", ENGINE_ENOTSUP },
+      { "E2BIG", ENGINE_E2BIG },
+      { "FAILED", ENGINE_FAILED },
+      { "ADD", OPERATION_ADD },
+      { "SET", OPERATION_SET },
+      { "REPLACE", OPERATION_REPLACE },
+      { "APPEND", OPERATION_APPEND },
+      { "PREPEND", OPERATION_PREPEND },
+      { "CAS", OPERATION_CAS },
+      { NULL, 0 }
+   };
+
+   lua_newtable(L);
+   for (int ii = 0; constants[ii].name != NULL; ++ii) {
+      lua_pushinteger(L, constants[ii].value);
+      lua_setfield(L, -2, constants[ii].name);
+   }
+   lua_setglobal(L, "memcached");
+}
 
-      char *script = luaeng->config.script;
-      if (script == NULL) {
-         script = (char *) "./memcached.lua";
+static const char* const hook_names[LUAENG_HOOK_MAX] = {
+   [LUAENG_HOOK_GET] = "memcached_get",
+   [LUAENG_HOOK_GET_MULTI] = "memcached_get_multi",
+   [LUAENG_HOOK_STORE] = "memcached_store",
+   [LUAENG_HOOK_REMOVE] = "memcached_remove",
+   [LUAENG_HOOK_ARITHMETIC] = "memcached_arithmetic",
+   [LUAENG_HOOK_FLUSH] = "memcached_flush",
+   [LUAENG_HOOK_EVICT] = "memcached_evict",
+   [LUAENG_HOOK_COMMAND] = "memcached_command"
+};
+
+/*
+ * Look up the hooks defined by the script once, keeping a reference to
+ * each in the registry so requests don't need to search the globals.
+ */
+static void resolve_hooks(struct luaeng_lua* ll) {
+   lua_State* L = ll->L;
+   for (int ii = 0; ii < LUAENG_HOOK_MAX; ++ii) {
+      lua_getglobal(L, hook_names[ii]);
+      if (lua_isfunction(L, -1)) {
+         ll->hooks[ii] = luaL_ref(L, LUA_REGISTRYINDEX);
+      } else {
+         ll->hooks[ii] = LUA_NOREF;
+         lua_pop(L, 1);
       }
+   }
+}
+
+static inline bool has_hook(struct luaeng_lua* ll, enum luaeng_hook hook) {
+   return ll->hooks[hook] != LUA_NOREF;
+}
+
+static inline void push_hook(struct luaeng_lua* ll, enum luaeng_hook hook) {
+   lua_rawgeti(ll->L, LUA_REGISTRYINDEX, ll->hooks[hook]);
+}
+
+/*
+ * Report the error on top of the stack, unless we already did so in the
+ * current second, so that a script failing on every request can't flood
+ * the log.
+ */
+static void log_lua_error(struct luaeng* luaeng, const char* what,
+                          lua_State* L) {
+   rel_time_t now = luaeng->server.get_current_time();
+   rel_time_t last = luaeng->last_error_log;
+   if (last == now ||
+       !__sync_bool_compare_and_swap(&luaeng->last_error_log, last, now)) {
+      __sync_add_and_fetch(&luaeng->suppressed_errors, 1);
+      return;
+   }
+
+   uint32_t suppressed = __sync_lock_test_and_set(&luaeng->suppressed_errors, 0);
+   const char* msg = lua_tostring(L, -1);
+   if (msg == NULL) {
+      msg = "(error object is not a string)";
+   }
+   if (suppressed > 0) {
+      fprintf(stderr, "%s lua error: %s (%u more errors not logged)\n",
+              what, msg, suppressed);
+   } else {
+      fprintf(stderr, "%s lua error: %s\n", what, msg);
+   }
+}
 
-      int err = luaL_dofile(L, script);
-      if (err != 0) {
-         fprintf(stderr, "script error: %s\n", lua_tostring(L, -1));
-         exit(EXIT_FAILURE);
+/*
+ * Hooks return an engine status code. For backwards compatibility a
+ * missing result or true means success, and false means fail_code.
+ * Numbers other than the codes in the memcached table are logged and
+ * turned into ENGINE_FAILED.
+ */
+static ENGINE_ERROR_CODE lua_to_status(struct luaeng* luaeng, lua_State* L,
+                                       int idx, ENGINE_ERROR_CODE fail_code) {
+   if (lua_type(L, idx) == LUA_TNUMBER) {
+      lua_Number num = lua_tonumber(L, idx);
+      int code = -1;
+      if (num >= 0 && num <= INT_MAX && (int)num == num) {
+         code = (int)num;
       }
+      switch (code) {
+      case ENGINE_SUCCESS:
+      case ENGINE_KEY_ENOENT:
+      case ENGINE_KEY_EEXISTS:
+      case ENGINE_ENOMEM:
+      case ENGINE_NOT_STORED:
+      case ENGINE_EINVAL:
+      case ENGINE_ENOTSUP:
+      case ENGINE_E2BIG:
+      case ENGINE_FAILED:
+         return (ENGINE_ERROR_CODE)code;
+      }
+      lua_pushfstring(L, "invalid status %f", num);
+      log_lua_error(luaeng, "hook", L);
+      lua_pop(L, 1);
+      return ENGINE_FAILED;
+   }
+   if (lua_isnil(L, idx) || lua_toboolean(L, idx)) {
+      return ENGINE_SUCCESS;
+   }
+   return fail_code;
+}
+
+/* Registry key of the struct luaeng_lua owning an interpreter */
+static const char lua_owner_key = 'k';
+
+static struct luaeng_lua* lua_owner(lua_State* L) {
+   lua_pushlightuserdata(L, (void*)&lua_owner_key);
+   lua_rawget(L, LUA_REGISTRYINDEX);
+   struct luaeng_lua* ll = lua_touserdata(L, -1);
+   lua_pop(L, 1);
+   return ll;
+}
+
+/*
+ * Count hook, run every budget_step instructions, aborting the running
+ * hook call once it has used up its budget. Every later check fails as
+ * well, so a script can't pcall its way past the limit. With gc_idle it
+ * also restarts the collector for the rest of a call which gets close to
+ * memory_limit, as garbage would otherwise run it out of memory.
+ */
+static void budget_hook(lua_State* L, lua_Debug* UNUSED(ar)) {
+   struct luaeng_lua* ll = lua_owner(L);
+   if (ll == NULL) {
+      return;
+   }
+
+   ll->instructions += ll->budget_step;
+   if (ll->instruction_limit != 0 && ll->instructions > ll->instruction_limit) {
+      ll->over_budget = true;
+      luaL_error(L, "instruction limit exceeded");
+   }
+   if (ll->deadline != 0 && monotonic_ns() > ll->deadline) {
+      ll->over_budget = true;
+      luaL_error(L, "time limit exceeded");
+   }
+   if (ll->engine->config.gc_idle && ll->memory_limit != 0 &&
+       !ll->gc_running && ll->memory > ll->memory_limit / 4 * 3) {
+      ll->gc_running = true;
+      lua_gc(L, LUA_GCRESTART, 0);
+   }
+}
+
+/*
+ * Install the budget hook if the configuration limits hook calls, or
+ * the memory of interpreters whose collector is stopped during calls.
+ */
+static void init_budget(struct luaeng* luaeng, struct luaeng_lua* ll) {
+   ll->instruction_limit = luaeng->config.instruction_limit;
+   ll->time_limit = (uint64_t)luaeng->config.time_limit * 1000000;
+   if (ll->instruction_limit == 0 && ll->time_limit == 0 &&
+       !(luaeng->config.gc_idle && ll->memory_limit != 0)) {
+      return;
    }
 
-   return L;
+   ll->budget_step = BUDGET_STEP;
+   if (ll->instruction_limit != 0 && ll->instruction_limit < BUDGET_STEP) {
+      ll->budget_step = (int)ll->instruction_limit;
+   }
+
+   lua_sethook(ll->L, budget_hook, LUA_MASKCOUNT, ll->budget_step);
 }
 
-static lua_State* acquire_lua(struct luaeng* luaeng) {
-   lua_State* L = NULL;
+/*
+ * Start a new budget for the call about to be made at time now.
+ */
+static inline void reset_budget(struct luaeng_lua* ll, uint64_t now) {
+   if (ll->budget_step != 0) {
+      ll->instructions = 0;
+      ll->over_budget = false;
+      ll->deadline = ll->time_limit != 0 ? now + ll->time_limit : 0;
+   }
+}
 
+/*
+ * The calling thread's stats. Only used on threads which already got
+ * their thread local data in acquire_lua(), so this doesn't create it.
+ */
+static inline struct luaeng_thread_stats* thread_stats(struct luaeng* luaeng) {
+   struct luaeng_tld* tld = pthread_getspecific(luaeng->tld);
+   return tld != NULL ? &tld->stats : &luaeng->stats.orphan;
+}
+
+static struct luaeng_bytecode* get_bytecode(struct luaeng* luaeng) {
+   pthread_mutex_lock(&luaeng->lock);
+   struct luaeng_bytecode* bc = luaeng->bytecode;
+   __sync_add_and_fetch(&bc->refcount, 1);
+   pthread_mutex_unlock(&luaeng->lock);
+   return bc;
+}
+
+static void put_bytecode(struct luaeng_bytecode* bc) {
+   if (bc != NULL && __sync_sub_and_fetch(&bc->refcount, 1) == 0) {
+      free(bc->data);
+      free(bc->name);
+      free(bc);
+   }
+}
+
+/*
+ * The allocator of every interpreter. Objects up to LUA_SMALL_MAX bytes
+ * come from the interpreter slabs, whose per thread free lists need no
+ * locking, and the rest from malloc(). Each interpreter's usage is
+ * counted so it can be held to memory_limit: going over fails the
+ * allocation, which lua turns into an out of memory error.
+ */
+static void* lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+   struct luaeng_lua* ll = ud;
+   struct luaeng_slabs* slabs = &ll->engine->lua_slabs;
+   struct luaeng_thread_stats* stats = thread_stats(ll->engine);
+   if (ptr == NULL) {
+      osize = 0;
+   }
+
+   if (nsize == 0) {
+      if (ptr != NULL) {
+         slabs_free(slabs, ptr, slabs_clsid(slabs, osize));
+         ll->memory -= osize;
+         stats->lua_freed += osize;
+      }
+      return NULL;
+   }
+
+   /* Only growing counts against the limit */
+   if (nsize > osize && ll->memory_limit != 0 &&
+       ll->memory - osize + nsize > ll->memory_limit) {
+      stats->lua_over_memory++;
+      return NULL;
+   }
+
+   uint8_t oclsid = ptr != NULL ? slabs_clsid(slabs, osize) : SLAB_LARGE;
+   uint8_t nclsid = slabs_clsid(slabs, nsize);
+   void* res;
+   if (ptr != NULL && oclsid == nclsid && nclsid != SLAB_LARGE) {
+      res = ptr;
+   } else if (ptr != NULL && oclsid == SLAB_LARGE && nclsid == SLAB_LARGE) {
+      res = realloc(ptr, nsize);
+   } else {
+      res = slabs_alloc(slabs, nsize, &nclsid);
+      if (res != NULL && ptr != NULL) {
+         memcpy(res, ptr, osize < nsize ? osize : nsize);
+         slabs_free(slabs, ptr, oclsid);
+      }
+   }
+
+   /*
+    * Lua counts on shrinking never failing, so a block which can't move
+    * down to a smaller class stays where it is. Freeing it later hands it
+    * to the smaller class, which it is big enough for.
+    */
+   if (res == NULL && ptr != NULL && nsize < osize) {
+      res = ptr;
+   }
+
+   if (res != NULL) {
+      if (nsize > osize) {
+         ll->gc_debt += nsize - osize;
+      }
+      ll->memory = ll->memory - osize + nsize;
+      stats->lua_allocated += nsize;
+      stats->lua_freed += osize;
+   }
+   return res;
+}
+
+static inline size_t gc_pause(struct luaeng* luaeng) {
+   return luaeng->config.gc_pause != 0 ? luaeng->config.gc_pause : LUA_GC_PAUSE;
+}
+
+/*
+ * Hooks are always called in protected mode, so this is a last resort
+ * (as with luaL_newstate()).
+ */
+static int lua_panic(lua_State* L) {
+   const char* msg = lua_tostring(L, -1);
+   fprintf(stderr, "unprotected lua error: %s\n", msg ? msg : "(no message)");
+   return 0;
+}
+
+static int push_wait_result(lua_State* L, struct async_wait* wait) {
+   if (wait->op != ASYNC_READ_FILE) {
+      return 0;
+   }
+   if (wait->error != 0) {
+      lua_pushnil(L);
+      lua_pushstring(L, strerror(wait->error));
+      return 2;
+   }
+   lua_pushlstring(L, wait->data != NULL ? wait->data : "", wait->len);
+   return 1;
+}
+
+/*
+ * Wait for the operation p describes. A hook run by run_hook() yields,
+ * which parks the request until the operation is complete; anywhere else
+ * (or with no async threads) the operation is carried out right away.
+ */
+static int wait_for(lua_State* L, struct luaeng_parked* p) {
+   struct luaeng_lua* ll = lua_owner(L);
+   if (ll != NULL && ll->resumable && L == ll->co) {
+      /* Left behind by a yield which failed (from inside a pcall) */
+      if (ll->parked != NULL) {
+         async_wait_clear(&ll->parked->wait);
+         free(ll->parked);
+      }
+      ll->parked = p;
+      return lua_yield(L, 0);
+   }
+
+   async_run(&p->wait);
+   int nres = push_wait_result(L, &p->wait);
+   async_wait_clear(&p->wait);
+   free(p);
+   return nres;
+}
+
+/* memcached.sleep(seconds) */
+static int lua_sleep(lua_State* L) {
+   lua_Number seconds = luaL_checknumber(L, 1);
+   struct luaeng_parked* p = calloc(1, sizeof(*p));
+   if (p == NULL) {
+      return luaL_error(L, "out of memory");
+   }
+   p->wait.op = ASYNC_SLEEP;
+   p->wait.deadline = monotonic_ns();
+   if (seconds > 0) {
+      p->wait.deadline += (uint64_t)(seconds * 1e9);
+   }
+   return wait_for(L, p);
+}
+
+/* memcached.read_file(path): the contents, or nil and an error message */
+static int lua_read_file(lua_State* L) {
+   const char* path = luaL_checkstring(L, 1);
+   struct luaeng_parked* p = calloc(1, sizeof(*p));
+   if (p == NULL || (p->wait.path = strdup(path)) == NULL) {
+      free(p);
+      return luaL_error(L, "out of memory");
+   }
+   p->wait.op = ASYNC_READ_FILE;
+   return wait_for(L, p);
+}
+
+/*
+ * memcached.schedule(interval, fn[, name]): call fn every interval
+ * seconds on a task thread, until it returns false. Every interpreter
+ * runs the script, so the tasks it schedules as it loads are shared out
+ * between the task threads, and only the interpreter of the thread a
+ * task goes to keeps it. Returns whether this interpreter keeps it.
+ */
+static int lua_schedule(lua_State* L) {
+   lua_Number seconds = luaL_checknumber(L, 1);
+   luaL_argcheck(L, seconds > 0, 1, "expected a positive interval");
+   luaL_checktype(L, 2, LUA_TFUNCTION);
+   const char* name = luaL_optstring(L, 3, NULL);
+
+   struct luaeng_lua* ll = lua_owner(L);
+   struct luaeng* luaeng = ll != NULL ? ll->engine : NULL;
+   struct luaeng_tld* tld = luaeng != NULL ?
+      pthread_getspecific(luaeng->tld) : NULL;
+   struct luaeng_task_thread* tt = tld != NULL ? tld->task_thread : NULL;
+   if (tt == NULL || (!tt->loading && tt->ll != ll)) {
+      lua_pushboolean(L, 0);
+      return 1;
+   }
+
+   int n = tt->nscheduled++;
+   if (tt->loading && n % luaeng->ntask_threads != tt->index) {
+      lua_pushboolean(L, 0);
+      return 1;
+   }
+
+   lua_pushvalue(L, 2);
+   int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   pthread_mutex_lock(&luaeng->tasks_lock);
+   struct luaeng_task** tasks = tt->loading ? &tt->loaded : &tt->tasks;
+   int* ntasks = tt->loading ? &tt->nloaded : &tt->ntasks;
+   int* size = tt->loading ? &tt->loaded_size : &tt->tasks_size;
+   if (*ntasks == *size) {
+      int grown = *size > 0 ? *size * 2 : 4;
+      struct luaeng_task* mem = realloc(*tasks, grown * sizeof(*mem));
+      if (mem == NULL) {
+         pthread_mutex_unlock(&luaeng->tasks_lock);
+         luaL_unref(L, LUA_REGISTRYINDEX, ref);
+         return luaL_error(L, "out of memory");
+      }
+      *tasks = mem;
+      *size = grown;
+   }
+   struct luaeng_task* task = &(*tasks)[(*ntasks)++];
+   memset(task, 0, sizeof(*task));
+   task->ref = ref;
+   if (name != NULL) {
+      snprintf(task->name, sizeof(task->name), "%s", name);
+   } else if (tt->loading) {
+      snprintf(task->name, sizeof(task->name), "task%d", n);
+   } else {
+      snprintf(task->name, sizeof(task->name), "task%d.%d", tt->index, n);
+   }
+   task->interval = (uint64_t)(seconds * 1e9);
+   if (task->interval == 0) {
+      task->interval = 1;
+   }
+   task->next_run = monotonic_ns() + task->interval;
+   pthread_cond_broadcast(&luaeng->tasks_cond);
+   pthread_mutex_unlock(&luaeng->tasks_lock);
+
+   lua_pushboolean(L, 1);
+   return 1;
+}
+
+/*
+ * Add the engine's functions to the table "memcached".
+ */
+static void register_functions(lua_State* L) {
+   static const luaL_Reg functions[] = {
+      { "sleep", lua_sleep },
+      { "read_file", lua_read_file },
+      { "schedule", lua_schedule },
+      { NULL, NULL }
+   };
+
+   lua_getglobal(L, "memcached");
+   for (int ii = 0; functions[ii].name != NULL; ++ii) {
+      lua_pushcfunction(L, functions[ii].func);
+      lua_setfield(L, -2, functions[ii].name);
+   }
+   lua_pop(L, 1);
+}
+
+static struct luaeng_lua* load_lua(struct luaeng* luaeng,
+                                   struct luaeng_bytecode* bc) {
+   struct luaeng_lua* ll = calloc(1, sizeof(*ll));
+   if (ll == NULL) {
+      return NULL;
+   }
+   ll->engine = luaeng;
+   ll->generation = bc->generation;
+   ll->memory_limit = luaeng->config.memory_limit;
+
+   lua_State* L = ll->L = lua_newstate(lua_alloc, ll);
+   if (L == NULL) {
+      free(ll);
+      return NULL;
+   }
+   lua_atpanic(L, lua_panic);
+   if (luaeng->config.gc_pause != 0) {
+      lua_gc(L, LUA_GCSETPAUSE, (int)luaeng->config.gc_pause);
+   }
+   if (luaeng->config.gc_stepmul != 0) {
+      lua_gc(L, LUA_GCSETSTEPMUL, (int)luaeng->config.gc_stepmul);
+   }
+
+   luaL_openlibs(L);
+   lua_pushlightuserdata(L, (void*)&lua_owner_key);
+   lua_pushlightuserdata(L, ll);
+   lua_rawset(L, LUA_REGISTRYINDEX);
+   register_constants(L);
+   register_functions(L);
+   store_register(L, &luaeng->store);
+   init_budget(luaeng, ll);
+   reset_budget(ll, monotonic_ns());
+
+   int err = luaL_loadbuffer(L, bc->data, bc->size, bc->name) ||
+      lua_pcall(L, 0, 0, 0);
+   if (err != 0) {
+      thread_stats(luaeng)->lua_create_errors++;
+      log_lua_error(luaeng, "script", L);
+      lua_close(L);
+      free(ll);
+      return NULL;
+   }
+
+   resolve_hooks(ll);
+   if (luaeng->config.gc_idle) {
+      lua_gc(L, LUA_GCSTOP, 0);
+      ll->gc_running = false;
+      ll->gc_debt = 0;
+      ll->gc_threshold = ll->memory / 100 * gc_pause(luaeng);
+   }
+   luaeng->evict_hook = has_hook(ll, LUAENG_HOOK_EVICT);
+   thread_stats(luaeng)->lua_created++;
+   return ll;
+}
+
+static struct luaeng_lua* create_lua(struct luaeng* luaeng) {
+   struct luaeng_bytecode* bc = get_bytecode(luaeng);
+   struct luaeng_lua* ll = load_lua(luaeng, bc);
+   put_bytecode(bc);
+   return ll;
+}
+
+static void close_lua(struct luaeng* luaeng, struct luaeng_lua* ll) {
+   lua_close(ll->L);
+   free(ll);
+   thread_stats(luaeng)->lua_closed++;
+}
+
+/*
+ * Remove the interpreters which have been idle for pool_idle seconds
+ * from the bottom of a pool (least recently used first) into out, up to
+ * TRIM_BATCH of them and keeping at least keep.
+ */
+static int take_idle_lua(struct luaeng* luaeng, struct luaeng_lua** pool,
+                         int* npool, int keep, rel_time_t now,
+                         struct luaeng_lua** out) {
+   rel_time_t idle = (rel_time_t)luaeng->config.pool_idle;
+   if (idle == 0) {
+      return 0;
+   }
+
+   int n = 0;
+   while (n < TRIM_BATCH && *npool - n > keep &&
+          pool[n]->idle_since + idle <= now) {
+      out[n] = pool[n];
+      n++;
+   }
+   if (n > 0) {
+      memmove(pool, pool + n, (*npool - n) * sizeof(*pool));
+      *npool -= n;
+   }
+   return n;
+}
+
+static void close_idle_lua(struct luaeng* luaeng, struct luaeng_lua** idle,
+                           int n) {
+   for (int ii = 0; ii < n; ++ii) {
+      close_lua(luaeng, idle[ii]);
+   }
+   thread_stats(luaeng)->lua_trimmed += n;
+}
+
+/*
+ * Pass an interpreter the calling thread has no room for to the shared
+ * pool, so a thread running short can use it rather than create its
+ * own. It is closed if the shared pool is full as well.
+ */
+static void shelve_lua(struct luaeng* luaeng, struct luaeng_lua* ll,
+                       rel_time_t now) {
+   struct luaeng_lua* idle[TRIM_BATCH];
+   bool shelved = false;
+
+   pthread_mutex_lock(&luaeng->lock);
+   int n = take_idle_lua(luaeng, luaeng->shared, &luaeng->nshared, 0, now, idle);
+   if ((size_t)luaeng->nshared < luaeng->config.pool_shared) {
+      luaeng->shared[luaeng->nshared++] = ll;
+      shelved = true;
+   }
+   pthread_mutex_unlock(&luaeng->lock);
+
+   close_idle_lua(luaeng, idle, n);
+   if (shelved) {
+      thread_stats(luaeng)->lua_shared_put++;
+   } else {
+      close_lua(luaeng, ll);
+      thread_stats(luaeng)->lua_discarded++;
+   }
+}
+
+static struct luaeng_lua* unshelve_lua(struct luaeng* luaeng) {
+   struct luaeng_lua* ll = NULL;
+   pthread_mutex_lock(&luaeng->lock);
+   if (luaeng->nshared > 0) {
+      ll = luaeng->shared[--luaeng->nshared];
+   }
+   pthread_mutex_unlock(&luaeng->lock);
+   return ll;
+}
+
+/*
+ * Hand a thread its share of the interpreters created by prewarm_lua()
+ * at startup, as it first needs one (so threads which only touch the
+ * store, like the snapshot thread, don't take any).
+ */
+static void adopt_spare_lua(struct luaeng* luaeng, struct luaeng_tld* tld) {
+   pthread_mutex_lock(&luaeng->lock);
+   for (size_t ii = 0; ii < luaeng->config.prewarm && luaeng->nspare > 0 &&
+           tld->free_stack_top + 1 < tld->free_stack_size; ++ii) {
+      tld->free_stack[++tld->free_stack_top] = luaeng->spare[--luaeng->nspare];
+   }
+   pthread_mutex_unlock(&luaeng->lock);
+}
+
+static struct luaeng_tld* get_tld(struct luaeng* luaeng) {
    struct luaeng_tld* tld = pthread_getspecific(luaeng->tld);
    if (tld == NULL) {
+      size_t pool_max = luaeng->config.pool_max;
       tld = calloc(1, sizeof(*tld));
-      pthread_setspecific(luaeng->tld, tld);
+      if (tld != NULL && pool_max > 0) {
+         tld->free_stack = calloc(pool_max, sizeof(*tld->free_stack));
+         if (tld->free_stack == NULL) {
+            free(tld);
+            tld = NULL;
+         }
+      }
+      if (tld != NULL) {
+         tld->engine = luaeng;
+         tld->free_stack_top = -1;
+         tld->free_stack_size = (int)pool_max;
+         pthread_setspecific(luaeng->tld, tld);
+         slabs_register_cache(&luaeng->slabs, &tld->slabs);
+         slabs_register_cache(&luaeng->lua_slabs, &tld->lua_slabs);
+
+         pthread_mutex_lock(&luaeng->lock);
+         tld->next = luaeng->tlds;
+         luaeng->tlds = tld;
+         pthread_mutex_unlock(&luaeng->lock);
+      }
+   }
+   return tld;
+}
+
+/*
+ * Destructor of the thread local data, run as a thread exits. Its idle
+ * interpreters go to the shared pool, and its stats are kept so the
+ * totals don't go backwards.
+ */
+static void release_tld(void* arg) {
+   struct luaeng_tld* tld = arg;
+   struct luaeng* luaeng = tld->engine;
+
+   /* Whatever is freed below goes to this thread's stats and slab cache */
+   pthread_setspecific(luaeng->tld, tld);
+
+   while (tld->nevicted > 0) {
+      store_item_release(&luaeng->store, tld->evicted[--tld->nevicted]);
+   }
+   rel_time_t now = luaeng->server.get_current_time();
+   while (tld->free_stack_top >= 0) {
+      struct luaeng_lua* ll = tld->free_stack[tld->free_stack_top--];
+      if (ll->generation == luaeng->generation) {
+         shelve_lua(luaeng, ll, now);
+      } else {
+         close_lua(luaeng, ll);
+      }
+   }
+
+   pthread_setspecific(luaeng->tld, NULL);
+   slabs_unregister_cache(&luaeng->slabs, &tld->slabs);
+   slabs_unregister_cache(&luaeng->lua_slabs, &tld->lua_slabs);
+
+   pthread_mutex_lock(&luaeng->lock);
+   struct luaeng_tld** prev = &luaeng->tlds;
+   while (*prev != NULL && *prev != tld) {
+      prev = &(*prev)->next;
+   }
+   if (*prev != NULL) {
+      *prev = tld->next;
+   }
+   add_thread_stats(&luaeng->stats.departed, &tld->stats, false);
+   pthread_mutex_unlock(&luaeng->lock);
+
+   free(tld->free_stack);
+   free(tld);
+}
+
+static struct slab_cache* get_slab_cache(void* arg) {
+   struct luaeng_tld* tld = get_tld(arg);
+   return tld != NULL ? &tld->slabs : NULL;
+}
+
+static struct slab_cache* get_lua_slab_cache(void* arg) {
+   struct luaeng_tld* tld = get_tld(arg);
+   return tld != NULL ? &tld->lua_slabs : NULL;
+}
+
+/*
+ * Take the thread's most recently used interpreter, or one from the
+ * shared pool, and only create one if both are empty.
+ */
+static struct luaeng_lua* acquire_lua(struct luaeng* luaeng) {
+   struct luaeng_lua* ll = NULL;
+
+   struct luaeng_tld* tld = get_tld(luaeng);
+   uint32_t generation = luaeng->generation;
+
+   if (tld != NULL && !tld->adopted) {
+      tld->adopted = true;
+      adopt_spare_lua(luaeng, tld);
    }
 
-   if (tld != NULL &&
-       tld->free_stack != NULL &&
-       tld->free_stack_top >= 0) {
-      L = tld->free_stack[tld->free_stack_top];
+   while (ll == NULL && tld != NULL && tld->free_stack_top >= 0) {
+      ll = tld->free_stack[tld->free_stack_top];
       tld->free_stack[tld->free_stack_top] = NULL;
       tld->free_stack_top--;
+
+      /* Left over from before a reload */
+      if (ll->generation != generation) {
+         close_lua(luaeng, ll);
+         ll = NULL;
+      }
    }
 
-   if (L == NULL) {
-      L = create_lua(luaeng);
+   while (ll == NULL && (ll = unshelve_lua(luaeng)) != NULL) {
+      thread_stats(luaeng)->lua_shared_get++;
+      if (ll->generation != generation) {
+         close_lua(luaeng, ll);
+         ll = NULL;
+      }
+   }
+
+   if (ll == NULL) {
+      ll = create_lua(luaeng);
+   }
+
+   return ll;
+}
+
+/*
+ * Check the outcome of a hook call which left nres results (or an
+ * error) on the stack.
+ */
+static ENGINE_ERROR_CODE hook_result(struct luaeng* luaeng,
+                                     struct luaeng_lua* ll,
+                                     enum luaeng_hook hook,
+                                     int err, int nres) {
+   struct luaeng_thread_stats* stats = thread_stats(luaeng);
+   if (err == 0 && ll->over_budget) {
+      /* The script caught the error raised by budget_hook() */
+      lua_pop(ll->L, nres);
+      lua_pushliteral(ll->L, "budget exceeded");
+      err = LUA_ERRRUN;
+   }
+   if (err == 0) {
+      return ENGINE_SUCCESS;
+   }
+
+   if (ll->over_budget) {
+      stats->lua_over_budget++;
+   }
+   stats->lua_errors++;
+   log_lua_error(luaeng, hook_names[hook], ll->L);
+   ll->failed = true;
+   return err == LUA_ERRMEM ? ENGINE_ENOMEM : ENGINE_FAILED;
+}
+
+/*
+ * Call a hook pushed on the stack below its nargs arguments, recording
+ * the time it took. Failures are logged and counted, and the interpreter
+ * is marked to be discarded when released.
+ */
+static ENGINE_ERROR_CODE call_hook(struct luaeng* luaeng,
+                                   struct luaeng_lua* ll,
+                                   enum luaeng_hook hook,
+                                   int nargs, int nres) {
+   struct luaeng_thread_stats* stats = thread_stats(luaeng);
+   uint64_t start = monotonic_ns();
+   reset_budget(ll, start);
+   int err = lua_pcall(ll->L, nargs, nres, 0);
+   histogram_record(&stats->timings[hook], monotonic_ns() - start);
+   return hook_result(luaeng, ll, hook, err, nres);
+}
+
+static void parked_done(struct async_wait* wait) {
+   struct luaeng_parked* p = (struct luaeng_parked*)wait;
+   p->engine->server.notify_io_complete(p->cookie, ENGINE_SUCCESS);
+}
+
+/*
+ * Keep the interpreter aside while its hook waits for the operation it
+ * yielded with. The server calls the engine again with the same cookie
+ * once we tell it the operation is complete. Returns false, leaving the
+ * request to wait in place, if async_parked requests already wait.
+ */
+static bool park_lua(struct luaeng* luaeng, struct luaeng_lua* ll,
+                     const void* cookie, enum luaeng_hook hook) {
+   struct luaeng_parked* p = ll->parked;
+   p->engine = luaeng;
+   p->ll = ll;
+   p->cookie = cookie;
+   p->hook = hook;
+   p->wait.done = parked_done;
+
+   pthread_mutex_lock(&luaeng->lock);
+   if ((size_t)luaeng->nparked >= luaeng->config.async_parked) {
+      pthread_mutex_unlock(&luaeng->lock);
+      return false;
+   }
+   p->prev = NULL;
+   p->next = luaeng->parked;
+   if (p->next != NULL) {
+      p->next->prev = p;
+   }
+   luaeng->parked = p;
+   luaeng->nparked++;
+   pthread_mutex_unlock(&luaeng->lock);
+
+   luaeng->server.store_engine_specific(cookie, p);
+   async_submit(&luaeng->async, &p->wait);
+   return true;
+}
+
+static void unpark_lua(struct luaeng* luaeng, struct luaeng_parked* p) {
+   pthread_mutex_lock(&luaeng->lock);
+   if (p->prev != NULL) {
+      p->prev->next = p->next;
+   } else {
+      luaeng->parked = p->next;
+   }
+   if (p->next != NULL) {
+      p->next->prev = p->prev;
+   }
+   luaeng->nparked--;
+   pthread_mutex_unlock(&luaeng->lock);
+}
+
+/*
+ * The interpreter for a request: the one parked for it if the server is
+ * calling back after a wait, or any other.
+ */
+static struct luaeng_lua* acquire_request_lua(struct luaeng* luaeng,
+                                              const void* cookie,
+                                              enum luaeng_hook hook) {
+   struct luaeng_parked* p = NULL;
+   if (luaeng->async.nthreads > 0) {
+      p = luaeng->server.get_engine_specific(cookie);
+   }
+   if (p != NULL) {
+      luaeng->server.store_engine_specific(cookie, NULL);
+      unpark_lua(luaeng, p);
+      if (p->hook == hook) {
+         return p->ll;
+      }
+
+      /* Not the call it was parked in; drop the suspended hook */
+      struct luaeng_lua* ll = p->ll;
+      ll->parked = NULL;
+      async_wait_clear(&p->wait);
+      free(p);
+      luaL_unref(ll->L, LUA_REGISTRYINDEX, ll->co_ref);
+      ll->co_ref = LUA_NOREF;
+      ll->co = NULL;
+      release_lua(luaeng, ll);
+   }
+   return acquire_lua(luaeng);
+}
+
+static int new_coroutine(lua_State* L) {
+   struct luaeng_lua* ll = lua_touserdata(L, 1);
+   lua_State* co = lua_newthread(L);
+   ll->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+   ll->co = co;
+   return 0;
+}
+
+static int push_parked_result(lua_State* L) {
+   struct luaeng_parked* p = lua_touserdata(L, 1);
+   lua_pop(L, 1);
+   return push_wait_result(L, &p->wait);
+}
+
+/*
+ * Like call_hook(), for the hooks of requests which may wait: the hook
+ * runs in the interpreter's coroutine, and if it yields to wait for an
+ * operation the request is parked and ENGINE_EWOULDBLOCK returned. When
+ * the server calls back, acquire_request_lua() hands over the parked
+ * interpreter, and this resumes the hook with the result of the
+ * operation instead of starting it. nargs is only used when starting.
+ */
+static ENGINE_ERROR_CODE run_hook(struct luaeng* luaeng,
+                                  struct luaeng_lua* ll,
+                                  const void* cookie,
+                                  enum luaeng_hook hook,
+                                  int nargs, int nres) {
+   /* A shard's interpreter can't be set aside while others wait for it */
+   if (luaeng->async.nthreads == 0 || ll->shard != NULL) {
+      return call_hook(luaeng, ll, hook, nargs, nres);
+   }
+
+   struct luaeng_thread_stats* stats = thread_stats(luaeng);
+   lua_State* L = ll->L;
+   uint64_t start = monotonic_ns();
+   int err = 0;
+   int narg = nargs;
+
+   if (ll->co == NULL) {
+      err = lua_cpcall(L, new_coroutine, ll);
+   }
+
+   struct luaeng_parked* p = ll->parked;
+   if (err == 0 && p != NULL) {
+      /* Resuming: the result of the wait is what the hook gets back */
+      ll->parked = NULL;
+      int top = lua_gettop(L);
+      lua_pushcfunction(L, push_parked_result);
+      lua_pushlightuserdata(L, p);
+      err = lua_pcall(L, 1, LUA_MULTRET, 0);
+      async_wait_clear(&p->wait);
+      free(p);
+      narg = lua_gettop(L) - top;
+      if (ll->budget_step != 0 && ll->time_limit != 0) {
+         ll->deadline = start + ll->time_limit;
+      }
+   } else if (err == 0) {
+      reset_budget(ll, start);
+      ll->hook_ns = 0;
+      narg = nargs;
+      nargs++;
+   }
+
+   if (err == 0) {
+      lua_State* co = ll->co;
+      lua_xmove(L, co, p != NULL ? narg : nargs);
+      ll->resumable = true;
+      err = lua_resume(co, narg);
+      ll->resumable = false;
+
+      while (err == LUA_YIELD && ll->parked != NULL) {
+         stats->lua_waits++;
+         if (park_lua(luaeng, ll, cookie, hook)) {
+            ll->hook_ns += monotonic_ns() - start;
+            return ENGINE_EWOULDBLOCK;
+         }
+
+         /* Too many requests parked already: wait here and carry on */
+         p = ll->parked;
+         ll->parked = NULL;
+         async_run(&p->wait);
+         lua_pushcfunction(L, push_parked_result);
+         lua_pushlightuserdata(L, p);
+         int top = lua_gettop(L) - 2;
+         err = lua_pcall(L, 1, LUA_MULTRET, 0);
+         async_wait_clear(&p->wait);
+         free(p);
+         if (err != 0) {
+            /* Where the error of the hook itself would be */
+            lua_xmove(L, co, 1);
+            break;
+         }
+         narg = lua_gettop(L) - top;
+         lua_xmove(L, co, narg);
+         if (ll->budget_step != 0 && ll->time_limit != 0) {
+            ll->deadline = monotonic_ns() + ll->time_limit;
+         }
+         ll->resumable = true;
+         err = lua_resume(co, narg);
+         ll->resumable = false;
+      }
+      ll->hook_ns += monotonic_ns() - start;
+      histogram_record(&stats->timings[hook], ll->hook_ns);
+
+      if (err == 0) {
+         lua_settop(co, nres);
+         lua_xmove(co, L, nres);
+      } else if (err == LUA_YIELD) {
+         lua_pushliteral(L, "hooks can only yield by waiting for an operation");
+         err = LUA_ERRRUN;
+      } else {
+         lua_xmove(co, L, 1);
+      }
+   }
+
+   /* A wait which failed to yield (from inside a pcall) */
+   if (ll->parked != NULL) {
+      async_wait_clear(&ll->parked->wait);
+      free(ll->parked);
+      ll->parked = NULL;
+   }
+   return hook_result(luaeng, ll, hook, err, nres);
+}
+
+/*
+ * Called by the store for every item it evicts to make room. The script
+ * is told about them when the thread releases its interpreter, so we
+ * never call into lua from inside the store (or from inside a hook).
+ */
+static void store_evicted(void* arg, hash_item* it) {
+   struct luaeng* luaeng = arg;
+   if (!luaeng->evict_hook) {
+      return;
+   }
+
+   struct luaeng_tld* tld = pthread_getspecific(luaeng->tld);
+   if (tld != NULL && tld->nevicted < LUAENG_EVICT_QUEUE) {
+      __sync_add_and_fetch(&it->refcount, 1);
+      tld->evicted[tld->nevicted++] = it;
+   }
+}
+
+/*
+ * Pass the items queued by store_evicted() to memcached_evict(key, value,
+ * flags). Items the hook evicts in turn are passed on as well, up to a
+ * limit so it can't keep us here forever.
+ */
+static void notify_evictions(struct luaeng* luaeng, struct luaeng_lua* ll,
+                             struct luaeng_tld* tld) {
+   lua_State* L = ll->L;
+
+   for (int n = 0; tld->nevicted > 0; ++n) {
+      hash_item* it = tld->evicted[--tld->nevicted];
+      if (n < LUAENG_EVICT_QUEUE && !ll->failed &&
+          has_hook(ll, LUAENG_HOOK_EVICT)) {
+         push_hook(ll, LUAENG_HOOK_EVICT);
+         lua_pushlstring(L, item_get_key(&it->item), it->item.nkey);
+         lua_pushlstring(L, item_get_data(&it->item), it->item.nbytes);
+         marshal_push_u32(L, it->item.flags);
+         call_hook(luaeng, ll, LUAENG_HOOK_EVICT, 3, 0);
+      }
+      store_item_release(&luaeng->store, it);
+   }
+}
+
+struct gc_step {
+   int size;
+   bool cycle;
+};
+
+static int gc_step(lua_State* L) {
+   struct gc_step* step = lua_touserdata(L, 1);
+   step->cycle = lua_gc(L, LUA_GCSTEP, step->size) != 0;
+   lua_gc(L, LUA_GCSTOP, 0);
+   return 0;
+}
+
+/*
+ * With gc_idle the collector is stopped while hooks run, and catches up
+ * here, before the interpreter goes back to the pool, on what the call
+ * allocated. It does as much work as it would have done during the call
+ * and waits for the memory in use to grow by gc_pause percent after a
+ * full cycle, like the collector does by itself.
+ */
+static void idle_gc(struct luaeng* luaeng, struct luaeng_lua* ll) {
+   if (ll->gc_running) {
+      lua_gc(ll->L, LUA_GCSTOP, 0);
+      ll->gc_running = false;
+   }
+   if (ll->gc_debt == 0) {
+      return;
+   }
+   if (ll->memory < ll->gc_threshold) {
+      ll->gc_debt = 0;
+      return;
+   }
+
+   struct luaeng_thread_stats* stats = thread_stats(luaeng);
+   size_t kb = ll->gc_debt / 1024 + 1;
+   struct gc_step step = { .size = kb < INT_MAX ? (int)kb : INT_MAX };
+   ll->gc_debt = 0;
+
+   uint64_t start = monotonic_ns();
+   reset_budget(ll, start);
+   /* A step may run __gc metamethods, which may fail */
+   if (lua_cpcall(ll->L, gc_step, &step) != 0) {
+      stats->lua_errors++;
+      log_lua_error(luaeng, "gc", ll->L);
+      ll->failed = true;
    }
+   histogram_record(&stats->gc_timing, monotonic_ns() - start);
 
-   return L;
+   stats->lua_gc_steps++;
+   if (step.cycle) {
+      stats->lua_gc_cycles++;
+      ll->gc_threshold = ll->memory / 100 * gc_pause(luaeng);
+   }
 }
 
-static void release_lua(struct luaeng* luaeng, lua_State* L) {
+static void release_lua(struct luaeng* luaeng, struct luaeng_lua* ll) {
    struct luaeng_tld* tld = pthread_getspecific(luaeng->tld);
-   if (tld != NULL) {
-      tld->free_stack_top++;
-      assert(tld->free_stack_top >= 0);
-      if (tld->free_stack_top >= tld->free_stack_size) {
-         tld->free_stack_size = tld->free_stack_size * 2;
-         if (tld->free_stack_size < INIT_FREE_STACK_SIZE) {
-            tld->free_stack_size = INIT_FREE_STACK_SIZE;
+
+   if (tld != NULL && tld->nevicted > 0) {
+      notify_evictions(luaeng, ll, tld);
+   }
+
+   /* An interpreter which failed may be in any state; start afresh */
+   if (ll->failed || ll->generation != luaeng->generation || tld == NULL) {
+      close_lua(luaeng, ll);
+      return;
+   }
+
+   lua_settop(ll->L, 0);
+   if (luaeng->config.gc_idle) {
+      idle_gc(luaeng, ll);
+      if (ll->failed) {
+         close_lua(luaeng, ll);
+         return;
+      }
+   }
+
+   rel_time_t now = luaeng->server.get_current_time();
+   ll->idle_since = now;
+   if (tld->free_stack_top + 1 < tld->free_stack_size) {
+      tld->free_stack[++tld->free_stack_top] = ll;
+   } else {
+      shelve_lua(luaeng, ll, now);
+   }
+
+   /* Close the interpreters a burst of requests left behind */
+   struct luaeng_lua* idle[TRIM_BATCH];
+   int nfree = tld->free_stack_top + 1;
+   int n = take_idle_lua(luaeng, tld->free_stack, &nfree,
+                         (int)luaeng->config.pool_min, now, idle);
+   tld->free_stack_top = nfree - 1;
+   close_idle_lua(luaeng, idle, n);
+}
+
+/*
+ * Take the interpreter of a shard, waiting for the thread using it if
+ * need be, and (re)create it if it is missing or left over from before a
+ * reload. The shard stays locked until released with unlock_shard_lua().
+ */
+static struct luaeng_lua* lock_shard_lua(struct luaeng* luaeng,
+                                         struct luaeng_shard* shard) {
+   if (pthread_mutex_trylock(&shard->lock) != 0) {
+      __sync_add_and_fetch(&shard->contended, 1);
+      pthread_mutex_lock(&shard->lock);
+   }
+   shard->requests++;
+
+   struct luaeng_lua* ll = shard->ll;
+   if (ll != NULL && ll->generation != luaeng->generation) {
+      close_lua(luaeng, ll);
+      ll = shard->ll = NULL;
+   }
+   if (ll == NULL) {
+      ll = shard->ll = create_lua(luaeng);
+      if (ll == NULL) {
+         pthread_mutex_unlock(&shard->lock);
+         return NULL;
+      }
+      ll->shard = shard;
+   }
+   return ll;
+}
+
+static void unlock_shard_lua(struct luaeng* luaeng, struct luaeng_lua* ll) {
+   struct luaeng_shard* shard = ll->shard;
+
+   lua_settop(ll->L, 0);
+   if (luaeng->config.gc_idle && !ll->failed) {
+      idle_gc(luaeng, ll);
+   }
+   if (ll->failed) {
+      close_lua(luaeng, ll);
+      shard->ll = NULL;
+   }
+   pthread_mutex_unlock(&shard->lock);
+}
+
+static inline struct luaeng_shard* key_shard(struct luaeng* luaeng,
+                                             const void* key, size_t nkey) {
+   uint32_t hash = luaeng->server.hash(key, nkey, 0);
+   return &luaeng->shards[hash % luaeng->nshards];
+}
+
+/*
+ * Release the interpreter of a shard. Evictions caused meanwhile are
+ * passed to the interpreter owning each key, one shard at a time.
+ */
+static void release_shard_lua(struct luaeng* luaeng, struct luaeng_lua* ll) {
+   unlock_shard_lua(luaeng, ll);
+
+   struct luaeng_tld* tld = pthread_getspecific(luaeng->tld);
+   for (int n = 0; tld != NULL && tld->nevicted > 0; ++n) {
+      hash_item* it = tld->evicted[--tld->nevicted];
+      const void* key = item_get_key(&it->item);
+      struct luaeng_lua* owner = NULL;
+      if (n < LUAENG_EVICT_QUEUE) {
+         owner = lock_shard_lua(luaeng, key_shard(luaeng, key, it->item.nkey));
+      }
+      if (owner != NULL) {
+         if (has_hook(owner, LUAENG_HOOK_EVICT)) {
+            push_hook(owner, LUAENG_HOOK_EVICT);
+            lua_pushlstring(owner->L, key, it->item.nkey);
+            lua_pushlstring(owner->L, item_get_data(&it->item), it->item.nbytes);
+            marshal_push_u32(owner->L, it->item.flags);
+            call_hook(luaeng, owner, LUAENG_HOOK_EVICT, 3, 0);
          }
-         tld->free_stack = realloc(tld->free_stack, tld->free_stack_size * sizeof(lua_State*));
+         unlock_shard_lua(luaeng, owner);
       }
-      tld->free_stack[tld->free_stack_top] = L;
+      store_item_release(&luaeng->store, it);
    }
 }
 
-/**
- * call_lua_va(L, "f", "dd>d", x, y, &z);
- *
- * The string "dd>d" means "two arguments of type double, one result of type double".
+/*
+ * The interpreter for a request on a key: the one of the key's shard if
+ * configured, otherwise one from the pools. Released with
+ * release_key_lua().
  */
-static void call_lua_va(lua_State *L, const char *func, const char *sig, ...) {
-  va_list vl;
-  int narg, nres;  /* number of arguments and results */
+static struct luaeng_lua* acquire_key_lua(struct luaeng* luaeng,
+                                          const void* cookie,
+                                          enum luaeng_hook hook,
+                                          const void* key, size_t nkey) {
+   if (luaeng->nshards > 0) {
+      /* For the stats and slab caches of this thread */
+      get_tld(luaeng);
+      return lock_shard_lua(luaeng, key_shard(luaeng, key, nkey));
+   }
+   return acquire_request_lua(luaeng, cookie, hook);
+}
 
-  const char *sig_in = sig;
+static void release_key_lua(struct luaeng* luaeng, struct luaeng_lua* ll) {
+   if (ll->shard != NULL) {
+      release_shard_lua(luaeng, ll);
+   } else {
+      release_lua(luaeng, ll);
+   }
+}
 
-  va_start(vl, sig);
+static ENGINE_ERROR_CODE create_shards(struct luaeng* luaeng) {
+   int n = (int)luaeng->config.shards;
+   if (n == 0) {
+      return ENGINE_SUCCESS;
+   }
+   if (posix_memalign((void**)&luaeng->shards, 64,
+                      n * sizeof(*luaeng->shards)) != 0) {
+      luaeng->shards = NULL;
+      return ENGINE_ENOMEM;
+   }
+   memset(luaeng->shards, 0, n * sizeof(*luaeng->shards));
+   for (int ii = 0; ii < n; ++ii) {
+      pthread_mutex_init(&luaeng->shards[ii].lock, NULL);
+   }
+   luaeng->nshards = n;
+
+   /* Created up front, like prewarm, to keep it off the request path */
+   for (int ii = 0; ii < n; ++ii) {
+      struct luaeng_shard* shard = &luaeng->shards[ii];
+      struct luaeng_lua* ll = lock_shard_lua(luaeng, shard);
+      if (ll == NULL) {
+         return ENGINE_FAILED;
+      }
+      unlock_shard_lua(luaeng, ll);
+      shard->requests = 0;
+   }
+   return ENGINE_SUCCESS;
+}
 
-  lua_getglobal(L, func);  /* get function */
+static void destroy_shards(struct luaeng* luaeng) {
+   for (int ii = 0; ii < luaeng->nshards; ++ii) {
+      struct luaeng_shard* shard = &luaeng->shards[ii];
+      if (shard->ll != NULL) {
+         close_lua(luaeng, shard->ll);
+      }
+      pthread_mutex_destroy(&shard->lock);
+   }
+   free(luaeng->shards);
+   luaeng->shards = NULL;
+   luaeng->nshards = 0;
+}
 
-  /* push arguments */
-  narg = 0;
-  while (*sig) {  /* push arguments */
-    switch (*sig++) {
-    case 'd':  /* double argument */
-      lua_pushnumber(L, va_arg(vl, double));
-      break;
+/*
+ * (Re)create the interpreter of a task thread, which schedules its share
+ * of the script's tasks as it loads. These replace the tasks of the
+ * previous one, but when it is replaced after a failure (rather than a
+ * reload) the tasks of the same name keep their schedule and stats, so a
+ * failing task doesn't hold the others back.
+ */
+static void load_task_lua(struct luaeng* luaeng, struct luaeng_task_thread* tt) {
+   struct luaeng_lua* old = tt->ll;
+   uint32_t generation = luaeng->generation;
+
+   tt->nscheduled = 0;
+   tt->nloaded = 0;
+   tt->loading = true;
+   struct luaeng_lua* ll = create_lua(luaeng);
+   tt->loading = false;
+
+   pthread_mutex_lock(&luaeng->tasks_lock);
+   for (int ii = 0; ii < tt->nloaded && old != NULL &&
+           tt->generation == generation; ++ii) {
+      struct luaeng_task* task = &tt->loaded[ii];
+      for (int jj = 0; jj < tt->ntasks; ++jj) {
+         if (strcmp(task->name, tt->tasks[jj].name) == 0) {
+            int ref = task->ref;
+            uint64_t interval = task->interval;
+            *task = tt->tasks[jj];
+            task->ref = ref;
+            task->interval = interval;
+            break;
+         }
+      }
+   }
+   struct luaeng_task* tasks = tt->tasks;
+   int size = tt->tasks_size;
+   tt->tasks = tt->loaded;
+   tt->ntasks = tt->nloaded;
+   tt->tasks_size = tt->loaded_size;
+   tt->loaded = tasks;
+   tt->nloaded = 0;
+   tt->loaded_size = size;
+   tt->ll = ll;
+   tt->generation = ll != NULL ? ll->generation : generation;
+   pthread_mutex_unlock(&luaeng->tasks_lock);
+
+   if (old != NULL) {
+      close_lua(luaeng, old);
+   }
+}
 
-    case 'i':  /* int argument */
-      lua_pushnumber(L, va_arg(vl, int));
-      break;
+/*
+ * Run the due task at idx. Called with tasks_lock held, which is
+ * released while the task runs so that it can schedule others.
+ */
+static void run_task(struct luaeng* luaeng, struct luaeng_task_thread* tt,
+                     int idx, uint64_t now) {
+   struct luaeng_lua* ll = tt->ll;
+   lua_State* L = ll->L;
+   int ref = tt->tasks[idx].ref;
+   uint64_t delay = now - tt->tasks[idx].next_run;
+   pthread_mutex_unlock(&luaeng->tasks_lock);
+
+   struct luaeng_thread_stats* stats = thread_stats(luaeng);
+   uint64_t start = monotonic_ns();
+   reset_budget(ll, start);
+   lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+   int err = lua_pcall(L, 0, 1, 0);
+   uint64_t end = monotonic_ns();
+   histogram_record(&stats->task_timing, end - start);
+   stats->lua_task_runs++;
+
+   if (err == 0 && ll->over_budget) {
+      lua_pop(L, 1);
+      lua_pushliteral(L, "budget exceeded");
+      err = LUA_ERRRUN;
+   }
+   bool cancel = false;
+   if (err == 0) {
+      cancel = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+   } else {
+      if (ll->over_budget) {
+         stats->lua_over_budget++;
+      }
+      stats->lua_errors++;
+      log_lua_error(luaeng, "task", L);
+      ll->failed = true;
+   }
+   lua_settop(L, 0);
+   if (cancel) {
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+   }
 
-    case 's':  /* string argument */
-      lua_pushstring(L, va_arg(vl, char *));
-      break;
+   struct luaeng_tld* tld = pthread_getspecific(luaeng->tld);
+   if (tld->nevicted > 0) {
+      notify_evictions(luaeng, ll, tld);
+   }
+   if (luaeng->config.gc_idle && !ll->failed) {
+      idle_gc(luaeng, ll);
+   }
 
-    case '>':
-      goto endwhile;
-
-    default:
-      fprintf(stderr, "call_lua_va: invalid option (%c) calling %s (%s)\n", *(sig - 1), func, sig_in);
-      exit(EXIT_FAILURE);
-    }
-    narg++;
-    luaL_checkstack(L, 1, "call_lua_va: too many arguments");
-  } endwhile:
-
-  /* do the call */
-  nres = strlen(sig);  /* number of expected results */
-  if (lua_pcall(L, narg, nres, 0) != 0) { /* do the call */
-    fprintf(stderr, "call_lua_va: error running function %s (%s): %s\n",
-            func, sig_in, lua_tostring(L, -1));
-    exit(EXIT_FAILURE);
-  }
-
-  /* retrieve results */
-  nres = -nres;  /* stack index of first result */
-  while (*sig) {  /* get results */
-    switch (*sig++) {
-    case 'd':  /* double result */
-      if (!lua_isnumber(L, nres)) {
-        fprintf(stderr, "call_lua_va: wrong result type after calling %s (%s) - double was expected\n", func, sig_in);
-        exit(EXIT_FAILURE);
-      }
-      *va_arg(vl, double *) = lua_tonumber(L, nres);
-      break;
+   /* Only this thread removes tasks, so idx still holds this one */
+   pthread_mutex_lock(&luaeng->tasks_lock);
+   struct luaeng_task* task = &tt->tasks[idx];
+   task->runs++;
+   task->errors += err != 0;
+   task->last_ns = end - start;
+   if (task->last_ns > task->max_ns) {
+      task->max_ns = task->last_ns;
+   }
+   if (delay > task->max_delay) {
+      task->max_delay = delay;
+   }
+   /* Runs missed while falling behind are skipped, not made up for */
+   task->next_run += task->interval;
+   if (task->next_run <= end) {
+      task->next_run = end + task->interval;
+   }
+   if (cancel) {
+      *task = tt->tasks[--tt->ntasks];
+   }
+}
 
-    case 'i':  /* int result */
-      if (!lua_isnumber(L, nres)) {
-        fprintf(stderr, "call_lua_va: wrong result type after calling %s (%s) - int was expected\n", func, sig_in);
-        exit(EXIT_FAILURE);
+static void* task_thread(void* arg) {
+   struct luaeng_task_thread* tt = arg;
+   struct luaeng* luaeng = tt->engine;
+
+   /* The stats and allocations of the interpreter go to this thread */
+   struct luaeng_tld* tld = get_tld(luaeng);
+   if (tld == NULL) {
+      fprintf(stderr, "task thread %d: out of memory\n", tt->index);
+      return NULL;
+   }
+   tld->adopted = true;
+   tld->task_thread = tt;
+   load_task_lua(luaeng, tt);
+
+   pthread_mutex_lock(&luaeng->tasks_lock);
+   while (!luaeng->tasks_stopping) {
+      if (tt->generation != luaeng->generation ||
+          (tt->ll != NULL && tt->ll->failed)) {
+         pthread_mutex_unlock(&luaeng->tasks_lock);
+         load_task_lua(luaeng, tt);
+         pthread_mutex_lock(&luaeng->tasks_lock);
+         continue;
       }
-      *va_arg(vl, int *) = (int)lua_tonumber(L, nres);
-      break;
 
-    case 's':  /* string result */
-      if (!lua_isstring(L, nres)) {
-        fprintf(stderr, "call_lua_va: wrong result type after calling %s (%s)- string was expected\n", func, sig_in);
-        exit(EXIT_FAILURE);
+      int next = -1;
+      for (int ii = 0; ii < tt->ntasks; ++ii) {
+         if (next == -1 || tt->tasks[ii].next_run < tt->tasks[next].next_run) {
+            next = ii;
+         }
       }
-      *va_arg(vl, const char **) = lua_tostring(L, nres);
-      break;
 
-    default:
-      fprintf(stderr, "call_lua_va: invalid option (%c) calling %s (%s)\n", *(sig - 1), func, sig_in);
-      exit(EXIT_FAILURE);
-    }
-    nres++;
-  }
+      uint64_t now = monotonic_ns();
+      if (next == -1) {
+         pthread_cond_wait(&luaeng->tasks_cond, &luaeng->tasks_lock);
+      } else if (tt->tasks[next].next_run > now) {
+         uint64_t deadline = tt->tasks[next].next_run;
+         struct timespec ts = { deadline / 1000000000, deadline % 1000000000 };
+         pthread_cond_timedwait(&luaeng->tasks_cond, &luaeng->tasks_lock, &ts);
+      } else {
+         run_task(luaeng, tt, next, now);
+      }
+   }
+   pthread_mutex_unlock(&luaeng->tasks_lock);
+
+   if (tt->ll != NULL) {
+      close_lua(luaeng, tt->ll);
+      tt->ll = NULL;
+   }
+   return NULL;
+}
+
+static ENGINE_ERROR_CODE start_task_threads(struct luaeng* luaeng) {
+   int n = (int)luaeng->config.task_threads;
+   if (n == 0) {
+      return ENGINE_SUCCESS;
+   }
+   luaeng->task_threads = calloc(n, sizeof(*luaeng->task_threads));
+   if (luaeng->task_threads == NULL) {
+      return ENGINE_ENOMEM;
+   }
+   luaeng->ntask_threads = n;
+   for (int ii = 0; ii < n; ++ii) {
+      struct luaeng_task_thread* tt = &luaeng->task_threads[ii];
+      tt->engine = luaeng;
+      tt->index = ii;
+      if (pthread_create(&tt->thread, NULL, task_thread, tt) != 0) {
+         return ENGINE_FAILED;
+      }
+      tt->started = true;
+   }
+   return ENGINE_SUCCESS;
+}
+
+static void stop_task_threads(struct luaeng* luaeng) {
+   pthread_mutex_lock(&luaeng->tasks_lock);
+   luaeng->tasks_stopping = true;
+   pthread_cond_broadcast(&luaeng->tasks_cond);
+   pthread_mutex_unlock(&luaeng->tasks_lock);
+
+   for (int ii = 0; ii < luaeng->ntask_threads; ++ii) {
+      struct luaeng_task_thread* tt = &luaeng->task_threads[ii];
+      if (tt->started) {
+         pthread_join(tt->thread, NULL);
+      }
+      free(tt->tasks);
+      free(tt->loaded);
+   }
+   free(luaeng->task_threads);
+   luaeng->task_threads = NULL;
+   luaeng->ntask_threads = 0;
+}
+
+static int bytecode_writer(lua_State* UNUSED(L), const void* p,
+                           size_t sz, void* ud) {
+   struct luaeng_bytecode *bc = ud;
+   if (bc->size + sz > bc->capacity) {
+      size_t capacity = bc->capacity ? bc->capacity : 4096;
+      while (capacity < bc->size + sz) {
+         capacity *= 2;
+      }
+      char *data = realloc(bc->data, capacity);
+      if (data == NULL) {
+         return 1;
+      }
+      bc->data = data;
+      bc->capacity = capacity;
+   }
+   memcpy(bc->data + bc->size, p, sz);
+   bc->size += sz;
+   return 0;
+}
+
+/*
+ * Load and compile the script once, keeping the dumped bytecode so that
+ * new interpreters don't have to read or parse the file. The new
+ * bytecode is returned in *out with a single reference.
+ */
+static ENGINE_ERROR_CODE compile_script(struct luaeng* luaeng,
+                                        struct luaeng_bytecode** out) {
+   const char *script = luaeng->config.script;
+   if (script == NULL) {
+      script = DEFAULT_SCRIPT;
+   }
+
+   struct luaeng_bytecode* bc = calloc(1, sizeof(*bc));
+   if (bc == NULL) {
+      return ENGINE_ENOMEM;
+   }
+   bc->refcount = 1;
+
+   lua_State* L = lua_open();
+   if (L == NULL) {
+      put_bytecode(bc);
+      return ENGINE_ENOMEM;
+   }
+
+   ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+   if (luaL_loadfile(L, script) != 0) {
+      fprintf(stderr, "script error: %s\n", lua_tostring(L, -1));
+      ret = ENGINE_FAILED;
+   } else if (lua_dump(L, bytecode_writer, bc) != 0) {
+      ret = ENGINE_ENOMEM;
+   } else {
+      size_t len = strlen(script);
+      bc->name = malloc(len + 2);
+      if (bc->name == NULL) {
+         ret = ENGINE_ENOMEM;
+      } else {
+         bc->name[0] = '@';
+         memcpy(bc->name + 1, script, len + 1);
+      }
+   }
+
+   lua_close(L);
+
+   if (ret == ENGINE_SUCCESS) {
+      *out = bc;
+   } else {
+      put_bytecode(bc);
+   }
+   return ret;
+}
+
+/*
+ * Compile the script again and make it the current one. Threads replace
+ * their interpreters running the previous version as they come across
+ * them in acquire_lua(); the data in the store is left untouched.
+ */
+static ENGINE_ERROR_CODE reload_script(struct luaeng* luaeng) {
+   pthread_mutex_lock(&luaeng->reload_lock);
+
+   struct luaeng_bytecode* bc = NULL;
+   struct luaeng_lua* ll = NULL;
+   struct luaeng_lua** shared = NULL;
+   ENGINE_ERROR_CODE ret = compile_script(luaeng, &bc);
+   if (ret == ENGINE_SUCCESS) {
+      /* Make sure the new script runs before switching over to it */
+      bc->generation = luaeng->generation + 1;
+      ll = load_lua(luaeng, bc);
+      if (ll == NULL) {
+         put_bytecode(bc);
+         ret = ENGINE_FAILED;
+      }
+   }
+
+   /* The shared pool starts out empty, in an array of its own */
+   if (ret == ENGINE_SUCCESS && luaeng->config.pool_shared > 0) {
+      shared = calloc(luaeng->config.pool_shared, sizeof(*shared));
+      if (shared == NULL) {
+         close_lua(luaeng, ll);
+         put_bytecode(bc);
+         ret = ENGINE_ENOMEM;
+      }
+   }
+
+   if (ret == ENGINE_SUCCESS) {
+      /* Interpreters are closed after dropping the lock */
+      pthread_mutex_lock(&luaeng->lock);
+      struct luaeng_bytecode* old = luaeng->bytecode;
+      luaeng->bytecode = bc;
+      luaeng->generation = bc->generation;
+      int nspare = luaeng->nspare;
+      luaeng->nspare = 0;
+      struct luaeng_lua** old_shared = luaeng->shared;
+      int nshared = luaeng->nshared;
+      luaeng->shared = shared;
+      luaeng->nshared = 0;
+      pthread_mutex_unlock(&luaeng->lock);
+
+      /* Nothing is added to the spares after startup */
+      while (nspare > 0) {
+         close_lua(luaeng, luaeng->spare[--nspare]);
+      }
+      while (nshared > 0) {
+         close_lua(luaeng, old_shared[--nshared]);
+      }
+      free(old_shared);
+
+      put_bytecode(old);
+      release_lua(luaeng, ll);
+      thread_stats(luaeng)->lua_reloads++;
+
+      /* The task threads switch over right away */
+      pthread_mutex_lock(&luaeng->tasks_lock);
+      pthread_cond_broadcast(&luaeng->tasks_cond);
+      pthread_mutex_unlock(&luaeng->tasks_lock);
+   }
+
+   pthread_mutex_unlock(&luaeng->reload_lock);
+   return ret;
+}
+
+/*
+ * Create prewarm interpreters for each worker thread up front so that the
+ * first requests on a thread don't pay for it.
+ */
+static ENGINE_ERROR_CODE prewarm_lua(struct luaeng* luaeng) {
+   size_t total = luaeng->config.prewarm * luaeng->config.threads;
+   if (total == 0) {
+      return ENGINE_SUCCESS;
+   }
+
+   luaeng->spare = calloc(total, sizeof(*luaeng->spare));
+   if (luaeng->spare == NULL) {
+      return ENGINE_ENOMEM;
+   }
+
+   while (luaeng->nspare < (int)total) {
+      struct luaeng_lua *ll = create_lua(luaeng);
+      if (ll == NULL) {
+         return ENGINE_FAILED;
+      }
+      luaeng->spare[luaeng->nspare++] = ll;
+   }
 
-  va_end(vl);
+   return ENGINE_SUCCESS;
 }
 
 static ENGINE_ERROR_CODE luaeng_engine_initialize(ENGINE_HANDLE* handle,
@@ -323,7 +1873,65 @@ static ENGINE_ERROR_CODE luaeng_engine_initialize(ENGINE_HANDLE* handle,
       return ret;
    }
 
-   return ENGINE_SUCCESS;
+   if (!slabs_init(&se->slabs, se->config.slab_factor, get_slab_cache, se) ||
+       !slabs_init_range(&se->lua_slabs, LUA_SMALL_MIN, LUA_SMALL_MAX,
+                         SLAB_DEFAULT_FACTOR, get_lua_slab_cache, se)) {
+      return ENGINE_ENOMEM;
+   }
+
+   if (!store_init(&se->store, se->config.store_stripes, se->server.hash,
+                   se->server.get_current_time, &se->slabs)) {
+      return ENGINE_ENOMEM;
+   }
+   store_set_limit(&se->store, se->config.cache_size, store_evicted, se);
+
+   if (se->config.pool_shared > 0) {
+      se->shared = calloc(se->config.pool_shared, sizeof(*se->shared));
+      if (se->shared == NULL) {
+         return ENGINE_ENOMEM;
+      }
+   }
+
+   /*
+    * A damaged snapshot is only logged; the engine starts out empty. The
+    * journal holds everything the snapshot does and more, so the snapshot
+    * is only loaded without one.
+    */
+   snapshot_init(&se->snapshot, &se->store, se->config.snapshot,
+                 (uint32_t)se->config.snapshot_interval);
+   if (!journal_init(&se->journal, &se->store, se->config.journal,
+                     se->config.journal_sync)) {
+      return ENGINE_EINVAL;
+   }
+   bool replayed;
+   if (!journal_replay(&se->journal, &replayed)) {
+      return ENGINE_FAILED;
+   }
+   if (!replayed) {
+      snapshot_load(&se->snapshot, (int)se->config.threads);
+   }
+   if (!snapshot_start(&se->snapshot) || !journal_start(&se->journal)) {
+      return ENGINE_FAILED;
+   }
+
+   if (!async_start(&se->async, (int)se->config.async_threads)) {
+      return ENGINE_FAILED;
+   }
+
+   ret = compile_script(se, &se->bytecode);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = prewarm_lua(se);
+   if (ret == ENGINE_SUCCESS) {
+      ret = create_shards(se);
+   }
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   return start_task_threads(se);
 }
 
 static ENGINE_ERROR_CODE initalize_configuration(struct luaeng *se,
@@ -334,16 +1942,96 @@ static ENGINE_ERROR_CODE initalize_configuration(struct luaeng *se,
       struct config_item items[] = {
          { .key = "verbose",
            .datatype = DT_SIZE,
-           .value.dt_size = &se->config.verbose },
-         { .key = "script",
-           .datatype = DT_STRING,
-           .value.dt_string = &se->config.script },
+           .value.dt_size = &se->config.verbose },
+         { .key = "script",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.script },
+         { .key = "store_stripes",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.store_stripes },
+         { .key = "threads",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.threads },
+         { .key = "prewarm",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.prewarm },
+         { .key = "pool_min",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.pool_min },
+         { .key = "pool_max",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.pool_max },
+         { .key = "pool_shared",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.pool_shared },
+         { .key = "pool_idle",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.pool_idle },
+         { .key = "slab_factor",
+           .datatype = DT_FLOAT,
+           .value.dt_float = &se->config.slab_factor },
+         { .key = "instruction_limit",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.instruction_limit },
+         { .key = "time_limit",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.time_limit },
+         { .key = "cache_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.cache_size },
+         { .key = "memory_limit",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.memory_limit },
+         { .key = "gc_pause",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.gc_pause },
+         { .key = "gc_stepmul",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.gc_stepmul },
+         { .key = "gc_idle",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.gc_idle },
+         { .key = "command_min",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.command_min },
+         { .key = "command_max",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.command_max },
+         { .key = "snapshot",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.snapshot },
+         { .key = "snapshot_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.snapshot_interval },
+         { .key = "journal",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.journal },
+         { .key = "journal_sync",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.journal_sync },
+         { .key = "async_threads",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.async_threads },
+         { .key = "async_parked",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.async_parked },
+         { .key = "task_threads",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.task_threads },
+         { .key = "shards",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.shards },
          { .key = NULL }
       };
 
       ret = se->server.parse_config(cfg_str, items, stderr);
    }
 
+   /* A thread only adopts as many spares as its pool holds */
+   if (se->config.prewarm > se->config.pool_max) {
+      se->config.prewarm = se->config.pool_max;
+   }
+
    return ENGINE_SUCCESS;
 }
 
@@ -351,14 +2039,68 @@ static void luaeng_engine_destroy(ENGINE_HANDLE* handle) {
    struct luaeng* se = get_handle(handle);
 
    if (se->initialized) {
+      stop_task_threads(se);
+      snapshot_stop(&se->snapshot);
+      snapshot_destroy(&se->snapshot);
+      journal_stop(&se->journal);
+      journal_destroy(&se->journal);
+
+      /* Requests still parked were given up on by their connections */
+      async_stop(&se->async);
+      while (se->parked != NULL) {
+         struct luaeng_parked* p = se->parked;
+         se->parked = p->next;
+         close_lua(se, p->ll);
+         async_wait_clear(&p->wait);
+         free(p);
+      }
+      se->nparked = 0;
+      async_destroy(&se->async);
+      while (se->nspare > 0) {
+         close_lua(se, se->spare[--se->nspare]);
+      }
+      free(se->spare);
+      destroy_shards(se);
+      while (se->nshared > 0) {
+         close_lua(se, se->shared[--se->nshared]);
+      }
+      free(se->shared);
+      for (struct luaeng_tld* tld = se->tlds; tld != NULL; tld = tld->next) {
+         while (tld->nevicted > 0) {
+            store_item_release(&se->store, tld->evicted[--tld->nevicted]);
+         }
+         while (tld->free_stack_top >= 0) {
+            close_lua(se, tld->free_stack[tld->free_stack_top--]);
+         }
+      }
+      put_bytecode(se->bytecode);
+      store_destroy(&se->store);
+      slabs_destroy(&se->slabs);
+      slabs_destroy(&se->lua_slabs);
+
+      /* The threads' data goes with the engine rather than as they exit */
+      pthread_key_delete(se->tld);
+      while (se->tlds != NULL) {
+         struct luaeng_tld* next = se->tlds->next;
+         free(se->tlds->free_stack);
+         free(se->tlds);
+         se->tlds = next;
+      }
       pthread_mutex_destroy(&se->lock);
+      pthread_mutex_destroy(&se->reload_lock);
+      pthread_mutex_destroy(&se->tasks_lock);
+      pthread_cond_destroy(&se->tasks_cond);
       pthread_mutex_destroy(&se->stats.lock);
+      free(se->config.script);
+      free(se->config.snapshot);
+      free(se->config.journal);
+      free(se->config.journal_sync);
       se->initialized = false;
       free(se);
    }
 }
 
-static ENGINE_ERROR_CODE luaeng_item_allocate(ENGINE_HANDLE* UNUSED(handle),
+static ENGINE_ERROR_CODE luaeng_item_allocate(ENGINE_HANDLE* handle,
                                               const void* UNUSED(cookie),
                                               item **item_out,
                                               const void* key,
@@ -366,26 +2108,89 @@ static ENGINE_ERROR_CODE luaeng_item_allocate(ENGINE_HANDLE* UNUSED(handle),
                                               const size_t nbytes,
                                               const int flags,
                                               const rel_time_t exptime) {
-   size_t ntotal = sizeof(item) + nkey + nbytes;
-   item *it = malloc(ntotal);
+   struct luaeng* se = get_handle(handle);
+   hash_item *it = store_item_alloc(&se->store, key, nkey, nbytes, flags, exptime);
    if (it != NULL) {
-      it->exptime = exptime;
-      it->nbytes = nbytes;
-      it->flags = flags;
-      it->nkey = nkey;
-      it->iflag = 0;
-      memcpy((void*) (it + 1), key, nkey);
-      *item_out = it;
+      *item_out = &it->item;
       return ENGINE_SUCCESS;
    } else {
       return ENGINE_ENOMEM;
    }
 }
 
-static void luaeng_item_release(ENGINE_HANDLE* UNUSED(handle),
+static void luaeng_item_release(ENGINE_HANDLE* handle,
                                 const void* UNUSED(cookie),
                                 item* it) {
-  free(it);
+   struct luaeng* se = get_handle(handle);
+   store_item_release(&se->store, ITEM_HEADER(it));
+}
+
+/*
+ * Convert the result of a get hook into an item. The value at stack index
+ * idx is either an item handle from store:ref(), or a string followed by
+ * flags, exptime and cas in the next three slots. Expired values are
+ * misses; flags, exptime or cas which aren't integers that fit are logged
+ * and give ENGINE_EINVAL.
+ */
+static ENGINE_ERROR_CODE lua_to_item(ENGINE_HANDLE* handle,
+                                     const void* UNUSED(cookie),
+                                     lua_State* L, int idx,
+                                     const void* key, const int nkey,
+                                     item** it) {
+   struct luaeng* se = get_handle(handle);
+   *it = NULL;
+
+   /* A handle to a stored item is passed on to the server without a copy */
+   hash_item *ref = store_to_item(L, idx);
+   if (ref != NULL) {
+      if (store_item_expired(&se->store, ref)) {
+         store_item_release(&se->store, ref);
+         return ENGINE_KEY_ENOENT;
+      }
+      *it = &ref->item;
+      return ENGINE_SUCCESS;
+   }
+
+   size_t val_len = 0;
+   const char* val = lua_tolstring(L, idx, &val_len);
+   if (val == NULL) {
+      return ENGINE_KEY_ENOENT;
+   }
+
+   uint32_t it_flg, it_exp;
+   uint64_t it_cas;
+   if (!marshal_result_u32(L, idx + 1, &it_flg) ||
+       !marshal_result_u32(L, idx + 2, &it_exp) ||
+       !marshal_result_u64(L, idx + 3, &it_cas)) {
+      lua_pushliteral(L, "invalid flags, exptime or cas in a result");
+      log_lua_error(se, "get", L);
+      lua_pop(L, 1);
+      return ENGINE_EINVAL;
+   }
+
+   if (it_exp != 0 && it_exp <= se->server.get_current_time()) {
+      return ENGINE_KEY_ENOENT;
+   }
+
+   hash_item *hit = store_item_alloc(&se->store, key, nkey, val_len,
+                                     it_flg, it_exp);
+   if (hit == NULL) {
+      return ENGINE_ENOMEM;
+   }
+   memcpy(item_get_data(&hit->item), val, val_len);
+   hit->cas = it_cas;
+   *it = &hit->item;
+   return ENGINE_SUCCESS;
+}
+
+/*
+ * Look up a key directly in the store, for scripts without a get hook.
+ */
+static ENGINE_ERROR_CODE native_get(struct luaeng* se, item** it,
+                                    const void* key, const int nkey) {
+   hash_item *hit = store_get(&se->store, key, nkey);
+   *it = hit != NULL ? &hit->item : NULL;
+   return hit != NULL ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT;
 }
 
 static ENGINE_ERROR_CODE luaeng_item_get(ENGINE_HANDLE* handle,
@@ -394,169 +2199,933 @@ static ENGINE_ERROR_CODE luaeng_item_get(ENGINE_HANDLE* handle,
                                          const void* key,
                                          const int nkey) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
-
-   ENGINE_ERROR_CODE res = ENGINE_KEY_ENOENT;
+   struct luaeng_lua *ll = acquire_key_lua(se, cookie, LUAENG_HOOK_GET,
+                                           key, nkey);
+   if (ll == NULL) {
+      return ENGINE_FAILED;
+   }
+   lua_State *L = ll->L;
 
-   *it = NULL;
+   ENGINE_ERROR_CODE res;
 
-   lua_getglobal(L, "memcached_get");
-   lua_pushlstring(L, key, nkey);
+   if (has_hook(ll, LUAENG_HOOK_GET)) {
+      if (ll->parked == NULL) {
+         push_hook(ll, LUAENG_HOOK_GET);
+         lua_pushlstring(L, key, nkey);
+      }
 
-   int nres = 3;
+      res = run_hook(se, ll, cookie, LUAENG_HOOK_GET, 1, 4);
+      if (res == ENGINE_EWOULDBLOCK) {
+         return res;
+      }
+      if (res == ENGINE_SUCCESS) {
+         res = lua_to_item(handle, cookie, L, lua_gettop(L) - 3, key, nkey, it);
+      }
+   } else {
+      res = native_get(se, it, key, nkey);
+   }
 
-   if (lua_pcall(L, 1, nres, 0) != 0) {
-      fprintf(stderr, "memcached_get lua error: %s\n", lua_tostring(L, -1));
-      exit(EXIT_FAILURE);
+   struct luaeng_thread_stats* stats = thread_stats(se);
+   stats->cmd_get++;
+   if (res == ENGINE_SUCCESS) {
+      stats->get_hits++;
+   } else {
+      stats->get_misses++;
    }
 
-   nres = -nres;
+   release_key_lua(se, ll);
+   return res;
+}
 
-   size_t val_len = 0;
-   const char* val = lua_tolstring(L, nres++, &val_len);
-   if (val != NULL) {
-      int it_flg = (int) lua_tonumber(L, nres++);
-      int it_exp = (int) lua_tonumber(L, nres++);
+/*
+ * With shards, each key of a batch is looked up in the interpreter owning
+ * it, as a get of its own; memcached_get_multi isn't used.
+ */
+static ENGINE_ERROR_CODE shard_get_multi(ENGINE_HANDLE* handle,
+                                         const void* cookie, int nkeys,
+                                         const char** keys,
+                                         const uint16_t* lens, item** items) {
+   ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
 
-      if (luaeng_item_allocate(handle, cookie, it, key, nkey, val_len, it_flg, it_exp) == ENGINE_SUCCESS) {
-         memcpy(item_get_data(*it), val, val_len);
+   memset(items, 0, nkeys * sizeof(item*));
+
+   for (int ii = 0; ii < nkeys && res == ENGINE_SUCCESS; ++ii) {
+      res = luaeng_item_get(handle, cookie, &items[ii], keys[ii], lens[ii]);
+      /* Only a failing hook or a malformed result fails the batch */
+      if (res != ENGINE_FAILED && res != ENGINE_ENOMEM && res != ENGINE_EINVAL) {
+         if (res != ENGINE_SUCCESS) {
+            items[ii] = NULL;
+         }
          res = ENGINE_SUCCESS;
       }
    }
 
-   release_lua(se, L);
+   if (res != ENGINE_SUCCESS) {
+      for (int ii = 0; ii < nkeys; ++ii) {
+         if (items[ii] != NULL) {
+            luaeng_item_release(handle, cookie, items[ii]);
+            items[ii] = NULL;
+         }
+      }
+   }
+   return res;
+}
+
+/*
+ * Look up a batch of keys with a single interpreter. If the script
+ * defines memcached_get_multi(keys) it gets all the keys in one call and
+ * returns a table with the result for each position: nil, an item handle,
+ * a string, or a table { value, flags, exptime, cas }. Otherwise
+ * memcached_get is called for each key. Misses are left as NULL in items,
+ * and no items are returned if a hook fails or returns a malformed result.
+ */
+static ENGINE_ERROR_CODE get_multi(ENGINE_HANDLE* handle, const void* cookie, int nkeys,
+                      const char** keys, const uint16_t* lens, item** items) {
+   struct luaeng* se = get_handle(handle);
+   if (se->nshards > 0) {
+      return shard_get_multi(handle, cookie, nkeys, keys, lens, items);
+   }
+
+   struct luaeng_lua *ll = acquire_lua(se);
+   if (ll == NULL) {
+      return ENGINE_FAILED;
+   }
+   lua_State *L = ll->L;
+
+   ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
+
+   memset(items, 0, nkeys * sizeof(item*));
+
+   if (has_hook(ll, LUAENG_HOOK_GET_MULTI)) {
+      push_hook(ll, LUAENG_HOOK_GET_MULTI);
+      lua_createtable(L, nkeys, 0);
+      for (int ii = 0; ii < nkeys; ++ii) {
+         lua_pushlstring(L, keys[ii], lens[ii]);
+         lua_rawseti(L, -2, ii + 1);
+      }
+
+      res = call_hook(se, ll, LUAENG_HOOK_GET_MULTI, 1, 1);
+
+      int results = lua_gettop(L);
+      if (res == ENGINE_SUCCESS && lua_istable(L, results)) {
+         for (int ii = 0; ii < nkeys; ++ii) {
+            lua_rawgeti(L, results, ii + 1);
+            if (lua_istable(L, -1)) {
+               int entry = lua_gettop(L);
+               for (int jj = 1; jj <= 4; ++jj) {
+                  lua_rawgeti(L, entry, jj);
+               }
+            } else {
+               lua_pushnil(L);
+               lua_pushnil(L);
+               lua_pushnil(L);
+            }
+            res = lua_to_item(handle, cookie, L, lua_gettop(L) - 3,
+                              keys[ii], lens[ii], &items[ii]);
+            lua_settop(L, results);
+            /* A malformed entry fails the batch, as it fails a get */
+            if (res == ENGINE_KEY_ENOENT) {
+               res = ENGINE_SUCCESS;
+            } else if (res != ENGINE_SUCCESS) {
+               break;
+            }
+         }
+      }
+   } else if (has_hook(ll, LUAENG_HOOK_GET)) {
+      for (int ii = 0; ii < nkeys && res == ENGINE_SUCCESS; ++ii) {
+         push_hook(ll, LUAENG_HOOK_GET);
+         lua_pushlstring(L, keys[ii], lens[ii]);
+
+         res = call_hook(se, ll, LUAENG_HOOK_GET, 1, 4);
+         if (res == ENGINE_SUCCESS) {
+            res = lua_to_item(handle, cookie, L, lua_gettop(L) - 3,
+                              keys[ii], lens[ii], &items[ii]);
+            if (res == ENGINE_KEY_ENOENT) {
+               res = ENGINE_SUCCESS;
+            }
+         }
+         lua_settop(L, 0);
+      }
+   } else {
+      for (int ii = 0; ii < nkeys; ++ii) {
+         native_get(se, &items[ii], keys[ii], lens[ii]);
+      }
+   }
+
+   if (res != ENGINE_SUCCESS) {
+      for (int ii = 0; ii < nkeys; ++ii) {
+         if (items[ii] != NULL) {
+            luaeng_item_release(handle, cookie, items[ii]);
+            items[ii] = NULL;
+         }
+      }
+   }
+
+   struct luaeng_thread_stats* stats = thread_stats(se);
+   stats->cmd_get += nkeys;
+   for (int ii = 0; ii < nkeys; ++ii) {
+      if (items[ii] != NULL) {
+         stats->get_hits++;
+      } else {
+         stats->get_misses++;
+      }
+   }
+
+   release_lua(se, ll);
    return res;
 }
 
 static ENGINE_ERROR_CODE luaeng_item_store(ENGINE_HANDLE* handle,
-                                           const void* UNUSED(cookie),
+                                           const void* cookie,
                                            item* it,
-                                           uint64_t* UNUSED(cas),
+                                           uint64_t* cas,
                                            ENGINE_STORE_OPERATION operation) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
+   struct luaeng_lua *ll = acquire_key_lua(se, cookie, LUAENG_HOOK_STORE,
+                                           item_get_key(it), it->nkey);
+   if (ll == NULL) {
+      return ENGINE_FAILED;
+   }
+   lua_State *L = ll->L;
 
    ENGINE_ERROR_CODE res = ENGINE_NOT_STORED;
 
-   lua_getglobal(L, "memcached_store");
+   if (has_hook(ll, LUAENG_HOOK_STORE)) {
+      if (ll->parked == NULL) {
+         push_hook(ll, LUAENG_HOOK_STORE);
 
-   lua_pushlstring(L, item_get_key(it), it->nkey);
-   lua_pushnumber(L, operation);
-   lua_pushlstring(L, item_get_data(it), it->nbytes);
-   lua_pushnumber(L, it->flags);
-   lua_pushnumber(L, it->exptime);
+         lua_pushlstring(L, item_get_key(it), it->nkey);
+         lua_pushinteger(L, operation);
+         lua_pushlstring(L, item_get_data(it), it->nbytes);
+         marshal_push_u32(L, it->flags);
+         marshal_push_u32(L, it->exptime);
+         marshal_push_u64(L, item_get_cas(it));
+      }
+
+      res = run_hook(se, ll, cookie, LUAENG_HOOK_STORE, 6, 2);
+      if (res == ENGINE_EWOULDBLOCK) {
+         return res;
+      }
+      if (res == ENGINE_SUCCESS) {
+         res = lua_to_status(se, L, -2, ENGINE_NOT_STORED);
+      }
+      if (res == ENGINE_SUCCESS) {
+         if (marshal_result_u64(L, -1, cas)) {
+            item_set_cas(it, *cas);
+         } else {
+            res = ENGINE_EINVAL;
+         }
+      }
+   } else {
+      /* Without a hook the server's item is linked as is, without a copy */
+      res = store_item(&se->store, ITEM_HEADER(it), item_get_cas(it),
+                       operation);
+      if (res == ENGINE_SUCCESS) {
+         *cas = item_get_cas(it);
+      }
+   }
 
-   if (lua_pcall(L, 5, 1, 0) != 0) {
-      fprintf(stderr, "memcached_store lua error: %s\n", lua_tostring(L, -1));
-      exit(EXIT_FAILURE);
+   struct luaeng_thread_stats* stats = thread_stats(se);
+   if (operation >= 0 && operation <= OPERATION_CAS) {
+      stats->cmd_store[operation]++;
+   }
+   if (res == ENGINE_SUCCESS) {
+      stats->total_items++;
    }
 
-   release_lua(se, L);
+   release_key_lua(se, ll);
    return res;
 }
 
 static ENGINE_ERROR_CODE luaeng_item_remove(ENGINE_HANDLE* handle,
-                                            const void* UNUSED(cookie),
+                                            const void* cookie,
                                             const void* key,
                                             const size_t nkey,
-                                            uint64_t UNUSED(cas)) {
+                                            uint64_t cas) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
+   struct luaeng_lua *ll = acquire_key_lua(se, cookie, LUAENG_HOOK_REMOVE,
+                                           key, nkey);
+   if (ll == NULL) {
+      return ENGINE_FAILED;
+   }
+   lua_State *L = ll->L;
 
    ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
 
-   lua_getglobal(L, "memcached_remove");
-   lua_pushlstring(L, key, nkey);
+   if (has_hook(ll, LUAENG_HOOK_REMOVE)) {
+      if (ll->parked == NULL) {
+         push_hook(ll, LUAENG_HOOK_REMOVE);
+         lua_pushlstring(L, key, nkey);
+         marshal_push_u64(L, cas);
+      }
 
-   if (lua_pcall(L, 1, 1, 0) != 0) {
-      fprintf(stderr, "memcached_remove lua error: %s\n", lua_tostring(L, -1));
-      exit(EXIT_FAILURE);
+      res = run_hook(se, ll, cookie, LUAENG_HOOK_REMOVE, 2, 1);
+      if (res == ENGINE_EWOULDBLOCK) {
+         return res;
+      }
+      if (res == ENGINE_SUCCESS) {
+         res = lua_to_status(se, L, -1, ENGINE_KEY_ENOENT);
+      }
+   } else {
+      res = store_unlink(&se->store, key, nkey, cas);
    }
+   thread_stats(se)->cmd_remove++;
 
-   release_lua(se, L);
+   release_key_lua(se, ll);
    return res;
 }
 
+/*
+ * Counters are handled natively on the shared store unless the script
+ * defines memcached_arithmetic(key, increment, create, delta, initial,
+ * exptime), which returns status, result, cas.
+ */
 static ENGINE_ERROR_CODE luaeng_item_arithmetic(ENGINE_HANDLE* handle,
-                                                const void* UNUSED(cookie),
-                                                const void* UNUSED(key),
-                                                const int UNUSED(nkey),
-                                                const bool UNUSED(increment),
-                                                const bool UNUSED(create),
-                                                const uint64_t UNUSED(delta),
-                                                const uint64_t UNUSED(initial),
-                                                const rel_time_t UNUSED(exptime),
-                                                uint64_t* UNUSED(cas),
-                                                uint64_t* UNUSED(result)) {
+                                                const void* cookie,
+                                                const void* key,
+                                                const int nkey,
+                                                const bool increment,
+                                                const bool create,
+                                                const uint64_t delta,
+                                                const uint64_t initial,
+                                                const rel_time_t exptime,
+                                                uint64_t* cas,
+                                                uint64_t* result) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
+   struct luaeng_lua *ll = acquire_key_lua(se, cookie, LUAENG_HOOK_ARITHMETIC,
+                                           key, nkey);
+   if (ll == NULL) {
+      return ENGINE_FAILED;
+   }
+   lua_State *L = ll->L;
+
+   ENGINE_ERROR_CODE res;
+
+   if (has_hook(ll, LUAENG_HOOK_ARITHMETIC)) {
+      if (ll->parked == NULL) {
+         push_hook(ll, LUAENG_HOOK_ARITHMETIC);
+         lua_pushlstring(L, key, nkey);
+         lua_pushboolean(L, increment);
+         lua_pushboolean(L, create);
+         marshal_push_u64(L, delta);
+         marshal_push_u64(L, initial);
+         marshal_push_u32(L, exptime);
+      }
+
+      res = run_hook(se, ll, cookie, LUAENG_HOOK_ARITHMETIC, 6, 3);
+      if (res == ENGINE_EWOULDBLOCK) {
+         return res;
+      }
+      if (res == ENGINE_SUCCESS) {
+         res = lua_to_status(se, L, -3, ENGINE_KEY_ENOENT);
+      }
+      if (res == ENGINE_SUCCESS &&
+          (!marshal_to_u64(L, -2, result) || !marshal_result_u64(L, -1, cas))) {
+         res = ENGINE_EINVAL;
+      }
+   } else {
+      res = store_arithmetic(&se->store, key, nkey, increment, create,
+                             delta, initial, exptime, cas, result);
+   }
+   thread_stats(se)->cmd_arithmetic++;
+
+   release_key_lua(se, ll);
+   return res;
+}
+
+static ENGINE_ERROR_CODE flush_hook(struct luaeng* se, struct luaeng_lua* ll,
+                                    rel_time_t at) {
+   ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
 
-   ENGINE_ERROR_CODE res = ENGINE_KEY_ENOENT;
+   if (has_hook(ll, LUAENG_HOOK_FLUSH)) {
+      push_hook(ll, LUAENG_HOOK_FLUSH);
+      marshal_push_u32(ll->L, at);
 
-   release_lua(se, L);
+      res = call_hook(se, ll, LUAENG_HOOK_FLUSH, 1, 1);
+      if (res == ENGINE_SUCCESS) {
+         res = lua_to_status(se, ll->L, -1, ENGINE_FAILED);
+      }
+   }
    return res;
 }
 
+/*
+ * The store is flushed for every interpreter at once, in constant time,
+ * whether or not the script defines memcached_flush(when). The hook is
+ * still called for any side effects of its own, with the time of the
+ * flush on the server's clock (0 for now).
+ */
 static ENGINE_ERROR_CODE luaeng_flush(ENGINE_HANDLE* handle,
                                       const void* UNUSED(cookie),
                                       time_t when) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
+   rel_time_t at = when != 0 ? se->server.realtime(when) : 0;
+
+   store_flush(&se->store, at);
+   thread_stats(se)->cmd_flush++;
+
+   /* Each shard's interpreter keeps data of its own the hook may clear */
+   if (se->nshards > 0) {
+      get_tld(se);
+      ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
+      for (int ii = 0; ii < se->nshards && res == ENGINE_SUCCESS; ++ii) {
+         struct luaeng_lua *ll = lock_shard_lua(se, &se->shards[ii]);
+         if (ll == NULL) {
+            return ENGINE_FAILED;
+         }
+         res = flush_hook(se, ll, at);
+         release_shard_lua(se, ll);
+      }
+      return res;
+   }
 
-   ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
+   struct luaeng_lua *ll = acquire_lua(se);
+   if (ll == NULL) {
+      return ENGINE_FAILED;
+   }
+
+   ENGINE_ERROR_CODE res = flush_hook(se, ll, at);
+   release_lua(se, ll);
+   return res;
+}
 
-   int i = 0;
+/*
+ * Add (or subtract) one set of thread stats to another. They consist of
+ * nothing but uint64_t counters, so we can treat them as an array.
+ */
+static void add_thread_stats(struct luaeng_thread_stats* total,
+                             const struct luaeng_thread_stats* stats,
+                             bool subtract) {
+   uint64_t* dst = (uint64_t*)total;
+   const uint64_t* src = (const uint64_t*)stats;
+   for (size_t ii = 0; ii < sizeof(*total) / sizeof(uint64_t); ++ii) {
+      dst[ii] = subtract ? dst[ii] - src[ii] : dst[ii] + src[ii];
+   }
+}
 
-   call_lua_va(L, "memcached_flush", "i>i", when, &i);
+/*
+ * Sum up the stats of all threads. The counters are read while their
+ * threads may be updating them, which is fine for stats.
+ */
+static void collect_stats(struct luaeng* se, struct luaeng_thread_stats* total,
+                          int* idle) {
+   memset(total, 0, sizeof(*total));
+   *idle = 0;
+
+   pthread_mutex_lock(&se->lock);
+   for (struct luaeng_tld* tld = se->tlds; tld != NULL; tld = tld->next) {
+      add_thread_stats(total, &tld->stats, false);
+      *idle += tld->free_stack_top + 1;
+   }
+   add_thread_stats(total, &se->stats.departed, false);
+   *idle += se->nspare + se->nshared;
+   pthread_mutex_unlock(&se->lock);
 
-   release_lua(se, L);
-   return res;
+   add_thread_stats(total, &se->stats.orphan, false);
+}
+
+static void lua_stats(struct luaeng* se, const struct luaeng_thread_stats* st,
+                      uint64_t live, uint64_t memory, int idle,
+                      ADD_STAT add_stat, const void* cookie) {
+   static const char* const store_names[OPERATION_CAS + 1] = {
+      [OPERATION_ADD] = "cmd_add",
+      [OPERATION_SET] = "cmd_set",
+      [OPERATION_REPLACE] = "cmd_replace",
+      [OPERATION_APPEND] = "cmd_append",
+      [OPERATION_PREPEND] = "cmd_prepend",
+      [OPERATION_CAS] = "cmd_cas"
+   };
+
+   add_stat_u64(add_stat, cookie, "cmd_get", st->cmd_get);
+   add_stat_u64(add_stat, cookie, "get_hits", st->get_hits);
+   add_stat_u64(add_stat, cookie, "get_misses", st->get_misses);
+   for (int ii = 0; ii <= OPERATION_CAS; ++ii) {
+      if (store_names[ii] != NULL) {
+         add_stat_u64(add_stat, cookie, store_names[ii], st->cmd_store[ii]);
+      }
+   }
+   add_stat_u64(add_stat, cookie, "cmd_remove", st->cmd_remove);
+   add_stat_u64(add_stat, cookie, "cmd_arithmetic", st->cmd_arithmetic);
+   add_stat_u64(add_stat, cookie, "cmd_flush", st->cmd_flush);
+   add_stat_u64(add_stat, cookie, "cmd_script", st->cmd_script);
+   add_stat_u64(add_stat, cookie, "lua_errors", st->lua_errors);
+   add_stat_u64(add_stat, cookie, "lua_over_budget", st->lua_over_budget);
+   add_stat_u64(add_stat, cookie, "lua_create_errors", st->lua_create_errors);
+   add_stat_u64(add_stat, cookie, "lua_created", st->lua_created);
+   add_stat_u64(add_stat, cookie, "lua_interpreters", live);
+   add_stat_u64(add_stat, cookie, "lua_memory", memory);
+   add_stat_u64(add_stat, cookie, "lua_memory_limit", se->config.memory_limit);
+   add_stat_u64(add_stat, cookie, "lua_over_memory", st->lua_over_memory);
+   add_stat_u64(add_stat, cookie, "lua_gc_steps", st->lua_gc_steps);
+   add_stat_u64(add_stat, cookie, "lua_gc_cycles", st->lua_gc_cycles);
+   add_stat_u64(add_stat, cookie, "lua_waits", st->lua_waits);
+   add_stat_u64(add_stat, cookie, "lua_parked", se->nparked);
+   add_stat_u64(add_stat, cookie, "lua_task_runs", st->lua_task_runs);
+   add_stat_u64(add_stat, cookie, "lua_shards", se->nshards);
+   add_stat_u64(add_stat, cookie, "lua_idle", idle);
+   add_stat_u64(add_stat, cookie, "lua_shared", se->nshared);
+   add_stat_u64(add_stat, cookie, "lua_shared_put", st->lua_shared_put);
+   add_stat_u64(add_stat, cookie, "lua_shared_get", st->lua_shared_get);
+   add_stat_u64(add_stat, cookie, "lua_trimmed", st->lua_trimmed);
+   add_stat_u64(add_stat, cookie, "lua_discarded", st->lua_discarded);
+   add_stat_u64(add_stat, cookie, "lua_reloads", st->lua_reloads);
+   add_stat_u64(add_stat, cookie, "lua_generation", se->generation);
+}
+
+/*
+ * Report a histogram of times in ns: the number of calls, the mean, and
+ * a few percentiles.
+ */
+static void histogram_stats(const struct luaeng_histogram* hist,
+                            const char* name,
+                            ADD_STAT add_stat, const void* cookie) {
+   static const struct {
+      const char *name;
+      double percentile;
+   } percentiles[] = {
+      { "p50", 50.0 },
+      { "p90", 90.0 },
+      { "p99", 99.0 },
+      { "p999", 99.9 },
+      { "max", 100.0 }
+   };
+
+   if (hist->count == 0) {
+      return;
+   }
+
+   char key[64];
+   snprintf(key, sizeof(key), "%s:count", name);
+   add_stat_u64(add_stat, cookie, key, hist->count);
+   snprintf(key, sizeof(key), "%s:mean", name);
+   add_stat_u64(add_stat, cookie, key, hist->total / hist->count);
+   for (size_t jj = 0; jj < sizeof(percentiles) / sizeof(percentiles[0]); ++jj) {
+      snprintf(key, sizeof(key), "%s:%s", name, percentiles[jj].name);
+      add_stat_u64(add_stat, cookie, key,
+                   histogram_percentile(hist, percentiles[jj].percentile));
+   }
+}
+
+/*
+ * The time spent in each hook, and in collecting garbage between calls.
+ */
+static void timing_stats(const struct luaeng_thread_stats* st,
+                         ADD_STAT add_stat, const void* cookie) {
+   for (int ii = 0; ii < LUAENG_HOOK_MAX; ++ii) {
+      /* Skip the "memcached_" prefix */
+      histogram_stats(&st->timings[ii], hook_names[ii] + 10, add_stat, cookie);
+   }
+   histogram_stats(&st->gc_timing, "gc", add_stat, cookie);
+   histogram_stats(&st->task_timing, "task", add_stat, cookie);
+}
+
+/*
+ * How busy the interpreter of each shard is: the requests it handled,
+ * and how many of them had to wait for another thread using it.
+ */
+static void shard_stats(struct luaeng* se, ADD_STAT add_stat,
+                        const void* cookie) {
+   char key[64];
+   for (int ii = 0; ii < se->nshards; ++ii) {
+      struct luaeng_shard* shard = &se->shards[ii];
+      snprintf(key, sizeof(key), "shard_%d:requests", ii);
+      add_stat_u64(add_stat, cookie, key, shard->requests);
+      snprintf(key, sizeof(key), "shard_%d:contended", ii);
+      add_stat_u64(add_stat, cookie, key, shard->contended);
+   }
+}
+
+/*
+ * The tasks scheduled by the script, on every task thread: how often
+ * they run, when next, and how long they take (in ns).
+ */
+static void task_stats(struct luaeng* se, ADD_STAT add_stat,
+                       const void* cookie) {
+   add_stat_u64(add_stat, cookie, "task_threads", se->ntask_threads);
+
+   uint64_t now = monotonic_ns();
+   char key[64];
+   pthread_mutex_lock(&se->tasks_lock);
+   for (int ii = 0; ii < se->ntask_threads; ++ii) {
+      struct luaeng_task_thread* tt = &se->task_threads[ii];
+      for (int jj = 0; jj < tt->ntasks; ++jj) {
+         const struct luaeng_task* task = &tt->tasks[jj];
+         const struct {
+            const char *name;
+            uint64_t value;
+         } values[] = {
+            { "thread", (uint64_t)tt->index },
+            { "interval_ms", task->interval / 1000000 },
+            { "next_ms", task->next_run > now ?
+                 (task->next_run - now) / 1000000 : 0 },
+            { "runs", task->runs },
+            { "errors", task->errors },
+            { "last", task->last_ns },
+            { "max", task->max_ns },
+            { "max_delay", task->max_delay }
+         };
+         for (size_t kk = 0; kk < sizeof(values) / sizeof(values[0]); ++kk) {
+            snprintf(key, sizeof(key), "%s:%s", task->name, values[kk].name);
+            add_stat_u64(add_stat, cookie, key, values[kk].value);
+         }
+      }
+   }
+   pthread_mutex_unlock(&se->tasks_lock);
 }
 
 static ENGINE_ERROR_CODE luaeng_stats(ENGINE_HANDLE* handle,
                                       const void* cookie,
                                       const char* stat_key,
-                                      int UNUSED(nkey),
+                                      int nkey,
                                       ADD_STAT add_stat) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
 
    ENGINE_ERROR_CODE res = ENGINE_SUCCESS;
 
-   if (stat_key == NULL) {
-      char val[128];
-      int len;
+   struct luaeng_thread_stats *st = malloc(sizeof(*st));
+   if (st == NULL) {
+      return ENGINE_ENOMEM;
+   }
+   int idle;
+   collect_stats(se, st, &idle);
+   uint64_t live = st->lua_created - st->lua_closed;
+   uint64_t memory = st->lua_allocated - st->lua_freed;
+
+   pthread_mutex_lock(&se->stats.lock);
+   add_thread_stats(st, &se->stats.reset, true);
+   pthread_mutex_unlock(&se->stats.lock);
 
-      pthread_mutex_lock(&se->stats.lock);
-      len = sprintf(val, "%"PRIu64, (uint64_t)se->stats.total_items);
-      add_stat("total_items", 11, val, len, cookie);
-      pthread_mutex_unlock(&se->stats.lock);
+   if (stat_key == NULL) {
+      add_stat_u64(add_stat, cookie, "total_items", st->total_items);
+      add_stat_u64(add_stat, cookie, "curr_items", se->store.nitems);
+      add_stat_u64(add_stat, cookie, "bytes", se->store.nbytes);
+      add_stat_u64(add_stat, cookie, "limit_maxbytes", se->store.limit);
+      add_stat_u64(add_stat, cookie, "evictions", se->store.evictions);
+      add_stat_u64(add_stat, cookie, "reclaimed", se->store.reclaimed);
+   } else if (nkey == 3 && strncmp(stat_key, "lua", 3) == 0) {
+      lua_stats(se, st, live, memory, idle, add_stat, cookie);
+   } else if (nkey == 11 && strncmp(stat_key, "lua_timings", 11) == 0) {
+      timing_stats(st, add_stat, cookie);
+   } else if (nkey == 5 && strncmp(stat_key, "slabs", 5) == 0) {
+      slabs_stats(&se->slabs, add_stat, cookie);
+   } else if (nkey == 9 && strncmp(stat_key, "lua_slabs", 9) == 0) {
+      slabs_stats(&se->lua_slabs, add_stat, cookie);
+   } else if (nkey == 8 && strncmp(stat_key, "snapshot", 8) == 0) {
+      snapshot_stats(&se->snapshot, add_stat, cookie);
+   } else if (nkey == 7 && strncmp(stat_key, "journal", 7) == 0) {
+      journal_stats(&se->journal, add_stat, cookie);
+   } else if (nkey == 5 && strncmp(stat_key, "async", 5) == 0) {
+      async_stats(&se->async, add_stat, cookie);
+   } else if (nkey == 5 && strncmp(stat_key, "tasks", 5) == 0) {
+      task_stats(se, add_stat, cookie);
+   } else if (nkey == 6 && strncmp(stat_key, "shards", 6) == 0) {
+      shard_stats(se, add_stat, cookie);
    } else {
       res = ENGINE_KEY_ENOENT;
    }
 
-   release_lua(se, L);
+   free(st);
    return res;
 }
 
+/*
+ * The counters belong to the threads updating them, so rather than
+ * clearing them we remember the current totals and report the
+ * difference from then on.
+ */
 static void luaeng_reset_stats(ENGINE_HANDLE* handle,
                                const void* UNUSED(cookie)) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
+
+   struct luaeng_thread_stats *st = malloc(sizeof(*st));
+   if (st == NULL) {
+      return;
+   }
+   int idle;
+   collect_stats(se, st, &idle);
 
    pthread_mutex_lock(&se->stats.lock);
-   se->stats.total_items = 0;
+   se->stats.reset = *st;
    pthread_mutex_unlock(&se->stats.lock);
 
-   release_lua(se, L);
+   free(st);
+}
+
+/*
+ * LUAENG_CMD_GET_MULTI: the body of the request is a list of keys, each
+ * preceded by its length (1 to STORE_KEY_MAX) as a 16 bit integer in
+ * network byte order. Each hit is sent back as a response with the key,
+ * the flags as extras and the value, followed by an empty response
+ * terminating the batch.
+ */
+static ENGINE_ERROR_CODE handle_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          protocol_binary_request_header* request,
+                                          ADD_RESPONSE response) {
+   uint32_t bodylen = ntohl(request->request.bodylen);
+   uint32_t skip = request->request.extlen + ntohs(request->request.keylen);
+   if (skip > bodylen) {
+      skip = bodylen;
+   }
+   const char *body = (const char*)(request + 1) + skip;
+   const char *end = body + (bodylen - skip);
+
+   int nkeys = 0;
+   bool valid = true;
+   const char *ptr = body;
+   while (ptr < end) {
+      uint16_t len = 0;
+      if (end - ptr >= 2) {
+         memcpy(&len, ptr, sizeof(len));
+         len = ntohs(len);
+      }
+      if (len == 0 || len > STORE_KEY_MAX || len > end - ptr - 2) {
+         valid = false;
+         break;
+      }
+      ptr += 2 + len;
+      nkeys++;
+   }
+
+   uint16_t status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+   const char **keys = NULL;
+   uint16_t *lens = NULL;
+   item **items = NULL;
+
+   if (!valid) {
+      status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+   } else if (nkeys > 0) {
+      keys = malloc(nkeys * sizeof(*keys));
+      lens = malloc(nkeys * sizeof(*lens));
+      items = malloc(nkeys * sizeof(*items));
+      if (keys == NULL || lens == NULL || items == NULL) {
+         status = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+      }
+   }
+
+   bool ok = true;
+   if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS && nkeys > 0) {
+      ptr = body;
+      for (int ii = 0; ii < nkeys; ++ii) {
+         memcpy(&lens[ii], ptr, sizeof(lens[ii]));
+         lens[ii] = ntohs(lens[ii]);
+         keys[ii] = ptr + 2;
+         ptr += 2 + lens[ii];
+      }
+
+      ENGINE_ERROR_CODE res = get_multi(handle, cookie, nkeys, keys, lens, items);
+      if (res == ENGINE_ENOMEM) {
+         status = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+      } else if (res == ENGINE_EINVAL) {
+         status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+      } else if (res != ENGINE_SUCCESS) {
+         status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+      }
+
+      for (int ii = 0; ii < nkeys; ++ii) {
+         item *it = items[ii];
+         if (it == NULL) {
+            continue;
+         }
+         if (ok) {
+            const char *data = item_get_data(it);
+            uint32_t nbytes = it->nbytes;
+            if (nbytes >= 2 && memcmp(data + nbytes - 2, "\r\n", 2) == 0) {
+               nbytes -= 2;
+            }
+            /* The flags go out in network byte order */
+            uint32_t flags = htonl(it->flags);
+            ok = response(item_get_key(it), it->nkey, &flags,
+                          sizeof(flags), data, nbytes,
+                          PROTOCOL_BINARY_RAW_BYTES,
+                          PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                          item_get_cas(it), cookie);
+         }
+         luaeng_item_release(handle, cookie, it);
+      }
+   }
+
+   free(keys);
+   free(lens);
+   free(items);
+
+   if (ok && response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                      status, 0, cookie)) {
+      return ENGINE_SUCCESS;
+   }
+   return ENGINE_FAILED;
+}
+
+/*
+ * LUAENG_CMD_RELOAD: compile the configured script again and switch all
+ * threads over to it.
+ */
+static ENGINE_ERROR_CODE handle_reload(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       ADD_RESPONSE response) {
+   uint16_t status;
+   switch (reload_script(get_handle(handle))) {
+   case ENGINE_SUCCESS:
+      status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+      break;
+   case ENGINE_ENOMEM:
+      status = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+      break;
+   default:
+      status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+   }
+
+   if (response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                status, 0, cookie)) {
+      return ENGINE_SUCCESS;
+   }
+   return ENGINE_FAILED;
+}
+
+/*
+ * LUAENG_CMD_SNAPSHOT: have the snapshot thread write the store out. The
+ * response doesn't wait for it; see snapshot_taken in stats snapshot.
+ */
+static ENGINE_ERROR_CODE handle_snapshot(ENGINE_HANDLE* handle,
+                                         const void* cookie,
+                                         ADD_RESPONSE response) {
+   struct luaeng* se = get_handle(handle);
+   uint16_t status = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+   if (se->snapshot.started) {
+      snapshot_request(&se->snapshot);
+      status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+   }
+
+   if (response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                status, 0, cookie)) {
+      return ENGINE_SUCCESS;
+   }
+   return ENGINE_FAILED;
+}
+
+/*
+ * Map the engine status returned by memcached_command to the status of
+ * the response.
+ */
+static uint16_t to_protocol_status(ENGINE_ERROR_CODE res) {
+   switch (res) {
+   case ENGINE_SUCCESS:
+      return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+   case ENGINE_KEY_ENOENT:
+      return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+   case ENGINE_KEY_EEXISTS:
+      return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+   case ENGINE_ENOMEM:
+      return PROTOCOL_BINARY_RESPONSE_ENOMEM;
+   case ENGINE_NOT_STORED:
+      return PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+   case ENGINE_EINVAL:
+      return PROTOCOL_BINARY_RESPONSE_EINVAL;
+   case ENGINE_ENOTSUP:
+      return PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+   case ENGINE_E2BIG:
+      return PROTOCOL_BINARY_RESPONSE_E2BIG;
+   default:
+      return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+   }
+}
+
+static uint64_t ntoh64(uint64_t value) {
+   const uint8_t *bytes = (const uint8_t*)&value;
+   uint64_t res = 0;
+   for (int ii = 0; ii < 8; ++ii) {
+      res = (res << 8) | bytes[ii];
+   }
+   return res;
+}
+
+/*
+ * Opcodes between command_min and command_max are passed to the script
+ * as memcached_command(opcode, key, extras, body, cas), which returns
+ * the status, body, extras and cas of the response. Everything but the
+ * status may be left out.
+ */
+static ENGINE_ERROR_CODE handle_command(ENGINE_HANDLE* handle,
+                                        const void* cookie,
+                                        protocol_binary_request_header* request,
+                                        ADD_RESPONSE response) {
+   struct luaeng* se = get_handle(handle);
+   uint32_t bodylen = ntohl(request->request.bodylen);
+   uint16_t keylen = ntohs(request->request.keylen);
+   uint8_t extlen = request->request.extlen;
+   const char *extras = (const char*)(request + 1);
+   const char *key = extras + extlen;
+   const char *body = key + keylen;
+
+   uint16_t status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+   const char *rbody = NULL, *rextras = NULL;
+   size_t rbodylen = 0, rextlen = 0;
+   uint64_t rcas = 0;
+
+   struct luaeng_lua *ll = NULL;
+   if ((uint32_t)extlen + keylen > bodylen) {
+      status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+   } else {
+      ll = acquire_key_lua(se, cookie, LUAENG_HOOK_COMMAND, key, keylen);
+   }
+
+   if (ll != NULL && has_hook(ll, LUAENG_HOOK_COMMAND)) {
+      lua_State *L = ll->L;
+      push_hook(ll, LUAENG_HOOK_COMMAND);
+      lua_pushinteger(L, request->request.opcode);
+      lua_pushlstring(L, key, keylen);
+      lua_pushlstring(L, extras, extlen);
+      lua_pushlstring(L, body, bodylen - extlen - keylen);
+      marshal_push_u64(L, ntoh64(request->request.cas));
+
+      ENGINE_ERROR_CODE res = call_hook(se, ll, LUAENG_HOOK_COMMAND, 5, 4);
+      if (res == ENGINE_SUCCESS) {
+         status = to_protocol_status(lua_to_status(se, L, -4, ENGINE_FAILED));
+         rbody = lua_tolstring(L, -3, &rbodylen);
+         rextras = lua_tolstring(L, -2, &rextlen);
+         if (rbodylen > UINT32_MAX - UINT8_MAX || rextlen > UINT8_MAX ||
+             !marshal_result_u64(L, -1, &rcas)) {
+            status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+            rbody = rextras = NULL;
+            rbodylen = rextlen = 0;
+            rcas = 0;
+         }
+      } else {
+         status = to_protocol_status(res);
+      }
+      thread_stats(se)->cmd_script++;
+   } else if (ll != NULL) {
+      status = PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND;
+   }
+
+   /* The strings belong to the interpreter, so respond before releasing it */
+   bool ok = response(NULL, 0, rextras, rextlen, rbody, rbodylen,
+                      PROTOCOL_BINARY_RAW_BYTES, status, rcas, cookie);
+   if (ll != NULL) {
+      release_key_lua(se, ll);
+   }
+   return ok ? ENGINE_SUCCESS : ENGINE_FAILED;
 }
 
 static ENGINE_ERROR_CODE luaeng_unknown_command(ENGINE_HANDLE* handle,
                                                 const void* cookie,
-                                                protocol_binary_request_header* UNUSED(request),
+                                                protocol_binary_request_header* request,
                                                 ADD_RESPONSE response) {
    struct luaeng* se = get_handle(handle);
-   lua_State *L = acquire_lua(se);
+   uint8_t opcode = request->request.opcode;
+
+   switch (opcode) {
+   case LUAENG_CMD_GET_MULTI:
+      return handle_get_multi(handle, cookie, request, response);
+   case LUAENG_CMD_RELOAD:
+      return handle_reload(handle, cookie, response);
+   case LUAENG_CMD_SNAPSHOT:
+      return handle_snapshot(handle, cookie, response);
+   }
+
+   if (opcode >= se->config.command_min && opcode <= se->config.command_max) {
+      return handle_command(handle, cookie, request, response);
+   }
 
    ENGINE_ERROR_CODE res = ENGINE_FAILED;
 
@@ -568,17 +3137,17 @@ static ENGINE_ERROR_CODE luaeng_unknown_command(ENGINE_HANDLE* handle,
       res = ENGINE_FAILED;
    }
 
-   release_lua(se, L);
    return res;
 }
 
-uint64_t item_get_cas(const item* UNUSED(it))
+uint64_t item_get_cas(const item* it)
 {
-    return 0;
+    return ITEM_HEADER(it)->cas;
 }
 
-void item_set_cas(item* UNUSED(it), uint64_t UNUSED(val))
+void item_set_cas(item* it, uint64_t val)
 {
+    ITEM_HEADER(it)->cas = val;
 }
 
 const char* item_get_key(const item* it)
@@ -591,7 +3160,7 @@ char* item_get_data(const item* it)
     return ((char*)item_get_key(it)) + it->nkey;
 }
 
-uint8_t item_get_clsid(const item* UNUSED(it))
+uint8_t item_get_clsid(const item* it)
 {
-    return 0;
+    return ITEM_HEADER(it)->clsid;
 }
@@ -35,6 +35,12 @@
 
 #include <memcached/util.h>
 
+#include "async.h"
+#include "histogram.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "store.h"
+
 #ifndef PUBLIC
 
 #if defined (__SUNPRO_C) && (__SUNPRO_C >= 0x550)
@@ -50,6 +56,35 @@
 /* Forward decl */
 struct luaeng;
 
+/**
+ * Engine specific binary command looking up a batch of keys with a
+ * single call into lua (see handle_get_multi() in lua_engine.c).
+ */
+#define LUAENG_CMD_GET_MULTI 0xd0
+
+/**
+ * Engine specific binary command compiling the script again and
+ * replacing every interpreter with one running the new version.
+ */
+#define LUAENG_CMD_RELOAD    0xd1
+
+/**
+ * Engine specific binary command starting a snapshot of the store.
+ */
+#define LUAENG_CMD_SNAPSHOT  0xd2
+
+/**
+ * Default range of binary opcodes passed to the script's
+ * memcached_command (see handle_command() in lua_engine.c).
+ */
+#define LUAENG_CMD_SCRIPT_MIN 0xe0
+#define LUAENG_CMD_SCRIPT_MAX 0xef
+
+/**
+ * Max evicted items a thread holds on to until it can tell the script.
+ */
+#define LUAENG_EVICT_QUEUE   16
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -62,23 +97,226 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
 struct luaeng_config {
    size_t verbose;
    char *script;
+   size_t store_stripes;
+   size_t threads;    // Number of memcached worker threads.
+   size_t prewarm;    // Interpreters to create up front for each thread.
+   size_t pool_min;   // Idle interpreters a thread always keeps.
+   size_t pool_max;   // Idle interpreters a thread keeps at most...
+   size_t pool_shared; // ...passing the rest to a pool shared by all threads.
+   size_t pool_idle;  // Seconds before closing an idle interpreter, 0 for never.
+   float slab_factor; // Growth factor between slab class sizes.
+   size_t instruction_limit; // Max lua instructions per hook call, 0 for none.
+   size_t time_limit;        // Max milliseconds per hook call, 0 for none.
+   size_t cache_size;        // Max bytes of items in the store, 0 for no limit.
+   size_t memory_limit;      // Max bytes per interpreter, 0 for no limit.
+   size_t gc_pause;          // Collector settings (see lua_gc()), 0 for lua's default.
+   size_t gc_stepmul;
+   bool   gc_idle;           // Collect garbage between hook calls, not during them.
+   size_t command_min;       // Opcodes passed to memcached_command, from...
+   size_t command_max;       // ...through.
+   char  *snapshot;          // File to keep a snapshot of the store in, if any.
+   size_t snapshot_interval; // Seconds between snapshots, 0 for on request only.
+   char  *journal;           // File to log the changes to the store to, if any.
+   char  *journal_sync;      // When to sync it: "always", "second" or "none".
+   size_t async_threads;     // Threads carrying out what hooks wait for, 0 for none.
+   size_t async_parked;      // Requests set aside while they wait, at most.
+   size_t task_threads;      // Threads running the script's scheduled tasks.
+   size_t shards;            // Interpreters keys are routed to, 0 to use the pools.
+};
+
+/**
+ * The script compiled once at startup (and on every reload). Every
+ * interpreter is created from this buffer so we never touch the file
+ * system on the request path.
+ */
+struct luaeng_bytecode {
+   char  *data;
+   size_t size;
+   size_t capacity;
+   char  *name;       // Chunk name used in error messages ("@path").
+   uint32_t generation;
+   uint32_t refcount; // One for the engine, one per interpreter being created.
+};
+
+/**
+ * The functions a script may define. Any of them may be left out, in
+ * which case the engine handles the operation natively on the store.
+ */
+enum luaeng_hook {
+   LUAENG_HOOK_GET,
+   LUAENG_HOOK_GET_MULTI,
+   LUAENG_HOOK_STORE,
+   LUAENG_HOOK_REMOVE,
+   LUAENG_HOOK_ARITHMETIC,
+   LUAENG_HOOK_FLUSH,
+   LUAENG_HOOK_EVICT,
+   LUAENG_HOOK_COMMAND,
+   LUAENG_HOOK_MAX
 };
 
 /**
- * Statistic information collected by the lua engine
+ * Statistic information collected by the lua engine. Every thread updates
+ * its own copy without any locking or atomic operations, and the copies
+ * are summed up when the stats are read. Only uint64_t counters may be
+ * added, see add_thread_stats().
  */
+struct luaeng_thread_stats {
+   uint64_t cmd_get;
+   uint64_t get_hits;
+   uint64_t get_misses;
+   uint64_t cmd_store[OPERATION_CAS + 1];  // By ENGINE_STORE_OPERATION.
+   uint64_t total_items;                   // Successful stores.
+   uint64_t cmd_remove;
+   uint64_t cmd_arithmetic;
+   uint64_t cmd_flush;
+   uint64_t cmd_script;         // Requests passed to memcached_command.
+   uint64_t lua_errors;         // Failed hook calls.
+   uint64_t lua_over_budget;    // Hook calls aborted by the instruction/time limit.
+   uint64_t lua_created;        // Interpreters created...
+   uint64_t lua_closed;         // ...and closed.
+   uint64_t lua_create_errors;  // Interpreters whose script failed to run.
+   uint64_t lua_reloads;
+   uint64_t lua_trimmed;        // Interpreters closed after being idle for pool_idle.
+   uint64_t lua_shared_put;     // Interpreters passed to the shared pool...
+   uint64_t lua_shared_get;     // ...and taken from it.
+   uint64_t lua_discarded;      // Interpreters closed as both pools were full.
+   uint64_t lua_allocated;      // Bytes allocated by interpreters...
+   uint64_t lua_freed;          // ...and freed, on this thread.
+   uint64_t lua_over_memory;    // Allocations refused by memory_limit.
+   uint64_t lua_gc_steps;       // Collection steps run by gc_idle...
+   uint64_t lua_gc_cycles;      // ...and the cycles they completed.
+   uint64_t lua_waits;          // Hook calls parked to wait for an operation.
+   uint64_t lua_task_runs;      // Scheduled tasks run.
+   struct luaeng_histogram timings[LUAENG_HOOK_MAX]; // Time spent in each hook, in ns.
+   struct luaeng_histogram gc_timing; // Time spent in each gc_idle step, in ns.
+   struct luaeng_histogram task_timing; // Time spent in each scheduled task, in ns.
+};
+
 struct luaeng_stats {
    pthread_mutex_t lock;
-   uint64_t total_items;
+   struct luaeng_thread_stats reset;   // Totals at the last reset, protected by lock.
+   struct luaeng_thread_stats orphan;  // For threads without thread local data.
+   struct luaeng_thread_stats departed; // Of threads which exited, protected by luaeng.lock.
+};
+
+/**
+ * An interpreter along with the hook functions defined by its script,
+ * resolved once when the interpreter is created.
+ */
+struct luaeng_lua {
+   lua_State *L;
+   struct luaeng *engine;
+   int hooks[LUAENG_HOOK_MAX];  // Registry references, LUA_NOREF if undefined.
+   bool failed;                 // Close instead of reusing on release.
+   uint32_t generation;         // Of the script the interpreter runs.
+   rel_time_t idle_since;       // When last released to a pool.
+   size_t memory;               // Bytes allocated by the interpreter...
+   size_t memory_limit;         // ...and the most it may use, 0 for no limit.
+   size_t gc_debt;              // Bytes allocated since the last gc_idle step.
+   size_t gc_threshold;         // Memory in use before the next gc_idle cycle.
+   bool   gc_running;           // Restarted during a call near memory_limit.
+
+   /* Budget of the current hook call, enforced by budget_hook() */
+   uint64_t instructions;       // Executed so far (in steps of budget_step).
+   uint64_t instruction_limit;
+   uint64_t deadline;           // Monotonic time in ns, 0 for none.
+   uint64_t time_limit;         // In ns.
+   int      budget_step;
+   bool     over_budget;
+
+   /* Hooks which may wait run in this coroutine, see run_hook() */
+   lua_State *co;
+   int       co_ref;           // Registry reference keeping co alive.
+   bool      resumable;        // Is co running a hook which may wait?
+   uint64_t  hook_ns;          // Time the hook ran for so far.
+   struct luaeng_parked *parked; // What the hook waits for, until resumed.
+
+   struct luaeng_shard *shard;   // Owning shard, NULL for the pools.
+};
+
+/**
+ * A request whose hook waits for an operation. The interpreter is kept
+ * here, off the pools, until the server calls the engine again.
+ */
+struct luaeng_parked {
+   struct async_wait wait;       // First, see parked_done().
+   struct luaeng *engine;
+   struct luaeng_lua *ll;
+   const void *cookie;
+   enum luaeng_hook hook;
+   struct luaeng_parked *prev;   // Every parked request, protected by luaeng.lock.
+   struct luaeng_parked *next;
 };
 
 /**
  * Thread local data.
  */
 struct luaeng_tld {
-   lua_State **free_stack;      // Array of unused lua interpreters.
-   int         free_stack_top;  // 0-based index to first free entry in the free_lua_arr, -1 when empty.
-   int         free_stack_size; // Total number of entries in the free_stack.
+   struct luaeng *engine;
+   struct luaeng_lua **free_stack; // Unused interpreters, least recently used first.
+   int         free_stack_top;  // 0-based index of the last entry in free_stack, -1 when empty.
+   int         free_stack_size; // Total number of entries in the free_stack (pool_max).
+   bool        adopted;         // Has the thread had its share of the spare interpreters?
+   struct slab_cache slabs;     // This thread's free item chunks.
+   struct slab_cache lua_slabs; // And its free chunks for small lua objects.
+   struct luaeng_thread_stats stats;
+   hash_item *evicted[LUAENG_EVICT_QUEUE]; // Referenced, see store_evicted().
+   int         nevicted;
+   struct luaeng_tld *next;     // All thread local data, for stats.
+   struct luaeng_task_thread *task_thread; // If this is a task thread.
+};
+
+/**
+ * With shards configured, each key belongs to the interpreter of one
+ * shard, which only one thread uses at a time.
+ */
+struct luaeng_shard {
+   pthread_mutex_t lock;
+   struct luaeng_lua *ll;        // Protected by lock, NULL until needed.
+   uint64_t requests;            // Protected by lock.
+   uint64_t contended;           // Requests which waited for the lock, updated atomically.
+} __attribute__((aligned(64)));
+
+/**
+ * A function the script scheduled with memcached.schedule(), in the
+ * interpreter of a task thread.
+ */
+struct luaeng_task {
+   int      ref;                // Registry reference to the function.
+   char     name[32];
+   uint64_t interval;           // In ns.
+   uint64_t next_run;           // Monotonic time in ns.
+
+   /* Stats */
+   uint64_t runs;
+   uint64_t errors;
+   uint64_t last_ns;            // Time the last run took.
+   uint64_t max_ns;
+   uint64_t max_delay;          // Longest a run started after it was due.
+};
+
+/**
+ * A thread running scheduled tasks in an interpreter of its own.
+ */
+struct luaeng_task_thread {
+   struct luaeng *engine;
+   int       index;
+   pthread_t thread;
+   bool      started;
+   struct luaeng_lua *ll;
+   uint32_t  generation;        // Of the script last loaded, even if it failed.
+   bool      loading;           // Is the script being run to create ll?
+   int       nscheduled;        // Tasks the script scheduled while loading.
+
+   /* Protected by luaeng.tasks_lock */
+   struct luaeng_task *tasks;
+   int       ntasks;
+   int       tasks_size;
+
+   /* Scheduled while loading, until they replace tasks */
+   struct luaeng_task *loaded;
+   int       nloaded;
+   int       loaded_size;
 };
 
 /**
@@ -99,8 +337,104 @@ struct luaeng {
 
    pthread_mutex_t lock;
 
+   /**
+    * The thread local data of every thread, protected by lock.
+    */
+   struct luaeng_tld *tlds;
+
+   /**
+    * The current script, protected by lock. Interpreters of an older
+    * generation are closed when next acquired or released.
+    */
+   struct luaeng_bytecode *bytecode;
+   uint32_t generation;
+
+   /**
+    * Serializes reloads.
+    */
+   pthread_mutex_t reload_lock;
+
+   /**
+    * Interpreters created at initialization time which have not yet been
+    * claimed by a worker thread. Protected by lock.
+    */
+   struct luaeng_lua **spare;
+   int                 nspare;
+
+   /**
+    * Interpreters released by threads whose own pool was full, for any
+    * thread to take. Least recently used first, protected by lock.
+    */
+   struct luaeng_lua **shared;
+   int                 nshared;
+
    struct luaeng_config config;
    struct luaeng_stats stats;
+
+   /**
+    * Script errors are logged at most once per second; the others are
+    * only counted. Both updated atomically.
+    */
+   rel_time_t last_error_log;
+   uint32_t   suppressed_errors;
+
+   /**
+    * Does the script define memcached_evict? Set whenever an interpreter
+    * is created.
+    */
+   bool evict_hook;
+
+   /**
+    * Allocator for all items.
+    */
+   struct luaeng_slabs slabs;
+
+   /**
+    * Allocator for the small objects of all interpreters, see lua_alloc().
+    */
+   struct luaeng_slabs lua_slabs;
+
+   /**
+    * Key/value data shared by every interpreter on every thread.
+    */
+   struct luaeng_store store;
+
+   /**
+    * Writes the store to disk, and reads it back at startup.
+    */
+   struct luaeng_snapshot snapshot;
+
+   /**
+    * Logs the changes to the store, and replays them at startup.
+    */
+   struct luaeng_journal journal;
+
+   /**
+    * Carries out the operations hooks wait for.
+    */
+   struct luaeng_async async;
+
+   /**
+    * The requests parked waiting for them, protected by lock.
+    */
+   struct luaeng_parked *parked;
+   int                   nparked;
+
+   /**
+    * Threads running the script's scheduled tasks, and the lock and
+    * condition they wait on between runs.
+    */
+   struct luaeng_task_thread *task_threads;
+   int                        ntask_threads;
+   pthread_mutex_t            tasks_lock;
+   pthread_cond_t             tasks_cond;
+   bool                       tasks_stopping;
+
+   /**
+    * The interpreters owning the keys, if configured.
+    */
+   struct luaeng_shard *shards;
+   int                  nshards;
 };
 
 char* item_get_data(const item* item);
@@ -0,0 +1,145 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Passing the engine's integer types to and from lua.
+ *
+ * Lua numbers are doubles, which hold every 32 bit flags and exptime but
+ * only integers up to 2^53. Larger 64 bit values (cas, counters) are
+ * passed to lua as decimal strings instead, and both forms are accepted
+ * back, so a value a script gets from the engine always makes the round
+ * trip unchanged. Values which are negative, fractional, too large or not
+ * numbers at all are rejected rather than wrapped around or truncated.
+ */
+#ifndef MEMCACHED_LUA_MARSHAL_H
+#define MEMCACHED_LUA_MARSHAL_H
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/* Largest integer every lua_Number holds exactly */
+#define MARSHAL_EXACT_MAX (1ULL << 53)
+
+static inline void marshal_push_u64(lua_State *L, uint64_t value) {
+   if (value <= MARSHAL_EXACT_MAX) {
+      lua_pushnumber(L, (lua_Number)value);
+   } else {
+      char buf[24];
+      int len = snprintf(buf, sizeof(buf), "%"PRIu64, value);
+      lua_pushlstring(L, buf, len);
+   }
+}
+
+static inline void marshal_push_u32(lua_State *L, uint32_t value) {
+   lua_pushnumber(L, (lua_Number)value);
+}
+
+/**
+ * Convert the number or decimal string at idx. Returns false (leaving
+ * *value alone) for anything else, including nil.
+ */
+static inline bool marshal_to_u64(lua_State *L, int idx, uint64_t *value) {
+   if (lua_type(L, idx) == LUA_TNUMBER) {
+      lua_Number num = lua_tonumber(L, idx);
+      /* 2^64 is the first double which doesn't fit */
+      if (num < 0 || num >= 18446744073709551616.0 || num != num ||
+          (lua_Number)(uint64_t)num != num) {
+         return false;
+      }
+      *value = (uint64_t)num;
+      return true;
+   }
+
+   if (lua_type(L, idx) == LUA_TSTRING) {
+      const char *str = lua_tostring(L, idx);
+      char *end;
+      if (*str < '0' || *str > '9') {
+         return false;
+      }
+      errno = 0;
+      unsigned long long num = strtoull(str, &end, 10);
+      if (errno != 0 || *end != '\0') {
+         return false;
+      }
+      *value = (uint64_t)num;
+      return true;
+   }
+
+   return false;
+}
+
+static inline bool marshal_to_u32(lua_State *L, int idx, uint32_t *value) {
+   uint64_t num;
+   if (!marshal_to_u64(L, idx, &num) || num > UINT32_MAX) {
+      return false;
+   }
+   *value = (uint32_t)num;
+   return true;
+}
+
+/**
+ * For the results of a hook: nil (or nothing at all) gives 0, and only
+ * values which don't fit make the result invalid.
+ */
+static inline bool marshal_result_u64(lua_State *L, int idx, uint64_t *value) {
+   *value = 0;
+   return lua_isnoneornil(L, idx) || marshal_to_u64(L, idx, value);
+}
+
+static inline bool marshal_result_u32(lua_State *L, int idx, uint32_t *value) {
+   *value = 0;
+   return lua_isnoneornil(L, idx) || marshal_to_u32(L, idx, value);
+}
+
+/**
+ * Like luaL_optnumber(): the value of argument arg, def if it's nil or
+ * missing, and a lua error if it's anything else which doesn't fit.
+ */
+static inline uint64_t marshal_opt_u64(lua_State *L, int arg, uint64_t def) {
+   uint64_t value = def;
+   if (!lua_isnoneornil(L, arg) && !marshal_to_u64(L, arg, &value)) {
+      luaL_argerror(L, arg, "expected a non-negative 64 bit integer");
+   }
+   return value;
+}
+
+static inline uint32_t marshal_opt_u32(lua_State *L, int arg, uint32_t def) {
+   uint32_t value = def;
+   if (!lua_isnoneornil(L, arg) && !marshal_to_u32(L, arg, &value)) {
+      luaL_argerror(L, arg, "expected a non-negative 32 bit integer");
+   }
+   return value;
+}
+
+static inline uint64_t marshal_check_u64(lua_State *L, int arg) {
+   uint64_t value = 0;
+   if (!marshal_to_u64(L, arg, &value)) {
+      luaL_argerror(L, arg, "expected a non-negative 64 bit integer");
+   }
+   return value;
+}
+
+#endif
@@ -1,36 +1,65 @@
 print("hello world")
 
-dict = {}
+-- Items live in the engine's shared store so that every interpreter
+-- (one or more per memcached worker thread) sees the same data.
 
+-- Returning a handle from store:ref() lets the engine give the stored
+-- item to the server without copying the value.
 function memcached_get(key)
-  local v = dict[key]
-  if v then
-    local val = v[1]
-    local flg = v[2]
-    local exp = v[3]
-    print("memcached_get " .. key .. " " .. val .. " " .. flg .. " " .. exp)
-    return val, flg, exp
+  local it = store:ref(key)
+  if it then
+    print("memcached_get " .. key .. " " .. it:flags() .. " " .. it:exptime())
+    return it
   else
     print("memcached_get " .. key .. " [miss]")
     return nil, 0, 0
   end
 end
 
-function memcached_store(key, operation, val, flg, exp)
-  print("memcached_store " .. key .. " " .. operation .. " " .. val .. " " .. flg .. " " .. exp)
-  dict[key] = {val, flg, exp}
-  return 0
+-- Hooks return one of the memcached.* status codes. Passing the cas on
+-- to the store makes CAS updates and deletes atomic.
+function memcached_store(key, operation, val, flg, exp, cas)
+  print("memcached_store " .. key .. " " .. operation .. " " .. val .. " " .. flg .. " " .. exp .. " " .. cas)
+  local newcas, status = store:put(key, val, flg, exp, cas)
+  if newcas then
+    return memcached.SUCCESS, newcas
+  end
+  return status
 end
 
-function memcached_remove(key)
-  print("memcached_remove " .. key)
-  dict[key] = nil
-  return 0
+function memcached_remove(key, cas)
+  print("memcached_remove " .. key .. " " .. cas)
+  local ok, status = store:delete(key, cas)
+  if ok then
+    return memcached.SUCCESS
+  end
+  return status
 end
 
+-- The engine flushes the store by itself; the hook is only told about it.
 function memcached_flush(when)
   print("memcached_flush " .. when)
-  dict = {}
   return 0
 end
 
+-- Called for items evicted to stay within cache_size.
+function memcached_evict(key, value, flags)
+  print("memcached_evict " .. key)
+end
+
+-- Engine specific binary commands in the range command_min-command_max
+-- (0xe0-0xef by default). Returns the status, and optionally the body,
+-- extras and cas of the response; 0xe0 here returns the number of items.
+function memcached_command(opcode, key, extras, body, cas)
+  print("memcached_command " .. opcode .. " " .. key)
+  if opcode == 0xe0 then
+    return memcached.SUCCESS, tostring(store:count())
+  end
+  return memcached.ENOTSUP
+end
+
+-- Runs every 60 seconds on a task thread (with task_threads set), off the
+-- request path.
+memcached.schedule(60, function()
+  print("memcached task: " .. store:count() .. " items")
+end, "count")
@@ -0,0 +1,322 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "slabs.h"
+
+#define CHUNK_NEXT(c) (*(void**)(c))
+
+bool slabs_init(struct luaeng_slabs *slabs, double factor,
+                struct slab_cache *(*get_cache)(void *arg), void *arg) {
+   return slabs_init_range(slabs, SLAB_MIN_CHUNK, SLAB_PAGE_SIZE, factor,
+                           get_cache, arg);
+}
+
+bool slabs_init_range(struct luaeng_slabs *slabs, size_t min, size_t max,
+                      double factor,
+                      struct slab_cache *(*get_cache)(void *arg), void *arg) {
+   if (factor <= 1.0) {
+      factor = SLAB_DEFAULT_FACTOR;
+   }
+   /* Chunks must hold the free list pointer and stay 8 byte aligned */
+   min = (min + 7) & ~(size_t)7;
+   max = (max + 7) & ~(size_t)7;
+   if (max > SLAB_PAGE_SIZE) {
+      max = SLAB_PAGE_SIZE;
+   }
+   if (min < sizeof(void*) || min > max) {
+      return false;
+   }
+
+   memset(slabs, 0, sizeof(*slabs));
+   pthread_mutex_init(&slabs->lock, NULL);
+   slabs->get_cache = get_cache;
+   slabs->arg = arg;
+
+   size_t size = min;
+   int ii = 1;
+   while (ii < SLAB_MAX_CLASSES - 1 && size <= max / factor) {
+      slabs->classes[ii].size = size;
+      size_t next = ((size_t)(size * factor) + 7) & ~(size_t)7;
+      size = next > size ? next : size + 8;
+      ii++;
+   }
+   slabs->classes[ii].size = max;
+   slabs->nclasses = ii + 1;
+
+   for (ii = 1; ii < slabs->nclasses; ++ii) {
+      size_t max = SLAB_CACHE_BYTES / slabs->classes[ii].size;
+      slabs->classes[ii].cache_max = max < 4 ? 4 : max;
+   }
+
+   return true;
+}
+
+void slabs_destroy(struct luaeng_slabs *slabs) {
+   while (slabs->pages != NULL) {
+      void *next = CHUNK_NEXT(slabs->pages);
+      free(slabs->pages);
+      slabs->pages = next;
+   }
+   pthread_mutex_destroy(&slabs->lock);
+}
+
+void slabs_register_cache(struct luaeng_slabs *slabs, struct slab_cache *cache) {
+   pthread_mutex_lock(&slabs->lock);
+   cache->next = slabs->caches;
+   slabs->caches = cache;
+   pthread_mutex_unlock(&slabs->lock);
+}
+
+void slabs_unregister_cache(struct luaeng_slabs *slabs, struct slab_cache *cache) {
+   pthread_mutex_lock(&slabs->lock);
+   struct slab_cache **prev = &slabs->caches;
+   while (*prev != NULL && *prev != cache) {
+      prev = &(*prev)->next;
+   }
+   if (*prev != NULL) {
+      *prev = cache->next;
+   }
+
+   for (int ii = 0; ii < slabs->nclasses; ++ii) {
+      struct slab_class *cls = &slabs->classes[ii];
+      while (cache->lists[ii].head != NULL) {
+         void *chunk = cache->lists[ii].head;
+         cache->lists[ii].head = CHUNK_NEXT(chunk);
+         CHUNK_NEXT(chunk) = cls->depot;
+         cls->depot = chunk;
+         cls->ndepot++;
+      }
+      cache->lists[ii].count = 0;
+      __sync_add_and_fetch(&slabs->allocs[ii], cache->lists[ii].allocs);
+      __sync_add_and_fetch(&slabs->frees[ii], cache->lists[ii].frees);
+   }
+   pthread_mutex_unlock(&slabs->lock);
+}
+
+uint8_t slabs_clsid(struct luaeng_slabs *slabs, size_t size) {
+   if (size > slabs->classes[slabs->nclasses - 1].size) {
+      return SLAB_LARGE;
+   }
+
+   int lo = 1;
+   int hi = slabs->nclasses - 1;
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (slabs->classes[mid].size < size) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return (uint8_t)lo;
+}
+
+size_t slabs_chunk_size(struct luaeng_slabs *slabs, uint8_t clsid,
+                        size_t size) {
+   return clsid == SLAB_LARGE ? size : slabs->classes[clsid].size;
+}
+
+/*
+ * Get a chunk from the depot, or carve a new one. Must be called with the
+ * lock held.
+ */
+static void *do_slabs_get(struct luaeng_slabs *slabs, struct slab_class *cls) {
+   void *chunk = cls->depot;
+   if (chunk != NULL) {
+      cls->depot = CHUNK_NEXT(chunk);
+      cls->ndepot--;
+      return chunk;
+   }
+
+   if (cls->page_left < cls->size) {
+      char *page = malloc(sizeof(void*) + SLAB_PAGE_SIZE);
+      if (page == NULL) {
+         return NULL;
+      }
+      CHUNK_NEXT(page) = slabs->pages;
+      slabs->pages = page;
+      cls->page = page + sizeof(void*);
+      cls->page_left = SLAB_PAGE_SIZE;
+      cls->total_pages++;
+   }
+
+   chunk = cls->page;
+   cls->page += cls->size;
+   cls->page_left -= cls->size;
+   cls->total_chunks++;
+   return chunk;
+}
+
+static void refill_cache(struct luaeng_slabs *slabs, struct slab_cache *cache,
+                         uint8_t clsid) {
+   struct slab_class *cls = &slabs->classes[clsid];
+   uint32_t want = cls->cache_max / 2;
+   if (want == 0) {
+      want = 1;
+   }
+
+   pthread_mutex_lock(&slabs->lock);
+   for (uint32_t ii = 0; ii < want; ++ii) {
+      void *chunk = do_slabs_get(slabs, cls);
+      if (chunk == NULL) {
+         break;
+      }
+      CHUNK_NEXT(chunk) = cache->lists[clsid].head;
+      cache->lists[clsid].head = chunk;
+      cache->lists[clsid].count++;
+   }
+   pthread_mutex_unlock(&slabs->lock);
+}
+
+static void drain_cache(struct luaeng_slabs *slabs, struct slab_cache *cache,
+                        uint8_t clsid, uint32_t keep) {
+   struct slab_class *cls = &slabs->classes[clsid];
+
+   pthread_mutex_lock(&slabs->lock);
+   while (cache->lists[clsid].count > keep) {
+      void *chunk = cache->lists[clsid].head;
+      cache->lists[clsid].head = CHUNK_NEXT(chunk);
+      cache->lists[clsid].count--;
+      CHUNK_NEXT(chunk) = cls->depot;
+      cls->depot = chunk;
+      cls->ndepot++;
+   }
+   pthread_mutex_unlock(&slabs->lock);
+}
+
+void *slabs_alloc(struct luaeng_slabs *slabs, size_t size, uint8_t *clsid) {
+   uint8_t id = slabs_clsid(slabs, size);
+   *clsid = id;
+
+   if (id == SLAB_LARGE) {
+      __sync_add_and_fetch(&slabs->allocs[id], 1);
+      return malloc(size);
+   }
+
+   struct slab_cache *cache = slabs->get_cache(slabs->arg);
+   if (cache == NULL) {
+      pthread_mutex_lock(&slabs->lock);
+      void *chunk = do_slabs_get(slabs, &slabs->classes[id]);
+      pthread_mutex_unlock(&slabs->lock);
+      if (chunk != NULL) {
+         __sync_add_and_fetch(&slabs->allocs[id], 1);
+      }
+      return chunk;
+   }
+
+   if (cache->lists[id].head == NULL) {
+      refill_cache(slabs, cache, id);
+      if (cache->lists[id].head == NULL) {
+         return NULL;
+      }
+   }
+
+   void *chunk = cache->lists[id].head;
+   cache->lists[id].head = CHUNK_NEXT(chunk);
+   cache->lists[id].count--;
+   cache->lists[id].allocs++;
+   return chunk;
+}
+
+void slabs_free(struct luaeng_slabs *slabs, void *ptr, uint8_t clsid) {
+   if (clsid == SLAB_LARGE) {
+      __sync_add_and_fetch(&slabs->frees[clsid], 1);
+      free(ptr);
+      return;
+   }
+
+   struct slab_cache *cache = slabs->get_cache(slabs->arg);
+   if (cache == NULL) {
+      struct slab_class *cls = &slabs->classes[clsid];
+      pthread_mutex_lock(&slabs->lock);
+      CHUNK_NEXT(ptr) = cls->depot;
+      cls->depot = ptr;
+      cls->ndepot++;
+      pthread_mutex_unlock(&slabs->lock);
+      __sync_add_and_fetch(&slabs->frees[clsid], 1);
+      return;
+   }
+
+   CHUNK_NEXT(ptr) = cache->lists[clsid].head;
+   cache->lists[clsid].head = ptr;
+   cache->lists[clsid].count++;
+   cache->lists[clsid].frees++;
+
+   if (cache->lists[clsid].count > slabs->classes[clsid].cache_max) {
+      drain_cache(slabs, cache, clsid, slabs->classes[clsid].cache_max / 2);
+   }
+}
+
+static void add_class_stat(ADD_STAT add_stat, const void *cookie, int clsid,
+                           const char *name, uint64_t value) {
+   char key[64];
+   char val[32];
+   int klen = snprintf(key, sizeof(key), "%d:%s", clsid, name);
+   int vlen = snprintf(val, sizeof(val), "%"PRIu64, value);
+   add_stat(key, klen, val, vlen, cookie);
+}
+
+void slabs_stats(struct luaeng_slabs *slabs, ADD_STAT add_stat,
+                 const void *cookie) {
+   uint64_t total_malloced = 0;
+   int active = 0;
+
+   pthread_mutex_lock(&slabs->lock);
+   for (int ii = 0; ii < slabs->nclasses; ++ii) {
+      uint64_t allocs = slabs->allocs[ii];
+      uint64_t frees = slabs->frees[ii];
+      uint64_t cached = 0;
+      for (struct slab_cache *c = slabs->caches; c != NULL; c = c->next) {
+         allocs += c->lists[ii].allocs;
+         frees += c->lists[ii].frees;
+         cached += c->lists[ii].count;
+      }
+      uint64_t used = allocs > frees ? allocs - frees : 0;
+
+      if (ii == SLAB_LARGE) {
+         char val[32];
+         int len = snprintf(val, sizeof(val), "%"PRIu64, used);
+         add_stat("large_items", 11, val, len, cookie);
+         continue;
+      }
+
+      struct slab_class *cls = &slabs->classes[ii];
+      if (cls->total_chunks == 0) {
+         continue;
+      }
+      active++;
+      total_malloced += cls->total_pages * SLAB_PAGE_SIZE;
+
+      add_class_stat(add_stat, cookie, ii, "chunk_size", cls->size);
+      add_class_stat(add_stat, cookie, ii, "total_pages", cls->total_pages);
+      add_class_stat(add_stat, cookie, ii, "total_chunks", cls->total_chunks);
+      add_class_stat(add_stat, cookie, ii, "used_chunks", used);
+      add_class_stat(add_stat, cookie, ii, "cached_chunks", cached);
+      add_class_stat(add_stat, cookie, ii, "depot_chunks", cls->ndepot);
+   }
+   pthread_mutex_unlock(&slabs->lock);
+
+   char val[32];
+   int len = snprintf(val, sizeof(val), "%d", active);
+   add_stat("active_slabs", 12, val, len, cookie);
+   len = snprintf(val, sizeof(val), "%"PRIu64, total_malloced);
+   add_stat("total_malloced", 14, val, len, cookie);
+}
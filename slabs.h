@@ -0,0 +1,135 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Size-classed item allocator.
+ *
+ * Memory is carved out of large pages into chunks of a fixed set of
+ * sizes. Each thread keeps a small free list per size class, so the
+ * common allocate/release path is a pointer pop/push without any locking.
+ * Free lists that grow too long (typically because items allocated on one
+ * thread are released on another) are handed back to a shared depot from
+ * which other threads refill their lists.
+ */
+#ifndef MEMCACHED_LUA_SLABS_H
+#define MEMCACHED_LUA_SLABS_H
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <memcached/engine.h>
+
+#define SLAB_PAGE_SIZE       (1024 * 1024)
+#define SLAB_MIN_CHUNK       64
+#define SLAB_MAX_CLASSES     64
+#define SLAB_CACHE_BYTES     (64 * 1024)
+#define SLAB_DEFAULT_FACTOR  1.25
+
+/*
+ * Class id 0 is used for objects too large for any slab class; those are
+ * allocated with malloc().
+ */
+#define SLAB_LARGE 0
+
+struct slab_class {
+   size_t size;          // Size of each chunk.
+   uint32_t cache_max;   // Max chunks a thread keeps on its own free list.
+   void *depot;          // Free chunks shared by all threads.
+   uint32_t ndepot;
+   char *page;           // Page currently being carved into chunks.
+   size_t page_left;
+   uint64_t total_chunks;
+   uint64_t total_pages;
+};
+
+/**
+ * Per thread free lists. Lives in the engine's thread local data.
+ */
+struct slab_cache {
+   struct slab_cache *next;   // All registered caches, for stats.
+   struct {
+      void *head;
+      uint32_t count;
+      uint64_t allocs;
+      uint64_t frees;
+   } lists[SLAB_MAX_CLASSES];
+};
+
+struct luaeng_slabs {
+   pthread_mutex_t lock;
+   struct slab_class classes[SLAB_MAX_CLASSES];
+   int nclasses;
+   void *pages;               // Every page we've allocated, for destroy.
+   struct slab_cache *caches;
+
+   /* Return the calling thread's cache (or NULL) */
+   struct slab_cache *(*get_cache)(void *arg);
+   void *arg;
+
+   /* Counters for chunks without a cache, updated atomically */
+   uint64_t allocs[SLAB_MAX_CLASSES];
+   uint64_t frees[SLAB_MAX_CLASSES];
+};
+
+bool slabs_init(struct luaeng_slabs *slabs, double factor,
+                struct slab_cache *(*get_cache)(void *arg), void *arg);
+
+/**
+ * Like slabs_init(), for chunks from min up to max bytes. Larger objects
+ * are allocated with malloc().
+ */
+bool slabs_init_range(struct luaeng_slabs *slabs, size_t min, size_t max,
+                      double factor,
+                      struct slab_cache *(*get_cache)(void *arg), void *arg);
+void slabs_destroy(struct luaeng_slabs *slabs);
+
+/**
+ * Register a thread's cache so its counters show up in the stats.
+ */
+void slabs_register_cache(struct luaeng_slabs *slabs, struct slab_cache *cache);
+
+/**
+ * Return the chunks of an exiting thread's cache to the depot and keep
+ * its counters for the stats, so the cache can be freed.
+ */
+void slabs_unregister_cache(struct luaeng_slabs *slabs, struct slab_cache *cache);
+
+void *slabs_alloc(struct luaeng_slabs *slabs, size_t size, uint8_t *clsid);
+void slabs_free(struct luaeng_slabs *slabs, void *ptr, uint8_t clsid);
+
+/**
+ * The class of the chunks holding size bytes, SLAB_LARGE if too large.
+ */
+uint8_t slabs_clsid(struct luaeng_slabs *slabs, size_t size);
+
+/**
+ * The memory taken by a chunk of class clsid holding size bytes: the
+ * chunk size of the class, or size itself for SLAB_LARGE.
+ */
+size_t slabs_chunk_size(struct luaeng_slabs *slabs, uint8_t clsid,
+                        size_t size);
+
+/**
+ * Report per class usage ("stats slabs").
+ */
+void slabs_stats(struct luaeng_slabs *slabs, ADD_STAT add_stat,
+                 const void *cookie);
+
+#endif
@@ -0,0 +1,436 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "crc32.h"
+#include "lua_engine.h"
+#include "snapshot.h"
+
+/*
+ * File layout, all integers little endian:
+ *
+ *   header:  "LUAESNAP" version:u32 0:u32
+ *   item:    nkey:u16 nbytes:u32 flags:u32 exptime:u64 key value
+ *   trailer: END_MARK:u16 count:u64 crc32:u32
+ *
+ * exptime is a unix time (0 for never), as the server's clock starts
+ * over with the process.
+ */
+#define SNAPSHOT_MAGIC    "LUAESNAP"
+#define SNAPSHOT_VERSION  1
+#define HEADER_SIZE       16
+#define ITEM_HEADER_SIZE  18
+#define TRAILER_SIZE      14
+#define END_MARK          0xffff
+#define LOAD_BATCH        4096
+
+void snapshot_init(struct luaeng_snapshot *snap, struct luaeng_store *store,
+                   const char *path, uint32_t interval) {
+   memset(snap, 0, sizeof(*snap));
+   snap->store = store;
+   snap->path = path != NULL ? strdup(path) : NULL;
+   snap->interval = interval;
+   pthread_mutex_init(&snap->lock, NULL);
+   pthread_cond_init(&snap->cond, NULL);
+}
+
+void snapshot_destroy(struct luaeng_snapshot *snap) {
+   pthread_mutex_destroy(&snap->lock);
+   pthread_cond_destroy(&snap->cond);
+   free(snap->path);
+   snap->path = NULL;
+}
+
+struct writer {
+   FILE *fp;
+   uint32_t crc;
+};
+
+static void write_bytes(struct writer *w, const void *data, size_t len) {
+   w->crc = crc32_update(w->crc, data, len);
+   fwrite(data, 1, len, w->fp);
+}
+
+static void write_item(struct writer *w, const hash_item *it,
+                       rel_time_t now, time_t unix_now) {
+   uint8_t hdr[ITEM_HEADER_SIZE];
+   uint64_t exptime = 0;
+   if (it->item.exptime != 0) {
+      /* The clock may have moved on since the stripe was copied */
+      int64_t when = (int64_t)unix_now + ((int64_t)it->item.exptime - now);
+      exptime = when > 0 ? (uint64_t)when : 1;
+   }
+   put_le(hdr, it->item.nkey, 2);
+   put_le(hdr + 2, it->item.nbytes, 4);
+   put_le(hdr + 6, it->item.flags, 4);
+   put_le(hdr + 10, exptime, 8);
+   write_bytes(w, hdr, sizeof(hdr));
+   write_bytes(w, item_get_key(&it->item), it->item.nkey);
+   write_bytes(w, item_get_data(&it->item), it->item.nbytes);
+}
+
+/*
+ * Write every item to a temporary file, a stripe at a time, and rename
+ * it into place once it is safely on disk.
+ */
+static bool write_snapshot(struct luaeng_snapshot *snap) {
+   struct luaeng_store *store = snap->store;
+   size_t len = strlen(snap->path);
+   char *tmp = malloc(len + 5);
+   if (tmp == NULL) {
+      return false;
+   }
+   memcpy(tmp, snap->path, len);
+   memcpy(tmp + len, ".tmp", 5);
+
+   struct writer w = { .fp = fopen(tmp, "wb"), .crc = 0 };
+   if (w.fp == NULL) {
+      fprintf(stderr, "snapshot: can't create %s: %s\n", tmp, strerror(errno));
+      free(tmp);
+      return false;
+   }
+
+   uint8_t buf[HEADER_SIZE];
+   memcpy(buf, SNAPSHOT_MAGIC, 8);
+   put_le(buf + 8, SNAPSHOT_VERSION, 4);
+   put_le(buf + 12, 0, 4);
+   write_bytes(&w, buf, HEADER_SIZE);
+
+   bool ok = true;
+   snap->items = 0;
+   snap->bytes = HEADER_SIZE;
+   for (uint32_t ii = 0; ii < store->nstripes && ok; ++ii) {
+      hash_item **items;
+      int n = store_snapshot_stripe(store, ii, &items);
+      if (n < 0) {
+         ok = false;
+         break;
+      }
+
+      rel_time_t now = store->get_current_time();
+      time_t unix_now = time(NULL);
+      for (int jj = 0; jj < n; ++jj) {
+         hash_item *it = items[jj];
+         write_item(&w, it, now, unix_now);
+         snap->items++;
+         snap->bytes += ITEM_HEADER_SIZE + it->item.nkey + it->item.nbytes;
+         store_item_release(store, it);
+      }
+      free(items);
+      snap->stripes_done = ii + 1;
+      ok = !ferror(w.fp);
+   }
+
+   uint8_t trailer[TRAILER_SIZE];
+   put_le(trailer, END_MARK, 2);
+   put_le(trailer + 2, snap->items, 8);
+   w.crc = crc32_update(w.crc, trailer, 10);
+   put_le(trailer + 10, w.crc, 4);
+   fwrite(trailer, 1, TRAILER_SIZE, w.fp);
+   snap->bytes += TRAILER_SIZE;
+
+   ok = ok && fflush(w.fp) == 0 && !ferror(w.fp) && fsync(fileno(w.fp)) == 0;
+   if (fclose(w.fp) != 0) {
+      ok = false;
+   }
+   if (ok && rename(tmp, snap->path) != 0) {
+      ok = false;
+   }
+   if (!ok) {
+      fprintf(stderr, "snapshot: failed to write %s: %s\n", snap->path,
+              strerror(errno));
+      unlink(tmp);
+   }
+   free(tmp);
+   return ok;
+}
+
+static void take_snapshot(struct luaeng_snapshot *snap) {
+   uint64_t start = now_ms();
+   snap->stripes_done = 0;
+   snap->in_progress = true;
+   if (write_snapshot(snap)) {
+      snap->taken++;
+      snap->last_time = (uint64_t)time(NULL);
+   } else {
+      snap->failed++;
+   }
+   snap->last_duration = now_ms() - start;
+   snap->in_progress = false;
+}
+
+static void *snapshot_thread(void *arg) {
+   struct luaeng_snapshot *snap = arg;
+
+   pthread_mutex_lock(&snap->lock);
+   while (!snap->stopping) {
+      if (!snap->requested) {
+         if (snap->interval != 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += snap->interval;
+            if (pthread_cond_timedwait(&snap->cond, &snap->lock,
+                                       &deadline) == ETIMEDOUT) {
+               snap->requested = true;
+            }
+         } else {
+            pthread_cond_wait(&snap->cond, &snap->lock);
+         }
+         continue;
+      }
+
+      snap->requested = false;
+      pthread_mutex_unlock(&snap->lock);
+      take_snapshot(snap);
+      pthread_mutex_lock(&snap->lock);
+   }
+   pthread_mutex_unlock(&snap->lock);
+
+   /* The last one, for the next start */
+   take_snapshot(snap);
+   return NULL;
+}
+
+bool snapshot_start(struct luaeng_snapshot *snap) {
+   if (snap->path == NULL) {
+      return true;
+   }
+   snap->started = pthread_create(&snap->thread, NULL, snapshot_thread,
+                                  snap) == 0;
+   return snap->started;
+}
+
+void snapshot_request(struct luaeng_snapshot *snap) {
+   pthread_mutex_lock(&snap->lock);
+   snap->requested = true;
+   pthread_cond_signal(&snap->cond);
+   pthread_mutex_unlock(&snap->lock);
+}
+
+void snapshot_stop(struct luaeng_snapshot *snap) {
+   if (!snap->started) {
+      return;
+   }
+   pthread_mutex_lock(&snap->lock);
+   snap->stopping = true;
+   pthread_cond_signal(&snap->cond);
+   pthread_mutex_unlock(&snap->lock);
+   pthread_join(snap->thread, NULL);
+   snap->started = false;
+}
+
+/*
+ * Walk the items of a mapped snapshot file, checking that they fit and
+ * add up to the count and checksum in the trailer. Sets offsets to the
+ * start of every LOAD_BATCH'th item (so threads can split up the work)
+ * and returns the number of items, or -1 if the file doesn't check out.
+ */
+static int64_t check_snapshot(const uint8_t *data, size_t size,
+                              size_t **offsets, size_t *noffsets) {
+   *offsets = NULL;
+   *noffsets = 0;
+   if (size < HEADER_SIZE + TRAILER_SIZE ||
+       memcmp(data, SNAPSHOT_MAGIC, 8) != 0 ||
+       get_le(data + 8, 4) != SNAPSHOT_VERSION) {
+      return -1;
+   }
+
+   size_t capacity = 0;
+   size_t pos = HEADER_SIZE;
+   uint64_t count = 0;
+   while (pos + 2 <= size && get_le(data + pos, 2) != END_MARK) {
+      if (pos + ITEM_HEADER_SIZE > size) {
+         break;
+      }
+      size_t len = ITEM_HEADER_SIZE + get_le(data + pos, 2) +
+         get_le(data + pos + 2, 4);
+      if (len > size - pos) {
+         break;
+      }
+      if (count % LOAD_BATCH == 0) {
+         if (*noffsets == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            size_t *grown = realloc(*offsets, capacity * sizeof(size_t));
+            if (grown == NULL) {
+               break;
+            }
+            *offsets = grown;
+         }
+         (*offsets)[(*noffsets)++] = pos;
+      }
+      pos += len;
+      count++;
+   }
+
+   if (pos + TRAILER_SIZE != size || get_le(data + pos, 2) != END_MARK ||
+       get_le(data + pos + 2, 8) != count ||
+       get_le(data + pos + 10, 4) != crc32_update(0, data, pos + 10)) {
+      free(*offsets);
+      *offsets = NULL;
+      return -1;
+   }
+   return (int64_t)count;
+}
+
+struct loader {
+   struct luaeng_snapshot *snap;
+   const uint8_t *data;
+   size_t *offsets;
+   size_t noffsets;
+   size_t next;              // Next batch to load, taken atomically.
+   uint64_t count;
+   rel_time_t now;
+   time_t unix_now;
+};
+
+static void load_batch(struct loader *loader, size_t batch) {
+   struct luaeng_snapshot *snap = loader->snap;
+   size_t pos = loader->offsets[batch];
+   uint64_t first = (uint64_t)batch * LOAD_BATCH;
+   uint64_t last = first + LOAD_BATCH < loader->count ?
+      first + LOAD_BATCH : loader->count;
+
+   for (uint64_t ii = first; ii < last; ++ii) {
+      const uint8_t *p = loader->data + pos;
+      size_t nkey = get_le(p, 2);
+      size_t nbytes = get_le(p + 2, 4);
+      uint32_t flags = (uint32_t)get_le(p + 6, 4);
+      uint64_t exptime = get_le(p + 10, 8);
+      const uint8_t *key = p + ITEM_HEADER_SIZE;
+      pos += ITEM_HEADER_SIZE + nkey + nbytes;
+
+      rel_time_t rel = 0;
+      if (exptime != 0) {
+         if (exptime <= (uint64_t)loader->unix_now) {
+            __sync_add_and_fetch(&snap->load_skipped, 1);
+            continue;
+         }
+         rel = loader->now + (rel_time_t)(exptime - loader->unix_now);
+      }
+
+      hash_item *it = store_item_alloc(snap->store, key, nkey, nbytes,
+                                       flags, rel);
+      if (it == NULL) {
+         __sync_add_and_fetch(&snap->load_skipped, 1);
+         continue;
+      }
+      memcpy(item_get_data(&it->item), key + nkey, nbytes);
+      if (store_add(snap->store, it) == ENGINE_SUCCESS) {
+         __sync_add_and_fetch(&snap->loaded, 1);
+      } else {
+         __sync_add_and_fetch(&snap->load_skipped, 1);
+      }
+      store_item_release(snap->store, it);
+   }
+}
+
+static void *loader_thread(void *arg) {
+   struct loader *loader = arg;
+   size_t batch;
+   while ((batch = __sync_fetch_and_add(&loader->next, 1)) < loader->noffsets) {
+      load_batch(loader, batch);
+   }
+   return NULL;
+}
+
+bool snapshot_load(struct luaeng_snapshot *snap, int nthreads) {
+   if (snap->path == NULL) {
+      return true;
+   }
+
+   int fd = open(snap->path, O_RDONLY);
+   if (fd == -1) {
+      return errno == ENOENT;
+   }
+
+   uint64_t start = now_ms();
+   struct stat st;
+   void *data = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   }
+   close(fd);
+   if (data == MAP_FAILED) {
+      snap->load_failed = true;
+      return false;
+   }
+
+   struct loader loader = {
+      .snap = snap,
+      .data = data,
+      .now = snap->store->get_current_time(),
+      .unix_now = time(NULL)
+   };
+   int64_t count = check_snapshot(data, st.st_size, &loader.offsets,
+                                  &loader.noffsets);
+   if (count < 0) {
+      fprintf(stderr, "snapshot: ignoring damaged %s\n", snap->path);
+      munmap(data, st.st_size);
+      snap->load_failed = true;
+      return false;
+   }
+   loader.count = (uint64_t)count;
+
+   /* The store's stripes are locked separately, so this scales */
+   if (nthreads > (int)loader.noffsets) {
+      nthreads = (int)loader.noffsets;
+   }
+   pthread_t *threads = calloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+   int started = 0;
+   while (threads != NULL && started < nthreads &&
+          pthread_create(&threads[started], NULL, loader_thread, &loader) == 0) {
+      started++;
+   }
+   loader_thread(&loader);
+   for (int ii = 0; ii < started; ++ii) {
+      pthread_join(threads[ii], NULL);
+   }
+   free(threads);
+
+   free(loader.offsets);
+   munmap(data, st.st_size);
+   snap->load_duration = now_ms() - start;
+   return true;
+}
+
+void snapshot_stats(struct luaeng_snapshot *snap, ADD_STAT add_stat,
+                    const void *cookie) {
+   add_stat_u64(add_stat, cookie, "snapshot_interval", snap->interval);
+   add_stat_u64(add_stat, cookie, "snapshot_in_progress", snap->in_progress);
+   add_stat_u64(add_stat, cookie, "snapshot_stripes_done", snap->stripes_done);
+   add_stat_u64(add_stat, cookie, "snapshot_stripes", snap->store->nstripes);
+   add_stat_u64(add_stat, cookie, "snapshot_items", snap->items);
+   add_stat_u64(add_stat, cookie, "snapshot_bytes", snap->bytes);
+   add_stat_u64(add_stat, cookie, "snapshot_taken", snap->taken);
+   add_stat_u64(add_stat, cookie, "snapshot_failed", snap->failed);
+   add_stat_u64(add_stat, cookie, "snapshot_last_duration_ms", snap->last_duration);
+   add_stat_u64(add_stat, cookie, "snapshot_last_time", snap->last_time);
+   add_stat_u64(add_stat, cookie, "snapshot_loaded", snap->loaded);
+   add_stat_u64(add_stat, cookie, "snapshot_load_skipped", snap->load_skipped);
+   add_stat_u64(add_stat, cookie, "snapshot_load_duration_ms", snap->load_duration);
+   add_stat_u64(add_stat, cookie, "snapshot_load_failed", snap->load_failed);
+}
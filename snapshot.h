@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Snapshots of the store on disk, for warm restarts.
+ *
+ * A snapshot is written by a thread of its own, one stripe at a time:
+ * the items of a stripe are referenced under its lock and written out
+ * after releasing it, so requests are only held up for as long as it
+ * takes to walk one stripe. Items are never changed once linked, which
+ * makes the referenced items a consistent copy of each stripe.
+ *
+ * The file is written next to its final name and renamed into place once
+ * complete and synced, so a crash never leaves a partial snapshot behind.
+ * It ends with a CRC32 of its contents, and a file which doesn't check
+ * out is ignored when loading.
+ */
+#ifndef MEMCACHED_LUA_SNAPSHOT_H
+#define MEMCACHED_LUA_SNAPSHOT_H
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <memcached/engine.h>
+
+#include "store.h"
+
+struct luaeng_snapshot {
+   struct luaeng_store *store;
+   char *path;
+   uint32_t interval;        // Seconds between snapshots, 0 for on request only.
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t thread;
+   bool started;
+   bool requested;           // Protected by lock.
+   bool stopping;            // Protected by lock.
+
+   /* Stats, only written by the thread taking the snapshot */
+   bool in_progress;
+   uint32_t stripes_done;    // Of the snapshot in progress.
+   uint64_t items;           // Written by the snapshot in progress or the last one.
+   uint64_t bytes;
+   uint64_t taken;
+   uint64_t failed;
+   uint64_t last_duration;   // In ms.
+   uint64_t last_time;       // Unix time the last snapshot completed.
+
+   /* Stats of loading the snapshot at startup */
+   uint64_t loaded;
+   uint64_t load_skipped;    // Expired, or no room for them.
+   uint64_t load_duration;   // In ms.
+   bool load_failed;         // The file was there but didn't check out.
+};
+
+void snapshot_init(struct luaeng_snapshot *snap, struct luaeng_store *store,
+                   const char *path, uint32_t interval);
+
+/**
+ * Load the items of the snapshot file, if there is one, into the store
+ * using up to nthreads threads. Returns false if the file exists but is
+ * damaged, in which case nothing is loaded.
+ */
+bool snapshot_load(struct luaeng_snapshot *snap, int nthreads);
+
+/**
+ * Start the thread taking the snapshots.
+ */
+bool snapshot_start(struct luaeng_snapshot *snap);
+
+/**
+ * Have a snapshot taken as soon as possible (unless one is in progress).
+ */
+void snapshot_request(struct luaeng_snapshot *snap);
+
+/**
+ * Take a last snapshot and stop the thread.
+ */
+void snapshot_stop(struct luaeng_snapshot *snap);
+
+void snapshot_destroy(struct luaeng_snapshot *snap);
+
+void snapshot_stats(struct luaeng_snapshot *snap, ADD_STAT add_stat,
+                    const void *cookie);
+
+#endif
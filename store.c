@@ -0,0 +1,1071 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include <lauxlib.h>
+
+#include "lua_engine.h"
+#include "marshal.h"
+#include "store.h"
+
+#define STORE_META  "luaeng.store"
+#define CURSOR_META "luaeng.store.cursor"
+#define ITEM_META   "luaeng.store.item"
+
+static inline struct store_stripe *get_stripe(struct luaeng_store *store,
+                                              uint32_t hash) {
+   return &store->stripes[hash & (store->nstripes - 1)];
+}
+
+static inline uint32_t get_bucket(struct luaeng_store *store,
+                                  struct store_stripe *stripe,
+                                  uint32_t hash) {
+   return (hash >> store->stripe_bits) & (stripe->nbuckets - 1);
+}
+
+/* The memory an item takes up, counted against the limit */
+static inline size_t item_size(struct luaeng_store *store,
+                               const hash_item *it) {
+   return slabs_chunk_size(store->slabs, it->clsid,
+                           sizeof(*it) + it->item.nkey + it->item.nbytes);
+}
+
+static inline bool is_expired(struct luaeng_store *store,
+                              const hash_item *it, rel_time_t now) {
+   return (it->item.exptime != 0 && it->item.exptime <= now) ||
+      it->cas <= store->flush_cas;
+}
+
+/*
+ * Flush every item with a cas up to the given one.
+ */
+static void flush_before(struct luaeng_store *store, uint64_t cas) {
+   uint64_t old = store->flush_cas;
+   while (old < cas &&
+          !__sync_bool_compare_and_swap(&store->flush_cas, old, cas)) {
+      old = store->flush_cas;
+   }
+}
+
+/*
+ * Get the server's current time, first applying a delayed flush which
+ * has become due. Every operation on the store calls this before looking
+ * at items or handing out a cas, so the items linked before the flush
+ * time are exactly those with a cas up to the current one.
+ */
+static rel_time_t current_time(struct luaeng_store *store) {
+   rel_time_t now = store->get_current_time();
+   rel_time_t when = store->flush_time;
+   if (when != 0 && when <= now) {
+      uint64_t cas = store->cas;
+      if (__sync_bool_compare_and_swap(&store->flush_time, when, 0)) {
+         flush_before(store, cas);
+         if (store->changed != NULL) {
+            store->changed(store->changed_arg, STORE_FLUSHED, NULL, cas);
+         }
+      }
+   }
+   return now;
+}
+
+bool store_item_expired(struct luaeng_store *store, const hash_item *it) {
+   return is_expired(store, it, current_time(store));
+}
+
+bool store_init(struct luaeng_store *store, size_t nstripes,
+                uint32_t (*hash)(const void *key, size_t nkey, uint32_t seed),
+                rel_time_t (*get_current_time)(void),
+                struct luaeng_slabs *slabs) {
+   uint32_t n = 1;
+   uint32_t bits = 0;
+   while (n < nstripes) {
+      n <<= 1;
+      bits++;
+   }
+
+   memset(store, 0, sizeof(*store));
+   store->hash = hash;
+   store->get_current_time = get_current_time;
+   store->slabs = slabs;
+   store->nstripes = n;
+   store->stripe_bits = bits;
+
+   if (posix_memalign((void**)&store->stripes, 64, n * sizeof(*store->stripes)) != 0) {
+      store->stripes = NULL;
+      return false;
+   }
+   memset(store->stripes, 0, n * sizeof(*store->stripes));
+
+   for (uint32_t ii = 0; ii < n; ++ii) {
+      struct store_stripe *stripe = &store->stripes[ii];
+      stripe->buckets = calloc(STORE_INIT_BUCKETS, sizeof(hash_item*));
+      if (stripe->buckets == NULL) {
+         store->nstripes = ii;
+         store_destroy(store);
+         return false;
+      }
+      stripe->nbuckets = STORE_INIT_BUCKETS;
+      pthread_mutex_init(&stripe->lock, NULL);
+   }
+
+   return true;
+}
+
+void store_destroy(struct luaeng_store *store) {
+   if (store->stripes == NULL) {
+      return;
+   }
+
+   for (uint32_t ii = 0; ii < store->nstripes; ++ii) {
+      struct store_stripe *stripe = &store->stripes[ii];
+      for (uint32_t b = 0; b < stripe->nbuckets; ++b) {
+         hash_item *it = stripe->buckets[b];
+         while (it != NULL) {
+            hash_item *next = it->next;
+            store_item_release(store, it);
+            it = next;
+         }
+      }
+      free(stripe->buckets);
+      pthread_mutex_destroy(&stripe->lock);
+   }
+
+   free(store->stripes);
+   store->stripes = NULL;
+}
+
+void store_set_limit(struct luaeng_store *store, uint64_t limit,
+                     void (*evicted)(void *arg, hash_item *it), void *arg) {
+   store->limit = limit;
+   store->evicted = evicted;
+   store->evicted_arg = arg;
+}
+
+void store_set_changed(struct luaeng_store *store,
+                       void (*changed)(void *arg, enum store_change change,
+                                       hash_item *it, uint64_t value),
+                       void *arg) {
+   store->changed = changed;
+   store->changed_arg = arg;
+}
+
+hash_item *store_item_alloc(struct luaeng_store *store,
+                            const void *key, size_t nkey, size_t nbytes,
+                            uint32_t flags, rel_time_t exptime) {
+   uint8_t clsid;
+   hash_item *it = slabs_alloc(store->slabs, sizeof(*it) + nkey + nbytes, &clsid);
+   if (it != NULL) {
+      it->next = NULL;
+      it->cas = 0;
+      it->clsid = clsid;
+      it->referenced = 0;
+      it->hash = 0;
+      it->refcount = 1;
+      it->item.exptime = exptime;
+      it->item.nbytes = nbytes;
+      it->item.flags = flags;
+      it->item.nkey = nkey;
+      it->item.iflag = 0;
+      memcpy((void*)item_get_key(&it->item), key, nkey);
+   }
+   return it;
+}
+
+void store_item_release(struct luaeng_store *store, hash_item *it) {
+   if (__sync_sub_and_fetch(&it->refcount, 1) == 0) {
+      slabs_free(store->slabs, it, it->clsid);
+   }
+}
+
+static inline bool key_equal(const hash_item *it, uint32_t hash,
+                             const void *key, size_t nkey) {
+   return it->hash == hash && it->item.nkey == nkey &&
+      memcmp(item_get_key(&it->item), key, nkey) == 0;
+}
+
+/*
+ * Double the number of buckets in a stripe. Called with the stripe lock
+ * held; if we're out of memory we just keep the longer chains.
+ */
+static void grow_stripe(struct luaeng_store *store,
+                        struct store_stripe *stripe) {
+   uint32_t nbuckets = stripe->nbuckets * 2;
+   hash_item **buckets = calloc(nbuckets, sizeof(hash_item*));
+   if (buckets == NULL) {
+      return;
+   }
+
+   hash_item **old = stripe->buckets;
+   uint32_t nold = stripe->nbuckets;
+   stripe->buckets = buckets;
+   stripe->nbuckets = nbuckets;
+
+   for (uint32_t b = 0; b < nold; ++b) {
+      hash_item *it = old[b];
+      while (it != NULL) {
+         hash_item *next = it->next;
+         uint32_t idx = get_bucket(store, stripe, it->hash);
+         it->next = buckets[idx];
+         buckets[idx] = it;
+         it = next;
+      }
+   }
+   free(old);
+}
+
+/*
+ * Find the link to the item with the given key: either the pointer to it
+ * or the NULL ending its bucket's chain. Called with the stripe lock held.
+ */
+static hash_item **find_item(struct luaeng_store *store,
+                             struct store_stripe *stripe, uint32_t hash,
+                             const void *key, size_t nkey) {
+   hash_item **pos = &stripe->buckets[get_bucket(store, stripe, hash)];
+   while (*pos != NULL && !key_equal(*pos, hash, key, nkey)) {
+      pos = &(*pos)->next;
+   }
+   return pos;
+}
+
+/*
+ * Take the item at pos out of its stripe. Called with the stripe lock
+ * held; once it's released the caller passes the item to forget_item().
+ */
+static hash_item *unlink_pos(struct store_stripe *stripe, hash_item **pos) {
+   hash_item *it = *pos;
+   *pos = it->next;
+   it->next = NULL;
+   stripe->nitems--;
+   return it;
+}
+
+static void forget_item(struct luaeng_store *store, hash_item *it) {
+   __sync_sub_and_fetch(&store->nitems, 1);
+   __sync_sub_and_fetch(&store->nbytes, item_size(store, it));
+   store_item_release(store, it);
+}
+
+static void reclaim_item(struct luaeng_store *store, hash_item *it) {
+   __sync_add_and_fetch(&store->reclaimed, 1);
+   forget_item(store, it);
+}
+
+/*
+ * Move the clock hand of the next stripe until it finds an item which has
+ * expired or hasn't been read since the hand last passed it, and remove
+ * that item. Returns false if the stripe is empty.
+ */
+static bool evict_one(struct luaeng_store *store) {
+   uint32_t idx = __sync_fetch_and_add(&store->clock, 1) & (store->nstripes - 1);
+   struct store_stripe *stripe = &store->stripes[idx];
+   rel_time_t now = current_time(store);
+   hash_item *victim = NULL;
+
+   pthread_mutex_lock(&stripe->lock);
+   /* The first turn clears every referenced bit, so two are enough */
+   for (uint32_t n = 0;
+        victim == NULL && stripe->nitems > 0 && n <= 2 * stripe->nbuckets;
+        ++n) {
+      uint32_t b = stripe->hand & (stripe->nbuckets - 1);
+      for (hash_item **pos = &stripe->buckets[b]; *pos != NULL;
+           pos = &(*pos)->next) {
+         if (!(*pos)->referenced || is_expired(store, *pos, now)) {
+            victim = unlink_pos(stripe, pos);
+            break;
+         }
+         (*pos)->referenced = 0;
+      }
+      if (victim == NULL) {
+         stripe->hand = b + 1;
+      }
+   }
+   pthread_mutex_unlock(&stripe->lock);
+
+   if (victim == NULL) {
+      return false;
+   }
+   if (is_expired(store, victim, now)) {
+      reclaim_item(store, victim);
+   } else {
+      __sync_add_and_fetch(&store->evictions, 1);
+      if (store->evicted != NULL) {
+         store->evicted(store->evicted_arg, victim);
+      }
+      forget_item(store, victim);
+   }
+   return true;
+}
+
+/*
+ * Evict items until one of the given size fits under the limit. Gives up
+ * once a round over all stripes found nothing to evict.
+ */
+static bool make_room(struct luaeng_store *store, size_t size) {
+   if (size > store->limit) {
+      return false;
+   }
+
+   uint32_t empty = 0;
+   while (store->nbytes + size > store->limit) {
+      if (evict_one(store)) {
+         empty = 0;
+      } else if (++empty >= store->nstripes) {
+         return false;
+      }
+   }
+   return true;
+}
+
+hash_item *store_get(struct luaeng_store *store, const void *key, size_t nkey) {
+   uint32_t hash = store->hash(key, nkey, 0);
+   struct store_stripe *stripe = get_stripe(store, hash);
+   rel_time_t now = current_time(store);
+   hash_item *expired = NULL;
+
+   pthread_mutex_lock(&stripe->lock);
+   hash_item **pos = find_item(store, stripe, hash, key, nkey);
+   hash_item *it = *pos;
+   if (it != NULL && is_expired(store, it, now)) {
+      expired = unlink_pos(stripe, pos);
+      it = NULL;
+   } else if (it != NULL) {
+      it->referenced = 1;
+      __sync_add_and_fetch(&it->refcount, 1);
+   }
+   pthread_mutex_unlock(&stripe->lock);
+
+   if (expired != NULL) {
+      reclaim_item(store, expired);
+   }
+   return it;
+}
+
+/*
+ * Link it, replacing the item with the same key. With restore set, the
+ * item keeps its own cas instead of being given a new one. Room is made
+ * only once the store is known to go ahead, and only for what it adds
+ * over the item it replaces.
+ */
+static ENGINE_ERROR_CODE do_store_link(struct luaeng_store *store,
+                                       hash_item *it, uint64_t cas,
+                                       bool add, bool restore) {
+   const char *key = item_get_key(&it->item);
+   it->hash = store->hash(key, it->item.nkey, 0);
+   struct store_stripe *stripe = get_stripe(store, it->hash);
+   rel_time_t now = current_time(store);
+   size_t size = item_size(store, it);
+   bool room = store->limit == 0;
+   hash_item **pos;
+   hash_item *old;
+   bool expired;
+
+   pthread_mutex_lock(&stripe->lock);
+   for (;;) {
+      pos = find_item(store, stripe, it->hash, key, it->item.nkey);
+      old = *pos;
+      expired = old != NULL && is_expired(store, old, now);
+      if (add && old != NULL && !expired) {
+         pthread_mutex_unlock(&stripe->lock);
+         return ENGINE_KEY_EEXISTS;
+      }
+      if (cas != 0 && (old == NULL || expired || old->cas != cas)) {
+         pthread_mutex_unlock(&stripe->lock);
+         return old == NULL || expired ? ENGINE_KEY_ENOENT : ENGINE_KEY_EEXISTS;
+      }
+      if (room) {
+         break;
+      }
+
+      size_t need = size;
+      if (old != NULL) {
+         size_t old_size = item_size(store, old);
+         need = size > old_size ? size - old_size : 0;
+      }
+      if (store->nbytes + need <= store->limit) {
+         break;
+      }
+
+      /* Evicting takes stripe locks; look again once there is room */
+      pthread_mutex_unlock(&stripe->lock);
+      if (!make_room(store, need)) {
+         return ENGINE_ENOMEM;
+      }
+      room = true;
+      pthread_mutex_lock(&stripe->lock);
+   }
+
+   __sync_add_and_fetch(&it->refcount, 1);
+   if (!restore) {
+      it->cas = __sync_add_and_fetch(&store->cas, 1);
+   }
+   if (old != NULL) {
+      it->next = old->next;
+   } else {
+      it->next = NULL;
+      stripe->nitems++;
+   }
+   *pos = it;
+   if (store->changed != NULL) {
+      store->changed(store->changed_arg, STORE_LINKED, it, it->cas);
+   }
+   if (stripe->nitems > stripe->nbuckets + stripe->nbuckets / 2) {
+      grow_stripe(store, stripe);
+   }
+   pthread_mutex_unlock(&stripe->lock);
+
+   __sync_add_and_fetch(&store->nbytes, size);
+   if (old != NULL) {
+      if (expired) {
+         __sync_add_and_fetch(&store->reclaimed, 1);
+      }
+      __sync_sub_and_fetch(&store->nbytes, item_size(store, old));
+      store_item_release(store, old);
+   } else {
+      __sync_add_and_fetch(&store->nitems, 1);
+   }
+   return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE store_link(struct luaeng_store *store, hash_item *it,
+                             uint64_t cas) {
+   return do_store_link(store, it, cas, false, false);
+}
+
+ENGINE_ERROR_CODE store_add(struct luaeng_store *store, hash_item *it) {
+   return do_store_link(store, it, 0, true, false);
+}
+
+ENGINE_ERROR_CODE store_restore(struct luaeng_store *store, hash_item *it) {
+   uint64_t old = store->cas;
+   while (old < it->cas &&
+          !__sync_bool_compare_and_swap(&store->cas, old, it->cas)) {
+      old = store->cas;
+   }
+   if (store_item_expired(store, it)) {
+      return ENGINE_KEY_ENOENT;
+   }
+   return do_store_link(store, it, 0, false, true);
+}
+
+void store_flush_cas(struct luaeng_store *store, uint64_t cas) {
+   flush_before(store, cas);
+}
+
+ENGINE_ERROR_CODE store_unlink(struct luaeng_store *store, const void *key,
+                               size_t nkey, uint64_t cas) {
+   uint32_t hash = store->hash(key, nkey, 0);
+   struct store_stripe *stripe = get_stripe(store, hash);
+   rel_time_t now = current_time(store);
+
+   pthread_mutex_lock(&stripe->lock);
+   hash_item **pos = find_item(store, stripe, hash, key, nkey);
+   hash_item *it = *pos;
+   bool expired = it != NULL && is_expired(store, it, now);
+   if (it != NULL && !expired && cas != 0 && it->cas != cas) {
+      pthread_mutex_unlock(&stripe->lock);
+      return ENGINE_KEY_EEXISTS;
+   }
+   if (it != NULL) {
+      unlink_pos(stripe, pos);
+      if (!expired && store->changed != NULL) {
+         store->changed(store->changed_arg, STORE_UNLINKED, it, it->cas);
+      }
+   }
+   pthread_mutex_unlock(&stripe->lock);
+
+   if (it == NULL) {
+      return ENGINE_KEY_ENOENT;
+   }
+   if (expired) {
+      reclaim_item(store, it);
+      return ENGINE_KEY_ENOENT;
+   }
+
+   forget_item(store, it);
+   return ENGINE_SUCCESS;
+}
+
+/*
+ * Parse the decimal value of a counter. Like the server we accept
+ * trailing whitespace (such as the "\r\n" of the text protocol).
+ */
+static bool parse_counter(const hash_item *it, uint64_t *value) {
+   const char *ptr = item_get_data(&it->item);
+   const char *end = ptr + it->item.nbytes;
+   uint64_t val = 0;
+
+   if (ptr == end || *ptr < '0' || *ptr > '9') {
+      return false;
+   }
+   while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+      uint64_t next = val * 10 + (*ptr - '0');
+      if (next / 10 != val) {
+         return false;
+      }
+      val = next;
+      ptr++;
+   }
+   while (ptr < end && (*ptr == ' ' || *ptr == '\r' || *ptr == '\n')) {
+      ptr++;
+   }
+   if (ptr != end) {
+      return false;
+   }
+
+   *value = val;
+   return true;
+}
+
+static hash_item *counter_alloc(struct luaeng_store *store, const void *key,
+                                size_t nkey, uint64_t value, uint32_t flags,
+                                rel_time_t exptime) {
+   char buffer[32];
+   int len = snprintf(buffer, sizeof(buffer), "%"PRIu64"\r\n", value);
+   hash_item *it = store_item_alloc(store, key, nkey, len, flags, exptime);
+   if (it != NULL) {
+      memcpy(item_get_data(&it->item), buffer, len);
+   }
+   return it;
+}
+
+ENGINE_ERROR_CODE store_arithmetic(struct luaeng_store *store,
+                                   const void *key, size_t nkey,
+                                   bool increment, bool create,
+                                   uint64_t delta, uint64_t initial,
+                                   rel_time_t exptime,
+                                   uint64_t *cas, uint64_t *result) {
+   for (;;) {
+      ENGINE_ERROR_CODE ret;
+      hash_item *it = store_get(store, key, nkey);
+      hash_item *nit;
+      uint64_t value;
+
+      if (it == NULL) {
+         if (!create) {
+            return ENGINE_KEY_ENOENT;
+         }
+         value = initial;
+         nit = counter_alloc(store, key, nkey, value, 0, exptime);
+         if (nit == NULL) {
+            return ENGINE_ENOMEM;
+         }
+         ret = store_add(store, nit);
+      } else {
+         if (!parse_counter(it, &value)) {
+            store_item_release(store, it);
+            return ENGINE_EINVAL;
+         }
+         if (increment) {
+            value += delta;
+         } else if (delta > value) {
+            value = 0;
+         } else {
+            value -= delta;
+         }
+         nit = counter_alloc(store, key, nkey, value, it->item.flags,
+                             it->item.exptime);
+         if (nit == NULL) {
+            store_item_release(store, it);
+            return ENGINE_ENOMEM;
+         }
+         ret = store_link(store, nit, it->cas);
+         store_item_release(store, it);
+      }
+
+      if (ret == ENGINE_SUCCESS) {
+         *cas = nit->cas;
+         *result = value;
+      }
+      store_item_release(store, nit);
+
+      /* Someone else changed the counter under our feet; try again */
+      if (ret != ENGINE_KEY_EEXISTS && ret != ENGINE_KEY_ENOENT) {
+         return ret;
+      }
+   }
+}
+
+/*
+ * Build the item resulting from appending or prepending the value of it to
+ * the value of old. The "\r\n" ending the first value is dropped so the
+ * result keeps a single terminator.
+ */
+static hash_item *concat_alloc(struct luaeng_store *store, hash_item *old,
+                               hash_item *it, bool append) {
+   hash_item *head = append ? old : it;
+   hash_item *tail = append ? it : old;
+   const char *hdata = item_get_data(&head->item);
+   size_t hlen = head->item.nbytes;
+   if (hlen >= 2 && memcmp(hdata + hlen - 2, "\r\n", 2) == 0) {
+      hlen -= 2;
+   }
+
+   hash_item *nit = store_item_alloc(store, item_get_key(&old->item),
+                                     old->item.nkey,
+                                     hlen + tail->item.nbytes,
+                                     old->item.flags, old->item.exptime);
+   if (nit != NULL) {
+      char *data = item_get_data(&nit->item);
+      memcpy(data, hdata, hlen);
+      memcpy(data + hlen, item_get_data(&tail->item), tail->item.nbytes);
+   }
+   return nit;
+}
+
+ENGINE_ERROR_CODE store_item(struct luaeng_store *store, hash_item *it,
+                             uint64_t cas, ENGINE_STORE_OPERATION operation) {
+   ENGINE_ERROR_CODE ret;
+
+   switch (operation) {
+   case OPERATION_SET:
+      return store_link(store, it, 0);
+   case OPERATION_CAS:
+      return store_link(store, it, cas);
+   case OPERATION_ADD:
+      ret = store_add(store, it);
+      return ret == ENGINE_KEY_EEXISTS ? ENGINE_NOT_STORED : ret;
+   case OPERATION_REPLACE:
+   case OPERATION_APPEND:
+   case OPERATION_PREPEND:
+      break;
+   default:
+      return ENGINE_NOT_STORED;
+   }
+
+   for (;;) {
+      hash_item *old = store_get(store, item_get_key(&it->item), it->item.nkey);
+      if (old == NULL) {
+         return ENGINE_NOT_STORED;
+      }
+      if (cas != 0 && old->cas != cas) {
+         store_item_release(store, old);
+         return ENGINE_KEY_EEXISTS;
+      }
+
+      if (operation == OPERATION_REPLACE) {
+         ret = store_link(store, it, old->cas);
+      } else {
+         hash_item *nit = concat_alloc(store, old, it,
+                                       operation == OPERATION_APPEND);
+         if (nit == NULL) {
+            store_item_release(store, old);
+            return ENGINE_ENOMEM;
+         }
+         ret = store_link(store, nit, old->cas);
+         it->cas = nit->cas;
+         store_item_release(store, nit);
+      }
+      store_item_release(store, old);
+
+      /* The item changed or went away since we looked; try again */
+      if (ret != ENGINE_KEY_EEXISTS && ret != ENGINE_KEY_ENOENT) {
+         return ret;
+      }
+   }
+}
+
+void store_flush(struct luaeng_store *store, rel_time_t when) {
+   if (when != 0 && when > store->get_current_time()) {
+      store->flush_time = when;
+      if (store->changed != NULL) {
+         store->changed(store->changed_arg, STORE_FLUSH_AT, NULL, when);
+      }
+      return;
+   }
+   uint64_t cas = store->cas;
+   store->flush_time = 0;
+   flush_before(store, cas);
+   if (store->changed != NULL) {
+      store->changed(store->changed_arg, STORE_FLUSHED, NULL, cas);
+   }
+}
+
+int store_snapshot_stripe(struct luaeng_store *store, uint32_t idx,
+                          hash_item ***items) {
+   struct store_stripe *stripe = &store->stripes[idx];
+   rel_time_t now = current_time(store);
+   int n = 0;
+
+   *items = NULL;
+
+   pthread_mutex_lock(&stripe->lock);
+   if (stripe->nitems > 0) {
+      *items = malloc(stripe->nitems * sizeof(hash_item*));
+      if (*items == NULL) {
+         pthread_mutex_unlock(&stripe->lock);
+         return -1;
+      }
+      for (uint32_t b = 0; b < stripe->nbuckets; ++b) {
+         for (hash_item *it = stripe->buckets[b]; it != NULL; it = it->next) {
+            if (is_expired(store, it, now)) {
+               continue;
+            }
+            __sync_add_and_fetch(&it->refcount, 1);
+            (*items)[n++] = it;
+         }
+      }
+   }
+   pthread_mutex_unlock(&stripe->lock);
+
+   return n;
+}
+
+/*
+ * Lua bindings. The store is exposed as a userdata with the methods:
+ *
+ *   store:get(key)                     -> value, flags, exptime, cas | nil
+ *   store:ref(key)                     -> item handle | nil
+ *   store:put(key, value[, flags[, exptime[, cas]]])
+ *                                      -> cas | nil, status
+ *   store:delete(key[, cas])           -> true | false, status
+ *   store:incr(key, delta[, initial[, exptime]])
+ *   store:decr(key, delta[, initial[, exptime]])
+ *                                      -> value, cas | nil, status
+ *   store:pairs()                      -> iterator over key, value, flags,
+ *                                         exptime, cas
+ *   store:count()                      -> number of items
+ *   store:flush([when])
+ *   store:now()                        -> the server's current time
+ *
+ * An item handle pins the stored value without copying it into lua. The
+ * handle may be returned from memcached_get, in which case the engine
+ * hands the stored item straight to the server. Handles have the methods
+ * key(), value(), flags(), exptime() and cas().
+ *
+ * A non-zero cas makes put and delete conditional on the stored item
+ * having that cas. On failure they return memcached.KEY_ENOENT or
+ * memcached.KEY_EEXISTS as the status.
+ *
+ * incr and decr work like the memcached commands on the decimal value of
+ * an item. If initial is given a missing counter is created with it.
+ *
+ * Flags and exptimes are 32 bit numbers. A cas, counter value or delta
+ * above 2^53 is passed as a decimal string (see marshal.h).
+ *
+ * An exptime is a time on the server's clock, as returned by store:now()
+ * and passed to the hooks; 0 means the item never expires. Expired items
+ * are invisible to every method.
+ */
+
+struct store_ref {
+   struct luaeng_store *store;
+   hash_item *it;
+};
+
+struct store_cursor {
+   struct luaeng_store *store;
+   uint32_t stripe;    // Next stripe to snapshot.
+   hash_item **items;  // Referenced items from the current stripe.
+   int nitems;
+   int pos;
+};
+
+static struct luaeng_store *check_store(lua_State *L) {
+   return *(struct luaeng_store **)luaL_checkudata(L, 1, STORE_META);
+}
+
+static void push_item(lua_State *L, hash_item *it) {
+   lua_pushlstring(L, item_get_data(&it->item), it->item.nbytes);
+   marshal_push_u32(L, it->item.flags);
+   marshal_push_u32(L, it->item.exptime);
+   marshal_push_u64(L, it->cas);
+}
+
+static int lstore_get(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   size_t nkey;
+   const char *key = luaL_checklstring(L, 2, &nkey);
+
+   hash_item *it = store_get(store, key, nkey);
+   if (it == NULL) {
+      lua_pushnil(L);
+      return 1;
+   }
+
+   push_item(L, it);
+   store_item_release(store, it);
+   return 4;
+}
+
+static int lstore_ref(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   size_t nkey;
+   const char *key = luaL_checklstring(L, 2, &nkey);
+
+   hash_item *it = store_get(store, key, nkey);
+   if (it == NULL) {
+      lua_pushnil(L);
+      return 1;
+   }
+
+   struct store_ref *ref = lua_newuserdata(L, sizeof(*ref));
+   ref->store = store;
+   ref->it = it;
+   luaL_getmetatable(L, ITEM_META);
+   lua_setmetatable(L, -2);
+   return 1;
+}
+
+static int lstore_put(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   size_t nkey, nbytes;
+   const char *key = luaL_checklstring(L, 2, &nkey);
+   const char *val = luaL_checklstring(L, 3, &nbytes);
+   uint32_t flags = marshal_opt_u32(L, 4, 0);
+   rel_time_t exptime = marshal_opt_u32(L, 5, 0);
+   uint64_t cas = marshal_opt_u64(L, 6, 0);
+
+   luaL_argcheck(L, nkey > 0 && nkey <= STORE_KEY_MAX, 2, "invalid key length");
+
+   hash_item *it = store_item_alloc(store, key, nkey, nbytes, flags, exptime);
+   if (it == NULL) {
+      return luaL_error(L, "store: out of memory");
+   }
+   memcpy(item_get_data(&it->item), val, nbytes);
+   ENGINE_ERROR_CODE ret = store_link(store, it, cas);
+   cas = it->cas;
+   store_item_release(store, it);
+
+   if (ret != ENGINE_SUCCESS) {
+      lua_pushnil(L);
+      lua_pushinteger(L, ret);
+      return 2;
+   }
+   marshal_push_u64(L, cas);
+   return 1;
+}
+
+static int lstore_delete(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   size_t nkey;
+   const char *key = luaL_checklstring(L, 2, &nkey);
+   uint64_t cas = marshal_opt_u64(L, 3, 0);
+
+   ENGINE_ERROR_CODE ret = store_unlink(store, key, nkey, cas);
+   lua_pushboolean(L, ret == ENGINE_SUCCESS);
+   if (ret != ENGINE_SUCCESS) {
+      lua_pushinteger(L, ret);
+      return 2;
+   }
+   return 1;
+}
+
+static int do_lstore_arithmetic(lua_State *L, bool increment) {
+   struct luaeng_store *store = check_store(L);
+   size_t nkey;
+   const char *key = luaL_checklstring(L, 2, &nkey);
+   uint64_t delta = marshal_check_u64(L, 3);
+   bool create = !lua_isnoneornil(L, 4);
+   uint64_t initial = marshal_opt_u64(L, 4, 0);
+   rel_time_t exptime = marshal_opt_u32(L, 5, 0);
+   uint64_t cas, result;
+
+   ENGINE_ERROR_CODE ret = store_arithmetic(store, key, nkey, increment,
+                                            create, delta, initial, exptime,
+                                            &cas, &result);
+   if (ret != ENGINE_SUCCESS) {
+      lua_pushnil(L);
+      lua_pushinteger(L, ret);
+      return 2;
+   }
+   marshal_push_u64(L, result);
+   marshal_push_u64(L, cas);
+   return 2;
+}
+
+static int lstore_incr(lua_State *L) {
+   return do_lstore_arithmetic(L, true);
+}
+
+static int lstore_decr(lua_State *L) {
+   return do_lstore_arithmetic(L, false);
+}
+
+/*
+ * The items linked. Expired and flushed items are only unlinked once
+ * something comes across them, so this is an upper bound on the live ones.
+ */
+static int lstore_count(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   lua_pushnumber(L, (lua_Number)store->nitems);
+   return 1;
+}
+
+static int lstore_flush(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   store_flush(store, marshal_opt_u32(L, 2, 0));
+   return 0;
+}
+
+static int lstore_now(lua_State *L) {
+   marshal_push_u32(L, check_store(L)->get_current_time());
+   return 1;
+}
+
+static hash_item *check_item(lua_State *L) {
+   return ((struct store_ref *)luaL_checkudata(L, 1, ITEM_META))->it;
+}
+
+static int litem_gc(lua_State *L) {
+   struct store_ref *ref = luaL_checkudata(L, 1, ITEM_META);
+   store_item_release(ref->store, ref->it);
+   return 0;
+}
+
+static int litem_key(lua_State *L) {
+   hash_item *it = check_item(L);
+   lua_pushlstring(L, item_get_key(&it->item), it->item.nkey);
+   return 1;
+}
+
+static int litem_value(lua_State *L) {
+   hash_item *it = check_item(L);
+   lua_pushlstring(L, item_get_data(&it->item), it->item.nbytes);
+   return 1;
+}
+
+static int litem_flags(lua_State *L) {
+   marshal_push_u32(L, check_item(L)->item.flags);
+   return 1;
+}
+
+static int litem_exptime(lua_State *L) {
+   marshal_push_u32(L, check_item(L)->item.exptime);
+   return 1;
+}
+
+static int litem_cas(lua_State *L) {
+   marshal_push_u64(L, check_item(L)->cas);
+   return 1;
+}
+
+hash_item *store_to_item(lua_State *L, int idx) {
+   struct store_ref *ref = lua_touserdata(L, idx);
+   if (ref == NULL || !lua_getmetatable(L, idx)) {
+      return NULL;
+   }
+   luaL_getmetatable(L, ITEM_META);
+   bool match = lua_rawequal(L, -1, -2);
+   lua_pop(L, 2);
+
+   if (!match) {
+      return NULL;
+   }
+   __sync_add_and_fetch(&ref->it->refcount, 1);
+   return ref->it;
+}
+
+static void cursor_drop(struct store_cursor *cursor) {
+   while (cursor->pos < cursor->nitems) {
+      store_item_release(cursor->store, cursor->items[cursor->pos++]);
+   }
+   free(cursor->items);
+   cursor->items = NULL;
+   cursor->nitems = cursor->pos = 0;
+}
+
+static int lcursor_gc(lua_State *L) {
+   cursor_drop(luaL_checkudata(L, 1, CURSOR_META));
+   return 0;
+}
+
+static int lcursor_next(lua_State *L) {
+   struct store_cursor *cursor = lua_touserdata(L, lua_upvalueindex(1));
+
+   while (cursor->pos >= cursor->nitems) {
+      cursor_drop(cursor);
+      if (cursor->stripe >= cursor->store->nstripes) {
+         return 0;
+      }
+      cursor->nitems = store_snapshot_stripe(cursor->store, cursor->stripe,
+                                             &cursor->items);
+      if (cursor->nitems < 0) {
+         cursor->nitems = 0;
+         return luaL_error(L, "store: out of memory");
+      }
+      cursor->stripe++;
+   }
+
+   hash_item *it = cursor->items[cursor->pos];
+   lua_pushlstring(L, item_get_key(&it->item), it->item.nkey);
+   push_item(L, it);
+   cursor->items[cursor->pos++] = NULL;
+   store_item_release(cursor->store, it);
+   return 5;
+}
+
+static int lstore_pairs(lua_State *L) {
+   struct luaeng_store *store = check_store(L);
+   struct store_cursor *cursor = lua_newuserdata(L, sizeof(*cursor));
+   memset(cursor, 0, sizeof(*cursor));
+   cursor->store = store;
+   luaL_getmetatable(L, CURSOR_META);
+   lua_setmetatable(L, -2);
+   lua_pushcclosure(L, lcursor_next, 1);
+   return 1;
+}
+
+static const luaL_Reg store_methods[] = {
+   { "get", lstore_get },
+   { "ref", lstore_ref },
+   { "put", lstore_put },
+   { "delete", lstore_delete },
+   { "incr", lstore_incr },
+   { "decr", lstore_decr },
+   { "pairs", lstore_pairs },
+   { "count", lstore_count },
+   { "flush", lstore_flush },
+   { "now", lstore_now },
+   { NULL, NULL }
+};
+
+static const luaL_Reg item_methods[] = {
+   { "key", litem_key },
+   { "value", litem_value },
+   { "flags", litem_flags },
+   { "exptime", litem_exptime },
+   { "cas", litem_cas },
+   { NULL, NULL }
+};
+
+void store_register(lua_State *L, struct luaeng_store *store) {
+   luaL_newmetatable(L, CURSOR_META);
+   lua_pushcfunction(L, lcursor_gc);
+   lua_setfield(L, -2, "__gc");
+   lua_pop(L, 1);
+
+   luaL_newmetatable(L, ITEM_META);
+   lua_pushcfunction(L, litem_gc);
+   lua_setfield(L, -2, "__gc");
+   lua_newtable(L);
+   luaL_register(L, NULL, item_methods);
+   lua_setfield(L, -2, "__index");
+   lua_pop(L, 1);
+
+   struct luaeng_store **ud = lua_newuserdata(L, sizeof(*ud));
+   *ud = store;
+   luaL_newmetatable(L, STORE_META);
+   lua_newtable(L);
+   luaL_register(L, NULL, store_methods);
+   lua_setfield(L, -2, "__index");
+   lua_setmetatable(L, -2);
+   lua_setglobal(L, "store");
+}
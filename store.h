@@ -0,0 +1,246 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Shared key/value store used by all lua interpreters.
+ *
+ * The store is a hash table split into a number of stripes, each protected
+ * by its own lock and owning its own bucket array, so threads working on
+ * different keys rarely contend with each other.
+ *
+ * Items past their expiry time are never returned and are removed when
+ * next looked at. A flush works the same way: it only records the last
+ * cas handed out, and items with a cas up to that one count as expired.
+ * When a memory limit is set, linking an item evicts others to make room
+ * for what it adds over the item it replaces. Victims are chosen per
+ * stripe with the CLOCK algorithm: a hand sweeps over the buckets, and
+ * items which have been read since it last passed get a second chance.
+ */
+#ifndef MEMCACHED_LUA_STORE_H
+#define MEMCACHED_LUA_STORE_H
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <lua.h>
+
+#include <memcached/engine.h>
+
+#include "slabs.h"
+
+#define STORE_DEFAULT_STRIPES 64
+#define STORE_INIT_BUCKETS    64
+#define STORE_KEY_MAX         250
+
+/**
+ * Every item created by the engine is prefixed by this header. The key
+ * and value follow the embedded item, so the layout matches what the
+ * item_get_key()/item_get_data() accessors expect.
+ */
+typedef struct luaeng_item {
+   struct luaeng_item *next; // Next item in the same hash bucket.
+   uint64_t cas;
+   uint32_t hash;            // Hash value of the key.
+   uint32_t refcount;        // One for the store (when linked), one per user.
+   uint8_t clsid;            // Slab class the item was allocated from.
+   uint8_t referenced;       // Read since the clock hand last passed.
+   item item;
+} hash_item;
+
+#define ITEM_HEADER(it) \
+   ((hash_item*)((char*)(it) - offsetof(hash_item, item)))
+
+/**
+ * Changes to the store reported to the changed callback (see
+ * store_set_changed()).
+ */
+enum store_change {
+   STORE_LINKED,    // The item was linked.
+   STORE_UNLINKED,  // The item was removed (not evicted or expired).
+   STORE_FLUSHED,   // The items with a cas up to value were flushed.
+   STORE_FLUSH_AT   // A flush was scheduled at time value.
+};
+
+struct store_stripe {
+   pthread_mutex_t lock;
+   hash_item **buckets;
+   uint32_t nbuckets;        // Always a power of two.
+   uint32_t nitems;
+   uint32_t hand;            // Next bucket to sweep for eviction.
+} __attribute__((aligned(64)));
+
+struct luaeng_store {
+   uint32_t (*hash)(const void *key, size_t nkey, uint32_t seed);
+   rel_time_t (*get_current_time)(void);
+   struct luaeng_slabs *slabs;
+   struct store_stripe *stripes;
+   uint32_t nstripes;        // Always a power of two.
+   uint32_t stripe_bits;
+   uint64_t nitems;          // Updated atomically.
+   uint64_t nbytes;          // Updated atomically.
+   uint64_t cas;             // Last cas handed out, updated atomically.
+   uint64_t flush_cas;       // Items up to this cas are flushed, updated atomically.
+   rel_time_t flush_time;    // Time of a pending delayed flush, 0 for none.
+
+   uint64_t limit;           // Max bytes of linked items, 0 for no limit.
+   uint32_t clock;           // Next stripe to evict from, updated atomically.
+   uint64_t evictions;       // Updated atomically.
+   uint64_t reclaimed;       // Expired items removed, updated atomically.
+
+   /* Called (outside of any lock) with every item evicted to make room */
+   void (*evicted)(void *arg, hash_item *it);
+   void *evicted_arg;
+
+   /* Called with every change, see store_set_changed() */
+   void (*changed)(void *arg, enum store_change change, hash_item *it,
+                   uint64_t value);
+   void *changed_arg;
+};
+
+bool store_init(struct luaeng_store *store, size_t nstripes,
+                uint32_t (*hash)(const void *key, size_t nkey, uint32_t seed),
+                rel_time_t (*get_current_time)(void),
+                struct luaeng_slabs *slabs);
+void store_destroy(struct luaeng_store *store);
+
+/**
+ * Limit the memory used by linked items to limit bytes (0 for no limit).
+ * The evicted callback, if any, may take its own reference to the item.
+ */
+void store_set_limit(struct luaeng_store *store, uint64_t limit,
+                     void (*evicted)(void *arg, hash_item *it), void *arg);
+
+/**
+ * Have the changed callback called with every item linked or unlinked,
+ * while the stripe's lock is held, so the changes to each key are
+ * reported in the order they happen. The callback may take its own
+ * reference to the item but must not call back into the store. Flushes
+ * are reported as they take effect, with it NULL.
+ */
+void store_set_changed(struct luaeng_store *store,
+                       void (*changed)(void *arg, enum store_change change,
+                                       hash_item *it, uint64_t value),
+                       void *arg);
+
+/**
+ * Has the item passed its expiry time, or been flushed?
+ */
+bool store_item_expired(struct luaeng_store *store, const hash_item *it);
+
+/**
+ * Allocate a new (unlinked) item with a reference count of one.
+ */
+hash_item *store_item_alloc(struct luaeng_store *store,
+                            const void *key, size_t nkey, size_t nbytes,
+                            uint32_t flags, rel_time_t exptime);
+
+/**
+ * Drop a reference to an item, freeing it when the last one goes away.
+ */
+void store_item_release(struct luaeng_store *store, hash_item *it);
+
+/**
+ * Look up a key. The returned item carries a reference owned by the
+ * caller which must be dropped with store_item_release().
+ */
+hash_item *store_get(struct luaeng_store *store, const void *key, size_t nkey);
+
+/**
+ * Link an item into the store, replacing any existing item with the
+ * same key, and give it a new cas. The store takes its own reference to
+ * the item. If cas is non-zero the existing item must have that cas, or
+ * ENGINE_KEY_ENOENT/ENGINE_KEY_EEXISTS is returned and nothing changes.
+ * Returns ENGINE_ENOMEM if there is no room for the item under the limit.
+ */
+ENGINE_ERROR_CODE store_link(struct luaeng_store *store, hash_item *it,
+                             uint64_t cas);
+
+/**
+ * Link an item into the store only if there is no item with its key,
+ * returning ENGINE_KEY_EEXISTS otherwise.
+ */
+ENGINE_ERROR_CODE store_add(struct luaeng_store *store, hash_item *it);
+
+/**
+ * Apply a memcached store operation to the store, with the same result
+ * codes as the server expects from the engine's store(). On success the
+ * new cas is available in it->cas.
+ */
+ENGINE_ERROR_CODE store_item(struct luaeng_store *store, hash_item *it,
+                             uint64_t cas, ENGINE_STORE_OPERATION operation);
+
+/**
+ * Remove a key from the store, subject to the same cas check as
+ * store_link().
+ */
+ENGINE_ERROR_CODE store_unlink(struct luaeng_store *store, const void *key,
+                               size_t nkey, uint64_t cas);
+
+/**
+ * Increment or decrement the decimal value stored for a key. Retries
+ * until the update is applied without racing another writer.
+ */
+ENGINE_ERROR_CODE store_arithmetic(struct luaeng_store *store,
+                                   const void *key, size_t nkey,
+                                   bool increment, bool create,
+                                   uint64_t delta, uint64_t initial,
+                                   rel_time_t exptime,
+                                   uint64_t *cas, uint64_t *result);
+
+/**
+ * Invalidate every item in the store at the given time (on the server's
+ * clock), or right away if it's 0 or in the past. Takes constant time;
+ * the memory is reclaimed as the items are found.
+ */
+void store_flush(struct luaeng_store *store, rel_time_t when);
+
+/**
+ * Link an item with the cas it already has, as when restoring the store
+ * from disk; handing out cas values carries on after the largest one.
+ * Items which have expired, or were flushed, are dropped.
+ */
+ENGINE_ERROR_CODE store_restore(struct luaeng_store *store, hash_item *it);
+
+/**
+ * Flush the items with a cas up to the given one, as when restoring the
+ * store from disk.
+ */
+void store_flush_cas(struct luaeng_store *store, uint64_t cas);
+
+/**
+ * Take a referenced copy of every item in one stripe. Returns the number
+ * of items placed into *items (which the caller must free()), or -1 on
+ * allocation failure.
+ */
+int store_snapshot_stripe(struct luaeng_store *store, uint32_t stripe,
+                          hash_item ***items);
+
+/**
+ * If the value at the given stack index is an item handle created by
+ * store:ref(), return the item with a new reference owned by the caller.
+ * Returns NULL for any other value.
+ */
+hash_item *store_to_item(lua_State *L, int idx);
+
+/**
+ * Expose the store to a lua interpreter as the global "store".
+ */
+void store_register(lua_State *L, struct luaeng_store *store);
+
+#endif
@@ -0,0 +1,22 @@
+-- Hooks doing the same as the ones in memcached.lua, without the
+-- logging, to measure the cost of calling into lua for every request.
+
+function memcached_get(key)
+  return store:ref(key)
+end
+
+function memcached_store(key, operation, val, flg, exp, cas)
+  local newcas, status = store:put(key, val, flg, exp, cas)
+  if newcas then
+    return memcached.SUCCESS, newcas
+  end
+  return status
+end
+
+function memcached_remove(key, cas)
+  local ok, status = store:delete(key, cas)
+  if ok then
+    return memcached.SUCCESS
+  end
+  return status
+end
@@ -0,0 +1,82 @@
+-- Hooks for the script tests in lua_test.c. The key of a request picks
+-- what the hook does, so every path can be reached with a plain request.
+
+-- Statuses returned by memcached_remove for "status:*" keys.
+local statuses = {
+  ["status:enoent"] = memcached.KEY_ENOENT,
+  ["status:eexists"] = memcached.KEY_EEXISTS,
+  ["status:true"] = true,
+  ["status:false"] = false,
+  ["status:unknown"] = 4242,
+  ["status:fraction"] = 1.5,
+  ["status:negative"] = -1
+}
+
+function memcached_get(key)
+  if key == "loop:forever" then
+    while true do end
+  elseif key == "loop:caught" then
+    -- The limit can't be caught
+    pcall(function() while true do end end)
+  end
+  return store:ref(key)
+end
+
+-- Only answers "multi:string" and "multi:table" itself, so a hit on them
+-- shows the batch went through here.
+function memcached_get_multi(keys)
+  local results = {}
+  for ii, key in ipairs(keys) do
+    if key == "multi:string" then
+      results[ii] = "string\r\n"
+    elseif key == "multi:table" then
+      results[ii] = { "table\r\n", 7, 0, 42 }
+    elseif key == "multi:bad" then
+      results[ii] = { "bad\r\n", "flags" }
+    else
+      results[ii] = store:ref(key)
+    end
+  end
+  return results
+end
+
+function memcached_store(key, operation, val, flg, exp, cas)
+  if key == "status:false" then
+    return false
+  end
+  local newcas, status = store:put(key, val, flg, exp, cas)
+  if newcas then
+    return memcached.SUCCESS, newcas
+  end
+  return status
+end
+
+function memcached_remove(key, cas)
+  local status = statuses[key]
+  if status ~= nil then
+    return status
+  end
+  local ok, status = store:delete(key, cas)
+  if ok then
+    return memcached.SUCCESS
+  end
+  return status
+end
+
+-- 0xe0 echoes the request back, 0xe1 returns script_version (appended
+-- to a copy of this file by the reload test) and 0xe2 a status of the
+-- key's choosing.
+function memcached_command(opcode, key, extras, body, cas)
+  if opcode == 0xe0 then
+    return memcached.SUCCESS, key .. ":" .. body, extras, cas + 1
+  elseif opcode == 0xe1 then
+    return memcached.SUCCESS, tostring(script_version)
+  elseif opcode == 0xe2 then
+    local status = statuses[key]
+    if status == nil then
+      status = memcached.SUCCESS
+    end
+    return status
+  end
+  return memcached.ENOTSUP
+end
@@ -0,0 +1,537 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Benchmark driver for the lua engine.
+ *
+ * Loads lua_engine.so the way memcached does, behind the server API in
+ * server.c, and calls the engine directly from a number of threads with a
+ * configurable mix of operations, key popularity and key/value sizes.
+ * Reports the throughput and latency percentiles of every operation.
+ * Exits with a non-zero status if an operation fails unexpectedly or the
+ * throughput is below the floor given with -f.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <memcached/engine.h>
+
+#include "histogram.h"
+#include "server.h"
+
+#define DEFAULT_ENGINE "../.libs/lua_engine.so"
+#define DEFAULT_CONFIG "script=bench.lua"
+#define DEFAULT_MIX    "get=80,set=18,remove=1,incr=1"
+#define KEY_MAX        250
+
+enum bench_op {
+   OP_GET,
+   OP_SET,
+   OP_REMOVE,
+   OP_INCR,
+   OP_MAX
+};
+
+static const char* const op_names[OP_MAX] = {
+   [OP_GET] = "get",
+   [OP_SET] = "set",
+   [OP_REMOVE] = "remove",
+   [OP_INCR] = "incr"
+};
+
+static struct {
+   const char *engine;
+   const char *config;
+   int threads;
+   uint64_t ops;          // Per thread.
+   uint32_t keys;
+   size_t key_min, key_max;
+   size_t value_min, value_max;
+   double skew;           // Zipf exponent, 0 for uniform key popularity.
+   uint32_t mix[OP_MAX];  // Cumulative weights.
+   bool preload;
+   const char *stats;     // Engine stats group to print after the run.
+   double floor;          // Min ops/s over all threads, 0 for none.
+} settings = {
+   .engine = DEFAULT_ENGINE,
+   .config = DEFAULT_CONFIG,
+   .threads = 4,
+   .ops = 100000,
+   .keys = 10000,
+   .key_min = 16, .key_max = 16,
+   .value_min = 64, .value_max = 512,
+   .skew = 0.0,
+   .preload = true,
+   .stats = NULL,
+   .floor = 0.0
+};
+
+struct bench_thread {
+   struct server_cookie cookie;
+   pthread_t tid;
+   uint64_t rng;
+   struct luaeng_histogram timings[OP_MAX];
+   uint64_t errors[OP_MAX];
+   uint64_t misses;
+};
+
+static ENGINE_HANDLE_V1 *engine;
+static double *zipf_cdf;
+static char *value_data;
+
+/*
+ * Workload generation.
+ */
+
+static inline uint64_t next_random(struct bench_thread *bt) {
+   /* xorshift64* */
+   bt->rng ^= bt->rng >> 12;
+   bt->rng ^= bt->rng << 25;
+   bt->rng ^= bt->rng >> 27;
+   return bt->rng * 2685821657736338717ULL;
+}
+
+static inline uint64_t random_range(struct bench_thread *bt,
+                                    uint64_t min, uint64_t max) {
+   return min + next_random(bt) % (max - min + 1);
+}
+
+static bool init_zipf(void) {
+   zipf_cdf = malloc(settings.keys * sizeof(*zipf_cdf));
+   if (zipf_cdf == NULL) {
+      return false;
+   }
+
+   double sum = 0;
+   for (uint32_t ii = 0; ii < settings.keys; ++ii) {
+      sum += 1.0 / pow(ii + 1, settings.skew);
+      zipf_cdf[ii] = sum;
+   }
+   for (uint32_t ii = 0; ii < settings.keys; ++ii) {
+      zipf_cdf[ii] /= sum;
+   }
+   return true;
+}
+
+static uint32_t next_key(struct bench_thread *bt) {
+   if (zipf_cdf == NULL) {
+      return (uint32_t)(next_random(bt) % settings.keys);
+   }
+
+   double r = (double)(next_random(bt) >> 11) / (double)(1ULL << 53);
+   uint32_t lo = 0;
+   uint32_t hi = settings.keys - 1;
+   while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (zipf_cdf[mid] < r) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+/*
+ * Every key has the same length on every use, picked from the key size
+ * range by its number.
+ */
+static size_t format_key(char *buf, uint32_t key) {
+   size_t len = settings.key_min;
+   if (settings.key_max > settings.key_min) {
+      len += server_hash(&key, sizeof(key), 0) % (settings.key_max - settings.key_min + 1);
+   }
+
+   int n = snprintf(buf, KEY_MAX + 1, "key:%08"PRIx32, key);
+   if ((size_t)n < len) {
+      memset(buf + n, 'k', len - n);
+   }
+   return (size_t)n > len ? (size_t)n : len;
+}
+
+static enum bench_op next_op(struct bench_thread *bt) {
+   uint32_t r = (uint32_t)(next_random(bt) % settings.mix[OP_MAX - 1]);
+   int op = 0;
+   while (r >= settings.mix[op]) {
+      ++op;
+   }
+   return (enum bench_op)op;
+}
+
+static inline uint64_t now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Operations, in the shape memcached calls them. Values end with "\r\n"
+ * like the ones the server stores.
+ */
+
+static ENGINE_ERROR_CODE do_set(struct bench_thread *bt, const char *key,
+                                size_t nkey, size_t nbytes) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   item *it;
+   uint64_t cas = 0;
+
+   ENGINE_ERROR_CODE ret = engine->allocate(h, bt, &it, key, nkey,
+                                            nbytes + 2, 0, 0);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+   char *data = engine->item_get_data(it);
+   memcpy(data, value_data, nbytes);
+   memcpy(data + nbytes, "\r\n", 2);
+   ret = engine->store(h, bt, it, &cas, OPERATION_SET);
+   engine->release(h, bt, it);
+   return ret;
+}
+
+static ENGINE_ERROR_CODE do_get(struct bench_thread *bt, const char *key,
+                                size_t nkey) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   item *it = NULL;
+
+   ENGINE_ERROR_CODE ret = engine->get(h, bt, &it, key, (int)nkey);
+   if (ret == ENGINE_SUCCESS) {
+      engine->release(h, bt, it);
+   }
+   return ret;
+}
+
+static void run_op(struct bench_thread *bt, enum bench_op op) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   char key[KEY_MAX + 1];
+   size_t nkey = format_key(key, next_key(bt));
+   size_t nbytes = random_range(bt, settings.value_min, settings.value_max);
+   uint64_t cas, result;
+   ENGINE_ERROR_CODE ret;
+
+   uint64_t start = now_ns();
+   switch (op) {
+   case OP_GET:
+      ret = do_get(bt, key, nkey);
+      break;
+   case OP_SET:
+      ret = do_set(bt, key, nkey, nbytes);
+      break;
+   case OP_REMOVE:
+      ret = engine->remove(h, bt, key, nkey, 0);
+      break;
+   case OP_INCR:
+      /* Counters live next to the other keys under their own prefix */
+      key[0] = 'c';
+      ret = engine->arithmetic(h, bt, key, (int)nkey, true, true, 1, 0, 0,
+                               &cas, &result);
+      break;
+   default:
+      ret = ENGINE_FAILED;
+      break;
+   }
+   histogram_record(&bt->timings[op], now_ns() - start);
+
+   if (ret == ENGINE_KEY_ENOENT && (op == OP_GET || op == OP_REMOVE)) {
+      bt->misses++;
+   } else if (ret != ENGINE_SUCCESS) {
+      bt->errors[op]++;
+   }
+}
+
+static void *bench_thread_main(void *arg) {
+   struct bench_thread *bt = arg;
+   for (uint64_t ii = 0; ii < settings.ops; ++ii) {
+      run_op(bt, next_op(bt));
+   }
+   return NULL;
+}
+
+static bool preload(void) {
+   struct bench_thread bt = { .rng = 1 };
+   char key[KEY_MAX + 1];
+
+   for (uint32_t ii = 0; ii < settings.keys; ++ii) {
+      size_t nkey = format_key(key, ii);
+      size_t nbytes = random_range(&bt, settings.value_min, settings.value_max);
+      if (do_set(&bt, key, nkey, nbytes) != ENGINE_SUCCESS) {
+         fprintf(stderr, "Failed to preload key %u\n", ii);
+         return false;
+      }
+   }
+   return true;
+}
+
+/*
+ * Reporting.
+ */
+
+static void print_stat(const char *key, const uint16_t klen,
+                       const char *val, const uint32_t vlen,
+                       const void *UNUSED(cookie)) {
+   printf("STAT %.*s %.*s\n", (int)klen, key, (int)vlen, val);
+}
+
+static bool report(struct bench_thread *threads, double seconds) {
+   uint64_t total = 0;
+   uint64_t errors = 0;
+   uint64_t misses = 0;
+
+   printf("%-8s %10s %10s %10s %10s %10s %10s %8s\n", "op", "count",
+          "ops/s", "mean(ns)", "p50(ns)", "p99(ns)", "p999(ns)", "errors");
+
+   for (int op = 0; op < OP_MAX; ++op) {
+      struct luaeng_histogram hist;
+      uint64_t op_errors = 0;
+
+      memset(&hist, 0, sizeof(hist));
+      for (int tt = 0; tt < settings.threads; ++tt) {
+         const struct luaeng_histogram *th = &threads[tt].timings[op];
+         hist.count += th->count;
+         hist.total += th->total;
+         for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+            hist.buckets[bb] += th->buckets[bb];
+         }
+         op_errors += threads[tt].errors[op];
+      }
+      if (hist.count == 0) {
+         continue;
+      }
+
+      printf("%-8s %10"PRIu64" %10.0f %10"PRIu64" %10"PRIu64" %10"PRIu64
+             " %10"PRIu64" %8"PRIu64"\n", op_names[op], hist.count,
+             hist.count / seconds, hist.total / hist.count,
+             histogram_percentile(&hist, 50.0),
+             histogram_percentile(&hist, 99.0),
+             histogram_percentile(&hist, 99.9), op_errors);
+      total += hist.count;
+      errors += op_errors;
+   }
+   for (int tt = 0; tt < settings.threads; ++tt) {
+      misses += threads[tt].misses;
+   }
+
+   double rate = total / seconds;
+   printf("%d threads, %"PRIu64" ops in %.3f s: %.0f ops/s, %"PRIu64
+          " misses, %"PRIu64" errors\n", settings.threads, total, seconds,
+          rate, misses, errors);
+
+   if (errors > 0) {
+      fprintf(stderr, "FAIL: %"PRIu64" operations failed\n", errors);
+      return false;
+   }
+   if (settings.floor > 0 && rate < settings.floor) {
+      fprintf(stderr, "FAIL: %.0f ops/s is below the floor of %.0f\n",
+              rate, settings.floor);
+      return false;
+   }
+   return true;
+}
+
+/*
+ * Command line.
+ */
+
+static void usage(const char *name) {
+   fprintf(stderr,
+           "Usage: %s [options]\n"
+           "  -e path     engine to load (default %s)\n"
+           "  -c config   engine configuration (default \"%s\")\n"
+           "  -t threads  number of threads (default %d)\n"
+           "  -n ops      operations per thread (default %"PRIu64")\n"
+           "  -k keys     number of distinct keys (default %u)\n"
+           "  -K min[-max]  key size (default %zu)\n"
+           "  -V min[-max]  value size (default %zu-%zu)\n"
+           "  -z skew     zipf exponent of key popularity, 0 for uniform\n"
+           "  -m mix      operation weights (default \"%s\")\n"
+           "  -P          don't store every key before the run\n"
+           "  -S group    print an engine stats group after the run\n"
+           "  -f ops/s    fail if the throughput is lower\n",
+           name, DEFAULT_ENGINE, DEFAULT_CONFIG, settings.threads,
+           settings.ops, settings.keys, settings.key_min,
+           settings.value_min, settings.value_max, DEFAULT_MIX);
+}
+
+static bool parse_range(const char *str, size_t *min, size_t *max) {
+   char *end;
+   errno = 0;
+   unsigned long lo = strtoul(str, &end, 10);
+   unsigned long hi = lo;
+   if (*end == '-') {
+      hi = strtoul(end + 1, &end, 10);
+   }
+   if (errno != 0 || *end != '\0' || hi < lo) {
+      return false;
+   }
+   *min = lo;
+   *max = hi;
+   return true;
+}
+
+static bool parse_mix(const char *str) {
+   uint32_t weights[OP_MAX] = { 0 };
+   char *copy = strdup(str);
+   char *save = NULL;
+   bool ok = copy != NULL;
+
+   for (char *tok = ok ? strtok_r(copy, ",", &save) : NULL; tok != NULL;
+        tok = strtok_r(NULL, ",", &save)) {
+      char *val = strchr(tok, '=');
+      int op = 0;
+      if (val != NULL) {
+         *val++ = '\0';
+         while (op < OP_MAX && strcmp(op_names[op], tok) != 0) {
+            ++op;
+         }
+      }
+      if (val == NULL || op == OP_MAX) {
+         fprintf(stderr, "Invalid mix entry: %s\n", tok);
+         ok = false;
+         break;
+      }
+      weights[op] = (uint32_t)strtoul(val, NULL, 10);
+   }
+   free(copy);
+
+   uint32_t sum = 0;
+   for (int op = 0; op < OP_MAX; ++op) {
+      sum += weights[op];
+      settings.mix[op] = sum;
+   }
+   return ok && sum > 0;
+}
+
+int main(int argc, char **argv) {
+   int c;
+
+   parse_mix(DEFAULT_MIX);
+   while ((c = getopt(argc, argv, "e:c:t:n:k:K:V:z:m:PS:f:h")) != -1) {
+      switch (c) {
+      case 'e':
+         settings.engine = optarg;
+         break;
+      case 'c':
+         settings.config = optarg;
+         break;
+      case 't':
+         settings.threads = atoi(optarg);
+         break;
+      case 'n':
+         settings.ops = strtoull(optarg, NULL, 10);
+         break;
+      case 'k':
+         settings.keys = (uint32_t)strtoul(optarg, NULL, 10);
+         break;
+      case 'K':
+         if (!parse_range(optarg, &settings.key_min, &settings.key_max) ||
+             settings.key_max > KEY_MAX) {
+            fprintf(stderr, "Invalid key size: %s\n", optarg);
+            return 1;
+         }
+         break;
+      case 'V':
+         if (!parse_range(optarg, &settings.value_min, &settings.value_max)) {
+            fprintf(stderr, "Invalid value size: %s\n", optarg);
+            return 1;
+         }
+         break;
+      case 'z':
+         settings.skew = atof(optarg);
+         break;
+      case 'm':
+         if (!parse_mix(optarg)) {
+            return 1;
+         }
+         break;
+      case 'P':
+         settings.preload = false;
+         break;
+      case 'S':
+         settings.stats = optarg;
+         break;
+      case 'f':
+         settings.floor = atof(optarg);
+         break;
+      default:
+         usage(argv[0]);
+         return c == 'h' ? 0 : 1;
+      }
+   }
+   if (settings.threads < 1 || settings.keys < 1) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   value_data = malloc(settings.value_max + 1);
+   if (value_data == NULL || (settings.skew > 0 && !init_zipf())) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   memset(value_data, 'v', settings.value_max);
+
+   CREATE_INSTANCE create = server_load_engine(settings.engine);
+   if (create == NULL ||
+       (engine = server_create_engine(create, settings.config)) == NULL) {
+      return 1;
+   }
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   printf("%s: %s\n", engine->get_info(h), settings.config);
+
+   if (settings.preload && !preload()) {
+      return 1;
+   }
+
+   struct bench_thread *threads = calloc(settings.threads, sizeof(*threads));
+   if (threads == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   uint64_t start = now_ns();
+   for (int tt = 0; tt < settings.threads; ++tt) {
+      threads[tt].rng = 0x9e3779b97f4a7c15ULL * (tt + 1);
+      if (pthread_create(&threads[tt].tid, NULL, bench_thread_main,
+                         &threads[tt]) != 0) {
+         fprintf(stderr, "Failed to create thread\n");
+         return 1;
+      }
+   }
+   for (int tt = 0; tt < settings.threads; ++tt) {
+      pthread_join(threads[tt].tid, NULL);
+   }
+   double seconds = (now_ns() - start) / 1e9;
+
+   bool ok = report(threads, seconds);
+   if (settings.stats != NULL) {
+      engine->get_stats(h, threads, settings.stats, (int)strlen(settings.stats),
+                        print_stat);
+   }
+
+   engine->destroy(h);
+   free(threads);
+   free(value_data);
+   free(zipf_cdf);
+   return ok ? 0 : 1;
+}
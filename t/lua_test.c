@@ -0,0 +1,680 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: Behavioural tests of the lua engine.
+ *
+ * Loads lua_engine.so like lua_bench does and checks, through the engine
+ * interface memcached calls, the cas semantics of stores and arithmetic,
+ * flushes at a later time, and that the data survives a restart from a
+ * snapshot into a journal and then from the journal alone. These run with
+ * a script defining no hooks (-s), to test the store itself.
+ *
+ * With the hooks of t/hooks.lua (-k) it checks instead how the statuses
+ * hooks return are mapped, memcached_get_multi through LUAENG_CMD_GET_MULTI,
+ * memcached_command, the instruction limit and LUAENG_CMD_RELOAD.
+ *
+ * Exits with a non-zero status if any check fails.
+ */
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memcached/engine.h>
+
+#include "lua_engine.h"
+#include "server.h"
+
+#define DEFAULT_ENGINE "../.libs/lua_engine.so"
+#define DEFAULT_SCRIPT "native.lua"
+#define MAX_RESPONSES  8
+
+static const char *script = DEFAULT_SCRIPT;
+static CREATE_INSTANCE create;
+static ENGINE_HANDLE_V1 *engine;
+static struct server_cookie cookie;
+static int failures;
+
+/* The responses to the last binary command */
+static struct response {
+   char key[256];
+   uint16_t nkey;
+   char extras[256];
+   uint8_t nextras;
+   char body[256];
+   uint32_t nbody;
+   uint16_t status;
+   uint64_t cas;
+} responses[MAX_RESPONSES];
+static int nresponses;
+
+#define check(cond) do { \
+      if (!(cond)) { \
+         fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                 #cond); \
+         failures++; \
+      } \
+   } while (0)
+
+static bool start_engine(const char *extra) {
+   char config[1024];
+   snprintf(config, sizeof(config), "script=%s%s", script, extra);
+   engine = server_create_engine(create, config);
+   return engine != NULL;
+}
+
+static void stop_engine(void) {
+   engine->destroy((ENGINE_HANDLE *)engine);
+   engine = NULL;
+}
+
+/*
+ * Operations, in the shape memcached calls them. Values end with "\r\n"
+ * like the ones the server stores.
+ */
+
+static ENGINE_ERROR_CODE do_store(ENGINE_STORE_OPERATION op, const char *key,
+                                  const char *value, uint64_t *cas) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   size_t nbytes = strlen(value);
+   item *it;
+
+   ENGINE_ERROR_CODE ret = engine->allocate(h, &cookie, &it, key,
+                                            strlen(key), nbytes + 2, 0, 0);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+   char *data = engine->item_get_data(it);
+   memcpy(data, value, nbytes);
+   memcpy(data + nbytes, "\r\n", 2);
+   engine->item_set_cas(it, *cas);
+   ret = engine->store(h, &cookie, it, cas, op);
+   engine->release(h, &cookie, it);
+   return ret;
+}
+
+static ENGINE_ERROR_CODE do_set(const char *key, const char *value) {
+   uint64_t cas = 0;
+   return do_store(OPERATION_SET, key, value, &cas);
+}
+
+/*
+ * Whether key holds value; its cas is put in cas when given.
+ */
+static bool has_value(const char *key, const char *value, uint64_t *cas) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   item *it = NULL;
+
+   if (engine->get(h, &cookie, &it, key, (int)strlen(key)) != ENGINE_SUCCESS) {
+      return false;
+   }
+   size_t nbytes = strlen(value);
+   const char *data = engine->item_get_data(it);
+   bool same = memcmp(data, value, nbytes) == 0 &&
+      memcmp(data + nbytes, "\r\n", 2) == 0;
+   if (cas != NULL) {
+      *cas = engine->item_get_cas(it);
+   }
+   engine->release(h, &cookie, it);
+   return same;
+}
+
+static bool is_missing(const char *key) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   item *it = NULL;
+
+   ENGINE_ERROR_CODE ret = engine->get(h, &cookie, &it, key, (int)strlen(key));
+   if (ret == ENGINE_SUCCESS) {
+      engine->release(h, &cookie, it);
+   }
+   return ret == ENGINE_KEY_ENOENT;
+}
+
+static ENGINE_ERROR_CODE do_arithmetic(const char *key, bool increment,
+                                       bool create, uint64_t delta,
+                                       uint64_t initial, uint64_t *cas,
+                                       uint64_t *result) {
+   return engine->arithmetic((ENGINE_HANDLE *)engine, &cookie, key,
+                             (int)strlen(key), increment, create, delta,
+                             initial, 0, cas, result);
+}
+
+static bool add_response(const void *key, uint16_t keylen,
+                         const void *ext, uint8_t extlen,
+                         const void *body, uint32_t bodylen,
+                         uint8_t UNUSED(datatype), uint16_t status,
+                         uint64_t cas, const void *UNUSED(cookie)) {
+   if (nresponses == MAX_RESPONSES || bodylen > sizeof(responses[0].body)) {
+      return false;
+   }
+   struct response *res = &responses[nresponses++];
+   res->nkey = keylen;
+   res->nextras = extlen;
+   res->nbody = bodylen;
+   if (keylen > 0) {
+      memcpy(res->key, key, keylen);
+   }
+   if (extlen > 0) {
+      memcpy(res->extras, ext, extlen);
+   }
+   if (bodylen > 0) {
+      memcpy(res->body, body, bodylen);
+   }
+   res->status = status;
+   res->cas = cas;
+   return true;
+}
+
+/*
+ * Send a binary command with the given key, extras and body, collecting
+ * the responses. Returns the status of the last one.
+ */
+static uint16_t do_command(uint8_t opcode, const char *key,
+                           const char *extras, const char *body,
+                           size_t nbody, uint64_t cas) {
+   struct {
+      protocol_binary_request_header header;
+      char data[1024];
+   } req;
+   size_t nkey = strlen(key);
+   size_t nextras = strlen(extras);
+
+   memset(&req.header, 0, sizeof(req.header));
+   req.header.request.magic = PROTOCOL_BINARY_REQ;
+   req.header.request.opcode = opcode;
+   req.header.request.keylen = htons((uint16_t)nkey);
+   req.header.request.extlen = (uint8_t)nextras;
+   req.header.request.bodylen = htonl((uint32_t)(nextras + nkey + nbody));
+   req.header.request.cas = ((uint64_t)htonl((uint32_t)cas) << 32) |
+      htonl((uint32_t)(cas >> 32));
+   memcpy(req.data, extras, nextras);
+   memcpy(req.data + nextras, key, nkey);
+   memcpy(req.data + nextras + nkey, body, nbody);
+
+   nresponses = 0;
+   if (engine->unknown_command((ENGINE_HANDLE *)engine, &cookie, &req.header,
+                               add_response) != ENGINE_SUCCESS ||
+       nresponses == 0) {
+      return 0xffff;
+   }
+   return responses[nresponses - 1].status;
+}
+
+/*
+ * A LUAENG_CMD_GET_MULTI body for the given keys.
+ */
+static size_t multi_body(char *body, const char *const *keys, int nkeys) {
+   size_t len = 0;
+   for (int ii = 0; ii < nkeys; ++ii) {
+      uint16_t nkey = htons((uint16_t)strlen(keys[ii]));
+      memcpy(body + len, &nkey, 2);
+      memcpy(body + len + 2, keys[ii], strlen(keys[ii]));
+      len += 2 + strlen(keys[ii]);
+   }
+   return len;
+}
+
+static bool is_response(int idx, const char *key, const char *body) {
+   const struct response *res = &responses[idx];
+   return idx < nresponses && res->nkey == strlen(key) &&
+      memcmp(res->key, key, res->nkey) == 0 && res->nbody == strlen(body) &&
+      memcmp(res->body, body, res->nbody) == 0;
+}
+
+static uint64_t lua_stat_value;
+static const char *lua_stat_name;
+
+static void find_stat(const char *key, const uint16_t klen,
+                      const char *val, const uint32_t vlen,
+                      const void *UNUSED(cookie)) {
+   if (klen == strlen(lua_stat_name) && memcmp(key, lua_stat_name, klen) == 0) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%.*s", (int)vlen, val);
+      lua_stat_value = strtoull(buf, NULL, 10);
+   }
+}
+
+static uint64_t lua_stat(const char *name) {
+   lua_stat_name = name;
+   lua_stat_value = 0;
+   engine->get_stats((ENGINE_HANDLE *)engine, &cookie, "lua", 3, find_stat);
+   return lua_stat_value;
+}
+
+/*
+ * The tests.
+ */
+
+static void test_store_cas(void) {
+   uint64_t cas = 0;
+   uint64_t first, second, got;
+
+   check(do_store(OPERATION_SET, "cas", "one", &cas) == ENGINE_SUCCESS);
+   check(cas != 0);
+   first = cas;
+   check(has_value("cas", "one", &got) && got == first);
+
+   cas = first + 1;
+   check(do_store(OPERATION_CAS, "cas", "bad", &cas) == ENGINE_KEY_EEXISTS);
+   check(has_value("cas", "one", NULL));
+
+   cas = first;
+   check(do_store(OPERATION_CAS, "cas", "two", &cas) == ENGINE_SUCCESS);
+   second = cas;
+   check(second != first);
+   check(has_value("cas", "two", &got) && got == second);
+
+   /* The cas of a replaced item can't be used again */
+   cas = first;
+   check(do_store(OPERATION_CAS, "cas", "three", &cas) == ENGINE_KEY_EEXISTS);
+   check(has_value("cas", "two", NULL));
+
+   cas = second;
+   check(do_store(OPERATION_CAS, "cas:none", "one", &cas) == ENGINE_KEY_ENOENT);
+   check(is_missing("cas:none"));
+
+   cas = 0;
+   check(do_store(OPERATION_ADD, "cas", "add", &cas) == ENGINE_NOT_STORED);
+   check(do_store(OPERATION_REPLACE, "cas:none", "one", &cas) == ENGINE_NOT_STORED);
+   check(is_missing("cas:none"));
+   check(do_store(OPERATION_REPLACE, "cas", "four", &cas) == ENGINE_SUCCESS);
+   check(cas != second);
+   check(has_value("cas", "four", NULL));
+}
+
+static void test_arithmetic_cas(void) {
+   uint64_t cas = 0;
+   uint64_t first, result;
+
+   check(do_arithmetic("ctr", true, false, 1, 0, &cas, &result) == ENGINE_KEY_ENOENT);
+   check(is_missing("ctr"));
+
+   check(do_arithmetic("ctr", true, true, 1, 10, &cas, &result) == ENGINE_SUCCESS);
+   check(result == 10 && cas != 0);
+   first = cas;
+
+   check(do_arithmetic("ctr", true, true, 5, 10, &cas, &result) == ENGINE_SUCCESS);
+   check(result == 15 && cas != first);
+   check(has_value("ctr", "15", NULL));
+
+   /* Arithmetic replaces the item, so its old cas is stale */
+   cas = first;
+   check(do_store(OPERATION_CAS, "ctr", "0", &cas) == ENGINE_KEY_EEXISTS);
+
+   check(do_arithmetic("ctr", false, false, 20, 0, &cas, &result) == ENGINE_SUCCESS);
+   check(result == 0);
+   check(has_value("ctr", "0", NULL));
+
+   check(do_set("ctr:text", "text") == ENGINE_SUCCESS);
+   check(do_arithmetic("ctr:text", true, false, 1, 0, &cas, &result) == ENGINE_EINVAL);
+   check(has_value("ctr:text", "text", NULL));
+}
+
+static void test_flush(void) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   uint64_t cas = 0;
+
+   check(do_set("flush:now", "one") == ENGINE_SUCCESS);
+   check(engine->flush(h, &cookie, 0) == ENGINE_SUCCESS);
+   check(is_missing("flush:now"));
+   check(do_store(OPERATION_ADD, "flush:now", "two", &cas) == ENGINE_SUCCESS);
+   check(has_value("flush:now", "two", NULL));
+
+   /* A flush at a later time leaves the items alone until then */
+   check(do_set("flush:later", "one") == ENGINE_SUCCESS);
+   check(engine->flush(h, &cookie, 10) == ENGINE_SUCCESS);
+   check(has_value("flush:later", "one", NULL));
+   server_advance_time(5);
+   check(has_value("flush:later", "one", NULL));
+   check(do_set("flush:later", "two") == ENGINE_SUCCESS);
+
+   server_advance_time(6);
+   check(is_missing("flush:later"));
+   check(is_missing("flush:now"));
+
+   /* and from then on the store is used as usual */
+   check(do_set("flush:after", "one") == ENGINE_SUCCESS);
+   check(has_value("flush:after", "one", NULL));
+   server_advance_time(10);
+   check(has_value("flush:after", "one", NULL));
+}
+
+/*
+ * Run with a snapshot, then with the snapshot and a journal, which picks
+ * up the snapshot's items, then with the journal alone.
+ */
+static void test_restart(void) {
+   const char *tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+   char snapshot[512], journal[512], config[1100];
+   uint64_t cas, result;
+
+   snprintf(snapshot, sizeof(snapshot), "%s/lua_test.%d.snapshot", tmp,
+            (int)getpid());
+   snprintf(journal, sizeof(journal), "%s/lua_test.%d.journal", tmp,
+            (int)getpid());
+   unlink(snapshot);
+   unlink(journal);
+
+   snprintf(config, sizeof(config), ";snapshot=%s", snapshot);
+   if (!start_engine(config)) {
+      failures++;
+      return;
+   }
+   check(do_set("restart:1", "one") == ENGINE_SUCCESS);
+   check(do_set("restart:2", "two") == ENGINE_SUCCESS);
+   check(do_arithmetic("restart:ctr", true, true, 1, 100, &cas, &result) == ENGINE_SUCCESS);
+   stop_engine();
+   check(access(snapshot, F_OK) == 0);
+
+   snprintf(config, sizeof(config), ";snapshot=%s;journal=%s;journal_sync=always",
+            snapshot, journal);
+   if (!start_engine(config)) {
+      failures++;
+      return;
+   }
+   check(has_value("restart:1", "one", NULL));
+   check(has_value("restart:2", "two", NULL));
+   check(has_value("restart:ctr", "100", NULL));
+   check(do_set("restart:3", "three") == ENGINE_SUCCESS);
+   check(engine->remove((ENGINE_HANDLE *)engine, &cookie, "restart:2", 9, 0) == ENGINE_SUCCESS);
+   check(do_arithmetic("restart:ctr", true, false, 5, 0, &cas, &result) == ENGINE_SUCCESS);
+   stop_engine();
+
+   /* Everything is in the journal, so the snapshot isn't needed */
+   unlink(snapshot);
+   snprintf(config, sizeof(config), ";journal=%s", journal);
+   if (!start_engine(config)) {
+      failures++;
+      return;
+   }
+   check(has_value("restart:1", "one", NULL));
+   check(is_missing("restart:2"));
+   check(has_value("restart:3", "three", NULL));
+   check(has_value("restart:ctr", "105", NULL));
+   stop_engine();
+
+   unlink(snapshot);
+   unlink(journal);
+}
+
+/*
+ * Hooks return one of the memcached.* statuses, nil or true for success,
+ * or false for the hook's own failure; anything else is a failure.
+ */
+static void test_hook_status(void) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   uint64_t cas = 0;
+
+   check(engine->remove(h, &cookie, "status:enoent", 13, 0) == ENGINE_KEY_ENOENT);
+   check(engine->remove(h, &cookie, "status:eexists", 14, 0) == ENGINE_KEY_EEXISTS);
+   check(engine->remove(h, &cookie, "status:true", 11, 0) == ENGINE_SUCCESS);
+   check(engine->remove(h, &cookie, "status:false", 12, 0) == ENGINE_KEY_ENOENT);
+   check(do_store(OPERATION_SET, "status:false", "one", &cas) == ENGINE_NOT_STORED);
+   check(engine->remove(h, &cookie, "status:unknown", 14, 0) == ENGINE_FAILED);
+   check(engine->remove(h, &cookie, "status:fraction", 15, 0) == ENGINE_FAILED);
+   check(engine->remove(h, &cookie, "status:negative", 15, 0) == ENGINE_FAILED);
+
+   check(do_set("status:stored", "one") == ENGINE_SUCCESS);
+   check(engine->remove(h, &cookie, "status:stored", 13, 0) == ENGINE_SUCCESS);
+   check(engine->remove(h, &cookie, "status:stored", 13, 0) == ENGINE_KEY_ENOENT);
+}
+
+static void test_get_multi(void) {
+   static const char *const keys[] = {
+      "multi:1", "multi:missing", "multi:string", "multi:table"
+   };
+   char body[1024];
+   size_t len;
+
+   check(do_set("multi:1", "one") == ENGINE_SUCCESS);
+   len = multi_body(body, keys, 4);
+   check(do_command(LUAENG_CMD_GET_MULTI, "", "", body, len, 0) ==
+         PROTOCOL_BINARY_RESPONSE_SUCCESS);
+   check(nresponses == 4);
+   check(is_response(0, "multi:1", "one"));
+   check(is_response(1, "multi:string", "string"));
+   check(is_response(2, "multi:table", "table"));
+   check(responses[2].cas == 42 && responses[2].nextras == 4 &&
+         memcmp(responses[2].extras, "\0\0\0\7", 4) == 0);
+   check(is_response(3, "", ""));
+
+   /* A malformed result fails the batch */
+   static const char *const bad[] = { "multi:1", "multi:bad" };
+   len = multi_body(body, bad, 2);
+   check(do_command(LUAENG_CMD_GET_MULTI, "", "", body, len, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINVAL);
+   check(nresponses == 1);
+
+   /* and so do keys which are empty, too long or cut short */
+   static const char empty[] = { 0, 0 };
+   check(do_command(LUAENG_CMD_GET_MULTI, "", "", empty, 2, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINVAL);
+   memset(body, 'k', sizeof(body));
+   body[0] = 0;
+   body[1] = (char)251;
+   check(do_command(LUAENG_CMD_GET_MULTI, "", "", body, 253, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINVAL);
+   body[1] = 10;
+   check(do_command(LUAENG_CMD_GET_MULTI, "", "", body, 5, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINVAL);
+   check(do_command(LUAENG_CMD_GET_MULTI, "", "", body, 1, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINVAL);
+   check(nresponses == 1);
+}
+
+static void test_command(void) {
+   check(do_command(0xe0, "key", "ext", "body", 4, 41) ==
+         PROTOCOL_BINARY_RESPONSE_SUCCESS);
+   check(nresponses == 1 && is_response(0, "", "key:body"));
+   check(responses[0].nextras == 3 && memcmp(responses[0].extras, "ext", 3) == 0);
+   check(responses[0].cas == 42);
+
+   check(do_command(0xe2, "status:eexists", "", "", 0, 0) ==
+         PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+   check(do_command(0xe2, "status:unknown", "", "", 0, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINTERNAL);
+   check(do_command(0xe3, "key", "", "", 0, 0) ==
+         PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+
+   /* Outside command_min-command_max the script isn't asked */
+   uint64_t calls = lua_stat("cmd_script");
+   check(do_command(0xf5, "key", "", "", 0, 0) ==
+         PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND);
+   check(lua_stat("cmd_script") == calls);
+}
+
+static void test_budget(void) {
+   ENGINE_HANDLE *h = (ENGINE_HANDLE *)engine;
+   item *it = NULL;
+
+   check(do_set("loop:forever", "one") == ENGINE_SUCCESS);
+   check(do_set("loop:caught", "one") == ENGINE_SUCCESS);
+   check(engine->get(h, &cookie, &it, "loop:forever", 12) == ENGINE_FAILED);
+   check(engine->get(h, &cookie, &it, "loop:caught", 11) == ENGINE_FAILED);
+   check(lua_stat("lua_over_budget") == 2);
+
+   /* The next call starts with a budget of its own */
+   check(do_set("loop:after", "one") == ENGINE_SUCCESS);
+   check(has_value("loop:after", "one", NULL));
+}
+
+/*
+ * Write hooks.lua to path with script_version = version appended, or a
+ * script which doesn't compile for version 0.
+ */
+static bool write_script(const char *path, const char *hooks, int version) {
+   FILE *fp = fopen(path, "w");
+   if (fp == NULL) {
+      return false;
+   }
+   if (version == 0) {
+      fprintf(fp, "function memcached_get(key\n");
+   } else {
+      fprintf(fp, "%s\nscript_version = %d\n", hooks, version);
+   }
+   return fclose(fp) == 0;
+}
+
+static bool has_version(const char *version) {
+   return do_command(0xe1, "", "", "", 0, 0) == PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+      is_response(0, "", version);
+}
+
+/*
+ * Everything but the reload runs on the script as given; the reload on a
+ * copy of it which is rewritten between reloads.
+ */
+static void test_hooks(const char *hooks) {
+   const char *tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+   char path[512], config[1100];
+
+   if (!start_engine(";instruction_limit=100000")) {
+      failures++;
+      return;
+   }
+   test_hook_status();
+   test_get_multi();
+   test_command();
+   test_budget();
+   stop_engine();
+
+   snprintf(path, sizeof(path), "%s/lua_test.%d.lua", tmp, (int)getpid());
+   snprintf(config, sizeof(config), "script=%s", path);
+   if (!write_script(path, hooks, 1) ||
+       (engine = server_create_engine(create, config)) == NULL) {
+      unlink(path);
+      failures++;
+      return;
+   }
+   check(has_version("1"));
+   check(do_set("reload", "one") == ENGINE_SUCCESS);
+
+   check(write_script(path, hooks, 2));
+   check(do_command(LUAENG_CMD_RELOAD, "", "", "", 0, 0) ==
+         PROTOCOL_BINARY_RESPONSE_SUCCESS);
+   check(has_version("2"));
+   check(has_value("reload", "one", NULL));
+
+   /* A script which doesn't compile leaves the running one in place */
+   check(write_script(path, hooks, 0));
+   check(do_command(LUAENG_CMD_RELOAD, "", "", "", 0, 0) ==
+         PROTOCOL_BINARY_RESPONSE_EINVAL);
+   check(has_version("2"));
+   stop_engine();
+   unlink(path);
+}
+
+/*
+ * The whole of a file, NULL if it can't be read.
+ */
+static char *read_file(const char *path) {
+   FILE *fp = fopen(path, "r");
+   if (fp == NULL) {
+      return NULL;
+   }
+   char *data = NULL;
+   size_t len = 0;
+   size_t size = 0;
+   int c;
+   while ((c = fgetc(fp)) != EOF) {
+      if (len + 1 >= size) {
+         size = size == 0 ? 4096 : size * 2;
+         char *grown = realloc(data, size);
+         if (grown == NULL) {
+            break;
+         }
+         data = grown;
+      }
+      data[len++] = (char)c;
+   }
+   fclose(fp);
+   if (data != NULL) {
+      data[len] = '\0';
+   }
+   return data;
+}
+
+static void usage(const char *name) {
+   fprintf(stderr,
+           "Usage: %s [options]\n"
+           "  -e path     engine to load (default %s)\n"
+           "  -s script   script defining no hooks (default %s)\n"
+           "  -k script   run the script tests with t/hooks.lua instead\n",
+           name, DEFAULT_ENGINE, DEFAULT_SCRIPT);
+}
+
+int main(int argc, char **argv) {
+   const char *path = DEFAULT_ENGINE;
+   const char *hooks = NULL;
+   int c;
+
+   while ((c = getopt(argc, argv, "e:s:k:h")) != -1) {
+      switch (c) {
+      case 'e':
+         path = optarg;
+         break;
+      case 's':
+         script = optarg;
+         break;
+      case 'k':
+         hooks = optarg;
+         break;
+      default:
+         usage(argv[0]);
+         return c == 'h' ? 0 : 1;
+      }
+   }
+
+   create = server_load_engine(path);
+   if (create == NULL) {
+      return 1;
+   }
+
+   if (hooks != NULL) {
+      char *data = read_file(hooks);
+      if (data == NULL) {
+         fprintf(stderr, "Failed to read %s\n", hooks);
+         return 1;
+      }
+      script = hooks;
+      test_hooks(data);
+      free(data);
+   } else {
+      if (!start_engine("")) {
+         return 1;
+      }
+      test_store_cas();
+      test_arithmetic_cas();
+      test_flush();
+      stop_engine();
+
+      test_restart();
+   }
+
+   if (failures > 0) {
+      fprintf(stderr, "FAIL: %d checks failed\n", failures);
+      return 1;
+   }
+   printf("All tests passed\n");
+   return 0;
+}
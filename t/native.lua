@@ -0,0 +1,2 @@
+-- Defines no hooks, so every request is handled natively on the store.
+-- Compared with bench.lua this gives the cost of the lua round trip.
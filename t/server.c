@@ -0,0 +1,193 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <memcached/util.h>
+
+#include "server.h"
+
+static time_t process_started;
+static volatile rel_time_t time_offset;
+
+static const char *server_version(void) {
+   return "lua_engine tests";
+}
+
+uint32_t server_hash(const void *key, size_t nkey, uint32_t seed) {
+   const uint8_t *ptr = key;
+   uint32_t h = 2166136261u ^ seed;
+   for (size_t ii = 0; ii < nkey; ++ii) {
+      h = (h ^ ptr[ii]) * 16777619u;
+   }
+   return h;
+}
+
+rel_time_t server_current_time(void) {
+   return (rel_time_t)(time(NULL) - process_started) + time_offset;
+}
+
+void server_advance_time(rel_time_t seconds) {
+   time_offset += seconds;
+}
+
+static rel_time_t realtime(const time_t exptime) {
+   if (exptime == 0) {
+      return 0;
+   }
+   /* Like memcached, anything over 30 days is an absolute time */
+   if (exptime > 60 * 60 * 24 * 30) {
+      time_t started = process_started + time_offset;
+      return exptime <= started ? 1 : (rel_time_t)(exptime - started);
+   }
+   return (rel_time_t)exptime + server_current_time();
+}
+
+static void store_engine_specific(const void *cookie, void *data) {
+   ((struct server_cookie *)cookie)->engine_data = data;
+}
+
+static void *get_engine_specific(const void *cookie) {
+   return ((struct server_cookie *)cookie)->engine_data;
+}
+
+static void notify_io_complete(const void *UNUSED(cookie),
+                               ENGINE_ERROR_CODE UNUSED(status)) {
+}
+
+/*
+ * Parse "key=value;key=value" like memcached does for the -e option.
+ */
+static int parse_engine_config(const char *str, struct config_item items[],
+                               FILE *error) {
+   char *copy = strdup(str);
+   char *save = NULL;
+   int ret = 0;
+
+   if (copy == NULL) {
+      return -1;
+   }
+
+   for (char *tok = strtok_r(copy, ";", &save); tok != NULL;
+        tok = strtok_r(NULL, ";", &save)) {
+      char *val = strchr(tok, '=');
+      if (val == NULL) {
+         fprintf(error, "Invalid entry, key without value: <%s>\n", tok);
+         ret = -1;
+         continue;
+      }
+      *val++ = '\0';
+
+      int ii = 0;
+      while (items[ii].key != NULL && strcmp(items[ii].key, tok) != 0) {
+         ++ii;
+      }
+      if (items[ii].key == NULL) {
+         fprintf(error, "Unsupported key: <%s>\n", tok);
+         ret = 1;
+         continue;
+      }
+
+      char *end;
+      unsigned long long num;
+      switch (items[ii].datatype) {
+      case DT_SIZE:
+         errno = 0;
+         num = strtoull(val, &end, 10);
+         if (errno != 0 || end == val || *end != '\0') {
+            fprintf(error, "Invalid value for %s: <%s>\n", tok, val);
+            ret = -1;
+            continue;
+         }
+         *items[ii].value.dt_size = (size_t)num;
+         break;
+      case DT_FLOAT:
+         *items[ii].value.dt_float = strtof(val, NULL);
+         break;
+      case DT_BOOL:
+         *items[ii].value.dt_bool = strcmp(val, "true") == 0 ||
+            strcmp(val, "on") == 0;
+         break;
+      case DT_STRING:
+         *items[ii].value.dt_string = strdup(val);
+         break;
+      default:
+         fprintf(error, "Unsupported type for %s\n", tok);
+         ret = -1;
+         continue;
+      }
+      items[ii].found = true;
+   }
+
+   free(copy);
+   return ret;
+}
+
+static SERVER_HANDLE_V1 server_api = {
+   .server_version = server_version,
+   .hash = server_hash,
+   .get_current_time = server_current_time,
+   .realtime = realtime,
+   .store_engine_specific = store_engine_specific,
+   .get_engine_specific = get_engine_specific,
+   .notify_io_complete = notify_io_complete,
+   .parse_config = parse_engine_config
+};
+
+static void *get_server_api(int interface) {
+   return interface == 1 ? &server_api : NULL;
+}
+
+CREATE_INSTANCE server_load_engine(const char *path) {
+   if (process_started == 0) {
+      process_started = time(NULL) - 2;
+   }
+
+   void *dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+   if (dl == NULL) {
+      fprintf(stderr, "Failed to load %s: %s\n", path, dlerror());
+      return NULL;
+   }
+   void *sym = dlsym(dl, "create_instance");
+   if (sym == NULL) {
+      fprintf(stderr, "No create_instance in %s\n", path);
+      return NULL;
+   }
+   return (CREATE_INSTANCE)sym;
+}
+
+ENGINE_HANDLE_V1 *server_create_engine(CREATE_INSTANCE create,
+                                       const char *config) {
+   ENGINE_HANDLE *h;
+   if (create(1, get_server_api, &h) != ENGINE_SUCCESS) {
+      fprintf(stderr, "Failed to create the engine\n");
+      return NULL;
+   }
+   if (((ENGINE_HANDLE_V1 *)h)->initialize(h, config) != ENGINE_SUCCESS) {
+      fprintf(stderr, "Failed to initialize the engine with \"%s\"\n",
+              config);
+      ((ENGINE_HANDLE_V1 *)h)->destroy(h);
+      return NULL;
+   }
+   return (ENGINE_HANDLE_V1 *)h;
+}
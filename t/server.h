@@ -0,0 +1,72 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2014 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Summary: The parts of the memcached server API the engine uses, for
+ * the programs which load lua_engine.so the way memcached does.
+ *
+ * The server's clock starts a couple of seconds before the engine is
+ * loaded, and can be moved forward to test expiry without waiting.
+ */
+#ifndef MEMCACHED_LUA_T_SERVER_H
+#define MEMCACHED_LUA_T_SERVER_H
+
+#include "config.h"
+
+#include <memcached/engine.h>
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#elif defined(__LCLINT__)
+# define UNUSED(x) /*@unused@*/ x
+#else
+# define UNUSED(x) x
+#endif
+
+/**
+ * What the engine is given as the cookie of a request. Callers with data
+ * of their own per "connection" put this first in their struct.
+ */
+struct server_cookie {
+   void *engine_data;     // Stored by the engine for this connection.
+};
+
+/**
+ * Load the engine at path, returning its create_instance() or NULL after
+ * printing why it failed.
+ */
+CREATE_INSTANCE server_load_engine(const char *path);
+
+/**
+ * Create and initialize an instance of the engine with the given
+ * configuration, NULL (with a message) if that fails.
+ */
+ENGINE_HANDLE_V1 *server_create_engine(CREATE_INSTANCE create,
+                                       const char *config);
+
+/* FNV-1a, standing in for the server's hash */
+uint32_t server_hash(const void *key, size_t nkey, uint32_t seed);
+
+rel_time_t server_current_time(void);
+
+/**
+ * Move the server's clock forward.
+ */
+void server_advance_time(rel_time_t seconds);
+
+#endif